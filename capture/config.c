@@ -537,9 +537,11 @@ void moloch_config_load()
     config.maxFrags              = moloch_config_int(keyfile, "maxFrags", 10000, 100, 0xffffff);
     config.snapLen               = moloch_config_int(keyfile, "snapLen", 16384, 1, MOLOCH_PACKET_MAX_LEN);
     config.maxMemPercentage      = moloch_config_int(keyfile, "maxMemPercentage", 100, 5, 100);
+    config.memEvictPercentage    = moloch_config_int(keyfile, "memEvictPercentage", config.maxMemPercentage == 100 ? 100 : MAX(config.maxMemPercentage - 5, 5), 5, 100);
     config.maxReqBody            = moloch_config_int(keyfile, "maxReqBody", 256, 0, 0x7fff);
 
     config.packetThreads         = moloch_config_int(keyfile, "packetThreads", 1, 1, MOLOCH_MAX_PACKET_THREADS);
+    config.offlineThreads        = moloch_config_int(keyfile, "offlineThreads", 1, 1, 32);
 
     config.logUnknownProtocols   = moloch_config_boolean(keyfile, "logUnknownProtocols", config.debug);
     config.logESRequests         = moloch_config_boolean(keyfile, "logESRequests", config.debug);
@@ -564,6 +566,8 @@ void moloch_config_load()
     config.autoGenerateId        = moloch_config_boolean(keyfile, "autoGenerateId", FALSE);
     config.enablePacketLen       = moloch_config_boolean(NULL, "enablePacketLen", FALSE);
     config.enablePacketDedup     = moloch_config_boolean(NULL, "enablePacketDedup", FALSE);
+    config.numaPlacement         = moloch_config_boolean(NULL, "numaPlacement", FALSE);
+    config.parserStats           = moloch_config_boolean(NULL, "parserStats", FALSE);
 
     config.maxStreams[SESSION_TCP] = MAX(100, maxStreams/config.packetThreads*1.25);
     config.maxStreams[SESSION_UDP] = MAX(100, maxStreams/config.packetThreads/20);
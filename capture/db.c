@@ -41,6 +41,7 @@ LOCAL  uint16_t         myPid;
 extern uint32_t         pluginsCbs;
 extern uint64_t         writtenBytes;
 extern uint64_t         unwrittenBytes;
+extern int64_t          sessionMemory[MOLOCH_MAX_PACKET_THREADS];
 
 extern int              mac1Field;
 extern int              mac2Field;
@@ -497,11 +498,11 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         return;
 
     /* No Packets */
-    if (!config.dryRun && !session->filePosArray->len)
+    if (!config.dryRun && !session->filePos.count)
         return;
 
     /* Not enough packets */
-    if (session->packets[0] + session->packets[1] < session->minSaving) {
+    if (session->packets[0] + session->packets[1] < session->cold->minSaving) {
         return;
     }
 
@@ -510,7 +511,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     }
 
     /* jsonSize is an estimate of how much space it will take to encode the session */
-    jsonSize = 1300 + session->filePosArray->len*17 + 10*session->fileNumArray->len;
+    jsonSize = 1300 + session->filePos.count*17 + 10*session->fileNumArray->len;
     if (config.enablePacketLen) {
         jsonSize += 10*session->fileLenArray->len;
     }
@@ -522,7 +523,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     }
 
     MOLOCH_THREAD_INCR(totalSessions);
-    session->segments++;
+    session->cold->segments++;
 
     const int thread = session->thread;
 
@@ -576,7 +577,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         }
     }
 
-    if (!config.autoGenerateId || session->rootId == (void *)1L) {
+    if (!config.autoGenerateId || session->cold->rootId == (void *)1L) {
         id_len = snprintf(id, sizeof(id), "%s-", dbInfo[thread].prefix);
 
         uuid_generate(uuid);
@@ -591,8 +592,8 @@ void moloch_db_save_session(MolochSession_t *session, int final)
             else if (id[i] == '/') id[i] = '_';
         }
 
-        if (session->rootId == (void*)1L)
-            session->rootId = g_strdup(id);
+        if (session->cold->rootId == (void*)1L)
+            session->cold->rootId = g_strdup(id);
     }
 
     struct timeval currentTime;
@@ -675,7 +676,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     if (session->firstBytesLen[0] > 0) {
         BSB_EXPORT_cstr(jbsb, "\"srcPayload8\":\"");
         for (i = 0; i < session->firstBytesLen[0]; i++) {
-            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->firstBytes[0][i]], 2);
+            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->cold->firstBytes[0][i]], 2);
         }
         BSB_EXPORT_cstr(jbsb, "\",");
     }
@@ -683,7 +684,7 @@ void moloch_db_save_session(MolochSession_t *session, int final)
     if (session->firstBytesLen[1] > 0) {
         BSB_EXPORT_cstr(jbsb, "\"dstPayload8\":\"");
         for (i = 0; i < session->firstBytesLen[1]; i++) {
-            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->firstBytes[1][i]], 2);
+            BSB_EXPORT_ptr(jbsb, moloch_char_to_hexstr[(unsigned char)session->cold->firstBytes[1][i]], 2);
         }
         BSB_EXPORT_cstr(jbsb, "\",");
     }
@@ -842,45 +843,35 @@ void moloch_db_save_session(MolochSession_t *session, int final)
                       "\"segmentCnt\":%u,"
                       "\"node\":\"%s\",",
                       session->databytes[0] + session->databytes[1],
-                      session->segments,
+                      session->cold->segments,
                       config.nodeName);
 
-    if (session->rootId) {
-        BSB_EXPORT_sprintf(jbsb, "\"rootId\":\"%s\",", session->rootId);
+    if (session->cold->rootId) {
+        BSB_EXPORT_sprintf(jbsb, "\"rootId\":\"%s\",", session->cold->rootId);
     }
     BSB_EXPORT_cstr(jbsb, "\"packetPos\":[");
+    MolochFilePosIter_t posIter;
+    int64_t             fpos, fgap;
+    moloch_filepos_iter_init(&session->filePos, &posIter);
     if (config.gapPacketPos) {
         /* Very simple gap encoding, with a gap the same as previous gap represented as 0.
          * Negative numbers, and numbers after the negative number are not encoded.
-         * This should reduce the saved size by over 50%.
-         * Future work of switching to binary varint with base64 might help more.
+         * The positions are already stored this way, so just print the gaps.
          */
-        int64_t last = 0;
-        int64_t lastgap = 0;
-        for(i = 0; i < session->filePosArray->len; i++) {
+        for(i = 0; moloch_filepos_next(&posIter, &fpos, &fgap); i++) {
             if (i != 0)
                 BSB_EXPORT_u08(jbsb, ',');
-            int64_t fpos = (int64_t)g_array_index(session->filePosArray, int64_t, i);
-            if (fpos < 0) {
-                last = 0;
-                lastgap = 0;
-                BSB_EXPORT_sprintf(jbsb, "%" PRId64, fpos);
-            } else {
-                if (fpos - last == lastgap) {
-                    BSB_EXPORT_u08(jbsb, '0');
-                } else {
-                    lastgap = fpos - last;
-                    BSB_EXPORT_sprintf(jbsb, "%" PRId64, lastgap);
-                }
-                last = fpos;
-            }
+            if (fgap == 0)
+                BSB_EXPORT_u08(jbsb, '0');
+            else
+                BSB_EXPORT_sprintf(jbsb, "%" PRId64, fgap);
         }
     } else {
         // Do NOT remove this, S3 and others use this
-        for(i = 0; i < session->filePosArray->len; i++) {
+        for(i = 0; moloch_filepos_next(&posIter, &fpos, &fgap); i++) {
             if (i != 0)
                 BSB_EXPORT_u08(jbsb, ',');
-            BSB_EXPORT_sprintf(jbsb, "%" PRId64, (int64_t)g_array_index(session->filePosArray, int64_t, i));
+            BSB_EXPORT_sprintf(jbsb, "%" PRId64, fpos);
         }
     }
     BSB_EXPORT_cstr(jbsb, "],");
@@ -1218,6 +1209,9 @@ void moloch_db_save_session(MolochSession_t *session, int final)
         }
         } /* switch */
         if (freeField) {
+            // Give back what the field charged, a mid save keeps the session around
+            session->cold->fieldMemory -= session->fields[pos]->memory;
+            sessionMemory[session->thread] -= session->fields[pos]->memory;
             MOLOCH_TYPE_FREE(MolochField_t, session->fields[pos]);
             session->fields[pos] = 0;
         }
@@ -1504,6 +1498,9 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
     double   memMax = moloch_db_memory_max();
     float    memUse = mem/memMax*100.0;
 
+    if (n == 0)
+        moloch_session_memory_check(memUse);
+
 #ifndef __SANITIZE_ADDRESS__
     if (config.maxMemPercentage != 100 && memUse > config.maxMemPercentage) {
         LOG("Aborting, max memory percentage reached: %.2f > %u", memUse, config.maxMemPercentage);
@@ -1603,6 +1600,11 @@ LOCAL void moloch_db_update_stats(int n, gboolean sync)
         diffms,
         (uint64_t)startTime.tv_sec);
 
+    if (config.parserStats && n == 0 && json_len < MOLOCH_HTTP_BUFFER_SIZE) {
+        json_len--; // Replace the closing brace
+        json_len += moloch_parsers_stats_json(json + json_len, MOLOCH_HTTP_BUFFER_SIZE - json_len);
+    }
+
     lastTime[n]            = currentTime;
     lastBytes[n]           = totalBytes;
     lastWrittenBytes[n]    = writtenBytes;
@@ -21,6 +21,7 @@
 #include "patricia.h"
 
 extern MolochConfig_t        config;
+extern int64_t               sessionMemory[MOLOCH_MAX_PACKET_THREADS];
 
 HASH_VAR(d_, fieldsByDb, MolochFieldInfo_t, 307);
 HASH_VAR(e_, fieldsByExp, MolochFieldInfo_t, 307);
@@ -37,6 +38,10 @@ LOCAL va_list empty_va_list;
 
 #define MOLOCH_FIELD_MAX_ELEMENT_SIZE 16384
 
+// Rough bytes a stored value costs, given back in moloch_field_free or when a mid save frees the field
+#define MOLOCH_FIELD_CHARGE(session, field, size) \
+    ((field)->memory += (size), (session)->cold->fieldMemory += (size), sessionMemory[(session)->thread] += (size))
+
 /******************************************************************************/
 void moloch_field_by_exp_add_special(char *exp, int pos)
 {
@@ -496,7 +501,7 @@ const char *moloch_field_string_add(int pos, MolochSession_t *session, const cha
         return NULL;
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         if (len == -1)
             len = strlen(string);
@@ -595,6 +600,7 @@ const char *moloch_field_string_add(int pos, MolochSession_t *session, const cha
     }
 
 added:
+    MOLOCH_FIELD_CHARGE(session, field, len + 48);
     if (info->ruleEnabled)
       moloch_rules_run_field_set(session, pos, (const gpointer) string);
 
@@ -669,7 +675,7 @@ const char *moloch_field_string_uw_add(int pos, MolochSession_t *session, const
         return NULL;
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         if (len == -1)
             len = strlen(string);
@@ -691,6 +697,7 @@ const char *moloch_field_string_uw_add(int pos, MolochSession_t *session, const
             hstring->utf8 = 0;
             hstring->uw = uw;
             HASH_ADD(s_, *hash, hstring->str, hstring);
+            MOLOCH_FIELD_CHARGE(session, field, len + 48);
             if (info->ruleEnabled)
                 moloch_rules_run_field_set(session, pos, (const gpointer) string);
             return string;
@@ -729,6 +736,7 @@ const char *moloch_field_string_uw_add(int pos, MolochSession_t *session, const
         hstring->utf8 = 0;
         hstring->uw = uw;
         HASH_ADD(s_, *(field->shash), hstring->str, hstring);
+        MOLOCH_FIELD_CHARGE(session, field, len + 48);
         if (info->ruleEnabled)
             moloch_rules_run_field_set(session, pos, (const gpointer) string);
         return string;
@@ -747,7 +755,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
         return FALSE;
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + 10;
         switch (config.fields[pos]->type) {
@@ -803,6 +811,7 @@ gboolean moloch_field_int_add(int pos, MolochSession_t *session, int i)
     }
 
 added:
+    MOLOCH_FIELD_CHARGE(session, field, 16);
     if (config.fields[pos]->ruleEnabled)
       moloch_rules_run_field_set(session, pos, (gpointer)(long)i);
 
@@ -868,7 +877,7 @@ gboolean moloch_field_ip_add_str(int pos, MolochSession_t *session, char *str)
     }
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + len + 100;
         switch (config.fields[pos]->type) {
@@ -903,6 +912,7 @@ gboolean moloch_field_ip_add_str(int pos, MolochSession_t *session, char *str)
     }
 
 added:
+    MOLOCH_FIELD_CHARGE(session, field, 48);
     if (config.fields[pos]->ruleEnabled)
       moloch_rules_run_field_set(session, pos, v);
 
@@ -923,7 +933,7 @@ gboolean moloch_field_ip4_add(int pos, MolochSession_t *session, uint32_t i)
     ((uint32_t *)v->s6_addr)[3] = i;
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + 15 + 100;
         switch (config.fields[pos]->type) {
@@ -958,6 +968,7 @@ gboolean moloch_field_ip4_add(int pos, MolochSession_t *session, uint32_t i)
     }
 
 added:
+    MOLOCH_FIELD_CHARGE(session, field, 48);
     if (config.fields[pos]->ruleEnabled)
       moloch_rules_run_field_set(session, pos, v);
 
@@ -974,7 +985,7 @@ gboolean moloch_field_ip6_add(int pos, MolochSession_t *session, const uint8_t *
     struct in6_addr *v = g_memdup(val, sizeof(struct in6_addr));
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + 30 + 100;
         switch (config.fields[pos]->type) {
@@ -1009,6 +1020,7 @@ gboolean moloch_field_ip6_add(int pos, MolochSession_t *session, const uint8_t *
     }
 
 added:
+    MOLOCH_FIELD_CHARGE(session, field, 48);
     if (config.fields[pos]->ruleEnabled)
       moloch_rules_run_field_set(session, pos, v);
 
@@ -1100,7 +1112,7 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
     MolochCertsInfo_t          *hci;
 
     if (!session->fields[pos]) {
-        field = MOLOCH_TYPE_ALLOC(MolochField_t);
+        field = MOLOCH_TYPE_ALLOC0(MolochField_t);
         session->fields[pos] = field;
         field->jsonSize = 3 + config.fields[pos]->dbFieldLen + 100 + len;
         switch (config.fields[pos]->type) {
@@ -1109,6 +1121,7 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
             HASH_INIT(t_, *hash, moloch_field_certsinfo_hash, moloch_field_certsinfo_cmp);
             field->cihash = hash;
             HASH_ADD(t_, *hash, certs, certs);
+            MOLOCH_FIELD_CHARGE(session, field, 256 + len);
             return TRUE;
         default:
             LOGEXIT("Not a certsinfo %s", config.fields[pos]->dbField);
@@ -1123,6 +1136,7 @@ gboolean moloch_field_certsinfo_add(int pos, MolochSession_t *session, MolochCer
             return FALSE;
         field->jsonSize += 3 + 100 + len;
         HASH_ADD(t_, *(field->cihash), certs, certs);
+        MOLOCH_FIELD_CHARGE(session, field, 256 + len);
         return TRUE;
     default:
         LOGEXIT("Not a certsinfo %s", config.fields[pos]->dbField);
@@ -1208,6 +1222,8 @@ void moloch_field_free(MolochSession_t *session)
     }
     MOLOCH_SIZE_FREE(fields, session->fields);
     session->fields = 0;
+    sessionMemory[session->thread] -= session->cold->fieldMemory;
+    session->cold->fieldMemory = 0;
 }
 /******************************************************************************/
 void moloch_field_certsinfo_free (MolochCertsInfo_t *certs)
@@ -1297,7 +1313,7 @@ void moloch_field_ops_run(MolochSession_t *session, MolochFieldOps_t *ops)
                     moloch_session_add_tag(session, "truncated-pcap");
                 break;
             case MOLOCH_FIELD_SPECIAL_MIN_SAVE:
-                session->minSaving = op->strLenOrInt;
+                session->cold->minSaving = op->strLenOrInt;
                 break;
             case MOLOCH_FIELD_SPECIAL_DROP_SRC:
                 moloch_packet_drophash_add(session, 0, op->strLenOrInt);
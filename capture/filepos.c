@@ -0,0 +1,186 @@
+/******************************************************************************/
+/* filepos.c  -- packet positions of a session, gap and varint encoded
+ *
+ * Copyright 2021 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Positions are kept the way the simple writer index stores them.  A
+ * negative position is a file number and resets the gap, other positions
+ * are the gap from the previous one, 0 if the same as the previous gap.
+ * Each gap is a varint, 7 bits at a time low bits first with the high bit
+ * set on the last byte.
+ *
+ * The encoder never writes a 0 in more than 1 byte, so those are escapes:
+ *   0x00 0x80 <varint>       file number
+ *   0x00 0x00 0x80 <varint>  negative gap
+ *
+ * Bytes live in a list of chunks that double in size up to a page.
+ */
+
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_FILEPOS_FIRST_CHUNK 32
+#define MOLOCH_FILEPOS_MAX_CHUNK   4096
+#define MOLOCH_FILEPOS_MAX_ENCODED 13   // 3 byte escape and 10 byte varint
+
+struct moloch_filepos_chunk {
+    struct moloch_filepos_chunk *next;
+    uint16_t                     size;
+    uint16_t                     len;
+    uint8_t                      data[];
+};
+
+/******************************************************************************/
+int moloch_filepos_varint(uint8_t *buf, uint64_t val)
+{
+    int len = 0;
+
+    while (val > 0x7f) {
+        buf[len++] = val & 0x7f;
+        val >>= 7;
+    }
+    buf[len++] = 0x80 | val;
+    return len;
+}
+/******************************************************************************/
+LOCAL void moloch_filepos_append(MolochFilePos_t *filePos, const uint8_t *buf, int len)
+{
+    MolochFilePosChunk_t *chunk = filePos->tail;
+
+    if (!chunk || chunk->len + len > chunk->size) {
+        int size = chunk ? MIN(chunk->size * 2, MOLOCH_FILEPOS_MAX_CHUNK) : MOLOCH_FILEPOS_FIRST_CHUNK;
+
+        chunk = MOLOCH_SIZE_ALLOC(filepos, sizeof(MolochFilePosChunk_t) + size);
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->len = 0;
+
+        if (filePos->tail)
+            filePos->tail->next = chunk;
+        else
+            filePos->head = chunk;
+        filePos->tail = chunk;
+    }
+
+    memcpy(chunk->data + chunk->len, buf, len);
+    chunk->len += len;
+}
+/******************************************************************************/
+void moloch_filepos_add(MolochFilePos_t *filePos, int64_t pos)
+{
+    uint8_t buf[MOLOCH_FILEPOS_MAX_ENCODED];
+    int     len = 0;
+
+    if (pos < 0) {
+        buf[len++] = 0x00;
+        buf[len++] = 0x80;
+        len += moloch_filepos_varint(buf + len, -pos);
+        filePos->last = 0;
+        filePos->lastgap = 0;
+    } else {
+        int64_t gap = pos - filePos->last;
+        filePos->last = pos;
+
+        if (gap == filePos->lastgap) {
+            buf[len++] = 0x80;
+        } else if (gap > 0) {
+            filePos->lastgap = gap;
+            len += moloch_filepos_varint(buf, gap);
+        } else {
+            filePos->lastgap = gap;
+            buf[len++] = 0x00;
+            buf[len++] = 0x00;
+            buf[len++] = 0x80;
+            len += moloch_filepos_varint(buf + len, -gap);
+        }
+    }
+
+    moloch_filepos_append(filePos, buf, len);
+    filePos->count++;
+}
+/******************************************************************************/
+void moloch_filepos_free(MolochFilePos_t *filePos)
+{
+    MolochFilePosChunk_t *chunk, *next;
+
+    for (chunk = filePos->head; chunk; chunk = next) {
+        next = chunk->next;
+        MOLOCH_SIZE_FREE(filepos, chunk);
+    }
+    memset(filePos, 0, sizeof(*filePos));
+}
+/******************************************************************************/
+void moloch_filepos_iter_init(const MolochFilePos_t *filePos, MolochFilePosIter_t *iter)
+{
+    iter->chunk = filePos->head;
+    iter->offset = 0;
+    iter->last = 0;
+    iter->lastgap = 0;
+}
+/******************************************************************************/
+LOCAL inline uint64_t moloch_filepos_read(const uint8_t *data, uint32_t *offset)
+{
+    uint64_t val = 0;
+    int      shift = 0;
+
+    while (1) {
+        uint8_t b = data[(*offset)++];
+        val |= (uint64_t)(b & 0x7f) << shift;
+        if (b & 0x80)
+            return val;
+        shift += 7;
+    }
+}
+/******************************************************************************/
+/* Returns the next absolute position, negative for a file number, and the
+ * gap it was stored as, 0 when the same as the previous gap.
+ */
+gboolean moloch_filepos_next(MolochFilePosIter_t *iter, int64_t *pos, int64_t *gap)
+{
+    // Entries never span chunks and chunks are never empty
+    if (iter->chunk && iter->offset >= iter->chunk->len) {
+        iter->chunk = iter->chunk->next;
+        iter->offset = 0;
+    }
+
+    if (!iter->chunk)
+        return FALSE;
+
+    uint32_t start = iter->offset;
+    uint64_t val = moloch_filepos_read(iter->chunk->data, &iter->offset);
+
+    if (val == 0 && iter->offset - start == 2) {
+        *pos = *gap = -(int64_t)moloch_filepos_read(iter->chunk->data, &iter->offset);
+        iter->last = 0;
+        iter->lastgap = 0;
+        return TRUE;
+    }
+
+    if (val == 0 && iter->offset - start == 3) {
+        iter->lastgap = -(int64_t)moloch_filepos_read(iter->chunk->data, &iter->offset);
+        *gap = iter->lastgap;
+    } else if (val == 0) {
+        *gap = 0;
+    } else {
+        iter->lastgap = val;
+        *gap = val;
+    }
+
+    iter->last += iter->lastgap;
+    *pos = iter->last;
+    return TRUE;
+}
@@ -438,6 +438,7 @@ LOCAL void moloch_http_curlm_check_multi_info(MolochHttpServer_t *server)
                 MOLOCH_LOCK(requests);
                 server->outstanding--;
                 MOLOCH_UNLOCK(requests);
+                moloch_reader_flow_signal();
             }
         }
     }
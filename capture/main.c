@@ -44,6 +44,7 @@ uint32_t               hashSalt;
 
 extern MolochWriterQueueLength moloch_writer_queue_length;
 extern MolochPcapFileHdr_t     pcapFileHeader;
+extern int                     readerDlt[256];
 
 MOLOCH_LOCK_DEFINE(LOG);
 
@@ -297,7 +298,7 @@ LOCAL void moloch_free_later_init()
 void *moloch_size_alloc(int size, int zero)
 {
     size += 8;
-    void *mem = (zero?g_slice_alloc0(size):g_slice_alloc(size));
+    void *mem = moloch_slab_alloc(size, zero);
     memcpy(mem, &size, 4);
     return (char *)mem + 8;
 }
@@ -308,7 +309,7 @@ int moloch_size_free(void *mem)
     mem = (char *)mem - 8;
 
     memcpy(&size, mem, 4);
-    g_slice_free1(size, mem);
+    moloch_slab_free(size, mem);
     return size - 8;
 }
 /******************************************************************************/
@@ -360,6 +361,88 @@ uint32_t moloch_get_next_powerof2(uint32_t v)
     return v;
 }
 /******************************************************************************/
+/* Pin the calling thread to a single cpu */
+void moloch_thread_set_cpu(int cpu)
+{
+#ifdef __linux
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        LOG("WARNING: Couldn't pin thread to cpu %d - %s", cpu, strerror(errno));
+#else
+    LOG("WARNING: Pinning thread to cpu %d not supported", cpu);
+#endif
+}
+/******************************************************************************/
+/* Numa node the interface's device is attached to, -1 if unknown or the
+ * interface isn't a real device.
+ */
+int moloch_numa_interface_node(const char *interface)
+{
+    char path[PATH_MAX];
+    int  node = -1;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", interface);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    if (fscanf(fp, "%d", &node) != 1)
+        node = -1;
+    fclose(fp);
+    return node;
+}
+/******************************************************************************/
+/* Pin the calling thread to every cpu of a numa node, memory it touches
+ * first after this comes from that node.  Returns 0 on success.
+ */
+int moloch_thread_set_numa_node(int node)
+{
+#ifdef __linux
+    char      path[PATH_MAX];
+    char      line[4096];
+    cpu_set_t set;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        LOG("WARNING: Couldn't read cpus of numa node %d - %s", node, strerror(errno));
+        return 1;
+    }
+    if (!fgets(line, sizeof(line), fp))
+        line[0] = 0;
+    fclose(fp);
+
+    // cpulist is ranges like 0-31,64-95
+    CPU_ZERO(&set);
+    char *p = line;
+    while (*p >= '0' && *p <= '9') {
+        int first = strtol(p, &p, 10);
+        int last = first;
+        if (*p == '-')
+            last = strtol(p + 1, &p, 10);
+        for (; first <= last && first < CPU_SETSIZE; first++)
+            CPU_SET(first, &set);
+        if (*p == ',')
+            p++;
+    }
+
+    if (CPU_COUNT(&set) == 0) {
+        LOG("WARNING: Numa node %d has no cpus", node);
+        return 1;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        LOG("WARNING: Couldn't pin thread to numa node %d - %s", node, strerror(errno));
+        return 1;
+    }
+    return 0;
+#else
+    LOG("WARNING: Pinning thread to numa node %d not supported", node);
+    return 1;
+#endif
+}
+/******************************************************************************/
 unsigned char *moloch_js0n_get(unsigned char *data, uint32_t len, char *key, uint32_t *olen)
 {
     uint32_t key_len = strlen(key);
@@ -766,6 +849,7 @@ LLVMFuzzerInitialize(int *UNUSED(argc), char ***UNUSED(argv))
 
     hashSalt = 0;
     pcapFileHeader.dlt = DLT_EN10MB;
+    readerDlt[0] = DLT_EN10MB;
 
     moloch_free_later_init();
     moloch_hex_init();
@@ -778,6 +862,7 @@ LLVMFuzzerInitialize(int *UNUSED(argc), char ***UNUSED(argv))
     moloch_field_init();
     moloch_http_init();
     moloch_db_init();
+    moloch_timer_init();
     moloch_packet_init();
     moloch_config_load_local_ips();
     moloch_config_load_packet_ips();
@@ -853,6 +938,7 @@ int main(int argc, char **argv)
     moloch_field_init();
     moloch_http_init();
     moloch_db_init();
+    moloch_timer_init();
     moloch_packet_init();
     moloch_config_load_local_ips();
     moloch_config_load_packet_ips();
@@ -56,9 +56,9 @@
 #define SUPPRESS_INT_CONVERSION
 #endif
 
-#define MOLOCH_API_VERSION 230
+#define MOLOCH_API_VERSION 238
 
-#define MOLOCH_SESSIONID_LEN 37
+#define MOLOCH_SESSIONID_LEN 40 // 37 used, rounded up to a uint64_t
 
 #define MOLOCH_V6_TO_V4(_addr) (((uint32_t *)(_addr).s6_addr)[3])
 
@@ -247,6 +247,7 @@ typedef struct {
         struct in6_addr          *ip;
     };
     uint32_t                   jsonSize;
+    uint32_t                   memory;      // What this field charged to sessionMemory
 } MolochField_t;
 
 #define MOLOCH_FIELD_OPS_FLAGS_COPY 0x0001
@@ -283,13 +284,15 @@ typedef struct {
 #define MOLOCH_THREAD_INCROLD(var)       __sync_fetch_and_add(&var, 1);
 #define MOLOCH_THREAD_INCR_NUM(var, num) __sync_add_and_fetch(&var, num);
 
-/* You are probably looking here because you think 24 is too low, really it isn't.
- * Instead, increase the number of threads used for reading packets.
+/* Only a limit, per thread memory is only used for packetThreads threads.
+ * Before raising packetThreads make sure it isn't the readers that are slow.
  * https://arkime.com/faq#why-am-i-dropping-packets
+ * session->thread is a uint8_t so this can't go higher.
  */
-#define MOLOCH_MAX_PACKET_THREADS 24
+#define MOLOCH_MAX_PACKET_THREADS 256
 
 #define MAX_INTERFACES 32
+#define MOLOCH_MAX_NUMA_NODES 8
 
 #ifndef LOCAL
 #define LOCAL static
@@ -388,6 +391,7 @@ typedef struct moloch_config {
     gboolean  trackESP;
     gboolean  noLockPcap;
     gint      pktsToRead;
+    gint      offlineThreads;
 
     GHashTable *override;
 
@@ -451,6 +455,7 @@ typedef struct moloch_config {
     uint32_t  maxFrags;
     uint32_t  snapLen;
     uint32_t  maxMemPercentage;
+    uint32_t  memEvictPercentage;
     uint32_t  maxReqBody;
     int       packetThreads;
 
@@ -480,6 +485,8 @@ typedef struct moloch_config {
     char      enablePacketLen;
     char      gapPacketPos;
     char      enablePacketDedup;
+    char      numaPlacement;
+    char      parserStats;
 } MolochConfig_t;
 
 typedef struct {
@@ -500,16 +507,25 @@ typedef struct {
 struct moloch_session;
 
 #define MOLOCH_PARSER_UNREGISTER -1
+#define MOLOCH_PARSER_STREAM_MAX 0x20000
 typedef int  (* MolochParserFunc) (struct moloch_session *session, void *uw, const unsigned char *data, int remaining, int which);
 typedef void (* MolochParserFreeFunc) (struct moloch_session *session, void *uw);
 typedef void (* MolochParserSaveFunc) (struct moloch_session *session, void *uw, int final);
 
+/* Bytes a stream parser left unconsumed, per direction */
+typedef struct {
+    uint8_t              *buf[2];
+    uint32_t              len[2];
+    uint32_t              size[2];
+} MolochParserStream_t;
+
 typedef struct {
     MolochParserFunc      parserFunc;
     void                 *uw;
     MolochParserFreeFunc  parserFreeFunc;
     MolochParserSaveFunc  parserSaveFunc;
-
+    MolochParserStream_t *stream;
+    int                   statsId;
 } MolochParserInfo_t;
 
 /******************************************************************************/
@@ -547,6 +563,8 @@ typedef struct molochpacket_t
     uint8_t        ipProtocol;     // ip protocol
     uint8_t        mProtocol;      // moloch protocol
     uint8_t        readerPos;      // position for filename/ops
+    uint8_t        zeroCopy:7;     // reader owned buffer, release func id
+    uint8_t        zeroCopyHeld:1; // on the packet thread held list
     uint32_t       ipOffset:11;    // offset to ip header from start
     uint32_t       vpnIpOffset:11; // offset to vpn ip header from start
     uint32_t       direction:1;    // direction of packet
@@ -571,20 +589,28 @@ typedef struct
     uint8_t               readerPos;
 } MolochPacketBatch_t;
 /******************************************************************************/
-typedef struct moloch_tcp_data {
-    struct moloch_tcp_data *td_next, *td_prev;
-
-    MolochPacket_t *packet;
+typedef struct {
+    union {
+        MolochPacket_t          *packet;
+        struct moloch_tcp_chunk *chunk;     // tcpCopyPayload
+    };
     uint32_t        seq;
     uint32_t        ack;
     uint16_t        len;
-    uint16_t        dataOffset;
+    uint16_t        dataOffset;             // into packet->pkt or chunk->data
+    uint32_t        arrival;                // tcpCopyPayload queue order
 } MolochTcpData_t;
 
+/* Queued tcp data for one direction sorted by seq, the queued entries are
+ * tds[start] through tds[start + count - 1].
+ */
 typedef struct {
-    struct moloch_tcp_data *td_next, *td_prev;
-    int td_count;
-} MolochTcpDataHead_t;
+    MolochTcpData_t         *tds;
+    struct moloch_tcp_chunk *chunk;         // Where the next payload is copied
+    uint16_t                 start;
+    uint16_t                 count;
+    uint16_t                 size;
+} MolochTcpDataQ_t;
 
 #define MOLOCH_TCP_STATE_FIN     1
 #define MOLOCH_TCP_STATE_FIN_ACK 2
@@ -604,66 +630,97 @@ typedef enum {
 } MolochSesTcpFlags;
 /******************************************************************************/
 /*
- * SPI Data Storage
+ * timer.c
  */
-typedef struct moloch_session {
-    struct moloch_session *tcp_next, *tcp_prev;
-    struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
-    uint32_t               h_hash;
+struct moloch_timer;
+typedef void (*MolochTimer_cb)(struct moloch_timer *timer, int thread);
 
-    uint8_t                sessionId[MOLOCH_SESSIONID_LEN];
+// The DLL links must be in the same spot as in MolochTimerHead_t
+typedef struct moloch_timer {
+    struct moloch_timer   *tm_next, *tm_prev;
+    MolochTimer_cb         cb;
+    uint32_t               expire;     // In packet seconds
+    int16_t                tm_bucket;
+} MolochTimer_t;
 
-    MolochField_t        **fields;
+typedef struct {
+    struct moloch_timer   *tm_next, *tm_prev;
+    int                    tm_count;
+} MolochTimerHead_t;
 
-    void                  **pluginData;
+void moloch_timer_init();
+void moloch_timer_add(int thread, MolochTimer_t *timer, uint32_t expire, MolochTimer_cb cb);
+void moloch_timer_remove(int thread, MolochTimer_t *timer);
+void moloch_timer_run(int thread, uint32_t now);
+int  moloch_timer_count(int thread);
 
-    MolochParserInfo_t    *parserInfo;
+/******************************************************************************/
+/*
+ * filepos.c
+ */
+typedef struct moloch_filepos_chunk MolochFilePosChunk_t;
 
-    MolochTcpDataHead_t   tcpData;
-    uint32_t              tcpSeq[2];
-    char                  tcpState[2];
+// Packet positions, gap and varint encoded as the simple writer index does
+typedef struct {
+    MolochFilePosChunk_t  *head, *tail;
+    int64_t                last;
+    int64_t                lastgap;
+    uint32_t               count;      // Positions and file numbers added
+} MolochFilePos_t;
 
-    GArray                *filePosArray;
-    GArray                *fileLenArray;
-    GArray                *fileNumArray;
-    char                  *rootId;
+typedef struct {
+    MolochFilePosChunk_t  *chunk;
+    uint32_t               offset;
+    int64_t                last;
+    int64_t                lastgap;
+} MolochFilePosIter_t;
+
+int      moloch_filepos_varint(uint8_t *buf, uint64_t val);
+void     moloch_filepos_add(MolochFilePos_t *filePos, int64_t pos);
+void     moloch_filepos_free(MolochFilePos_t *filePos);
+void     moloch_filepos_iter_init(const MolochFilePos_t *filePos, MolochFilePosIter_t *iter);
+gboolean moloch_filepos_next(MolochFilePosIter_t *iter, int64_t *pos, int64_t *gap);
 
-    struct timeval         firstPacket;
-    struct timeval         lastPacket;
-    struct in6_addr        addr1;
-    struct in6_addr        addr2;
+/******************************************************************************/
+/*
+ * SPI Data Storage
+ */
+
+// Rarely touched, only at session start or save, allocated with the session
+typedef struct moloch_session_cold {
     char                   firstBytes[2][8];
+    char                  *rootId;
+    uint16_t               outstandingQueries;
+    uint16_t               segments;
+    uint8_t                minSaving;
+    uint32_t               fieldMemory; // Charged to sessionMemory by field.c
+} MolochSessionCold_t;
 
+/* The first 2 cache lines are what every packet looks at, then what tcp
+ * and the parsers use.  The DLL links must be in the same spot as in
+ * MolochSessionHead_t.
+ */
+typedef struct moloch_session {
+    struct moloch_session *q_next, *q_prev;
+    uint32_t               h_hash;     // moloch_session_hash of sessionId
+    uint8_t                thread;
+    uint8_t                mProtocol;
+    uint8_t                ipProtocol;
+    uint8_t                parserNum;
+
+    uint8_t                sessionId[MOLOCH_SESSIONID_LEN] __attribute__((aligned(8)));
+
+    struct timeval         lastPacket;
     uint64_t               bytes[2];
     uint64_t               databytes[2];
-    uint64_t               totalDatabytes[2];
-
+    uint32_t               packets[2];
     uint32_t               lastFileNum;
     uint32_t               saveTime;
-    uint32_t               packets[2];
-    uint32_t               synTime;
-    uint32_t               ackTime;
-
     uint16_t               port1;
     uint16_t               port2;
-    uint16_t               outstandingQueries;
-    uint16_t               segments;
     uint16_t               stopSaving;
-    uint16_t               tcpFlagCnt[MOLOCH_TCPFLAG_MAX];
-    uint16_t               maxFields;
-
-    uint8_t                consumed[2];
-    uint8_t                ipProtocol;
-    uint8_t                mProtocol;
     uint8_t                firstBytesLen[2];
-    uint8_t                ip_tos;
-    uint8_t                tcp_flags;
-    uint8_t                parserLen;
-    uint8_t                parserNum;
-    uint8_t                minSaving;
-    uint8_t                thread;
+    uint8_t                consumed[2];
 
     uint16_t               haveTcpSession:1;
     uint16_t               needSave:1;
@@ -678,16 +735,40 @@ typedef struct moloch_session {
     uint16_t               diskOverload:1;
     uint16_t               pq:1;
     uint16_t               synSet:2;
+    uint16_t               inHash:1;
+
+    struct in6_addr        addr1;
+    struct in6_addr        addr2;
+
+    MolochFilePos_t        filePos;
+    GArray                *fileLenArray;
+    GArray                *fileNumArray;
+    MolochParserInfo_t    *parserInfo;
+
+    MolochTcpDataQ_t      tcpData[2];
+    uint32_t              tcpSeq[2];
+    char                  tcpState[2];
+    uint8_t               tcp_flags;
+    uint8_t               ip_tos;
+    uint32_t              synTime;
+    uint32_t              ackTime;
+    uint64_t              totalDatabytes[2];
+    uint16_t              tcpFlagCnt[MOLOCH_TCPFLAG_MAX];
+
+    MolochField_t        **fields;
+    void                 **pluginData;
+    MolochSessionCold_t   *cold;
+    struct timeval         firstPacket;
+    uint16_t               maxFields;
+    uint8_t                parserLen;
+
+    MolochTimer_t          idleTimer;  // Idle and closing timeout
+    MolochTimer_t          saveTimer;  // Long open mid save
 } MolochSession_t;
 
 typedef struct moloch_session_head {
-    struct moloch_session *tcp_next, *tcp_prev;
     struct moloch_session *q_next, *q_prev;
-    struct moloch_session *h_next, *h_prev;
-    int                    h_bucket;
-    int                    tcp_count;
     int                    q_count;
-    int                    h_count;
 } MolochSessionHead_t;
 
 
@@ -700,9 +781,11 @@ typedef struct moloch_session_head {
 #define MOLOCH_SIZE_ALLOC0(name, s) calloc(s, 1)
 #define MOLOCH_SIZE_FREE(name, mem) free(mem)
 #else
-#define MOLOCH_TYPE_ALLOC(type) (type *)(g_slice_alloc(sizeof(type)))
-#define MOLOCH_TYPE_ALLOC0(type) (type *)(g_slice_alloc0(sizeof(type)))
-#define MOLOCH_TYPE_FREE(type,mem) g_slice_free1(sizeof(type),mem)
+void *moloch_slab_alloc(size_t size, int zero);
+void  moloch_slab_free(size_t size, void *mem);
+#define MOLOCH_TYPE_ALLOC(type) (type *)(moloch_slab_alloc(sizeof(type), 0))
+#define MOLOCH_TYPE_ALLOC0(type) (type *)(moloch_slab_alloc(sizeof(type), 1))
+#define MOLOCH_TYPE_FREE(type,mem) moloch_slab_free(sizeof(type),mem)
 
 void *moloch_size_alloc(int size, int zero);
 int   moloch_size_free(void *mem);
@@ -806,6 +889,9 @@ void moloch_quit();
 
 uint32_t moloch_get_next_prime(uint32_t v);
 uint32_t moloch_get_next_powerof2(uint32_t v);
+void moloch_thread_set_cpu(int cpu);
+int moloch_numa_interface_node(const char *interface);
+int moloch_thread_set_numa_node(int node);
 
 
 /******************************************************************************/
@@ -922,6 +1008,36 @@ void  moloch_parsers_unregister(MolochSession_t *session, void *uw);
 void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc);
 #define moloch_parsers_register(session, func, uw, ffunc) moloch_parsers_register2(session, func, uw, ffunc, NULL)
 
+/* Stream parsers are called with everything not yet consumed in that direction
+ * and return how many bytes they used, the rest is handed back next time.
+ */
+void  moloch_parsers_register_stream(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc);
+const uint8_t *moloch_parsers_stream_leftover(MolochSession_t *session, void *uw, int which, int *len);
+int   moloch_parsers_call(MolochSession_t *session, MolochParserInfo_t *info, const uint8_t *data, int len, int which);
+void  moloch_parsers_free_info(MolochSession_t *session, MolochParserInfo_t *info);
+
+/* Per parser call, byte and sampled cycle counts when parserStats is set.
+ * Each packet thread only updates its own counters.
+ */
+#define MOLOCH_PARSER_STATS_MAX 256
+int   moloch_parsers_stats_id(const char *name);
+int   moloch_parsers_stats_start(int thread, int id, int len, uint64_t *start);
+void  moloch_parsers_stats_end(int thread, int id, uint64_t start, int prev);
+int   moloch_parsers_stats_json(char *buf, int size);
+void  moloch_parsers_stats_dump();
+
+#define MOLOCH_PARSER_STATS(thread, id, len, stmt) \
+    do { \
+        if (config.parserStats) { \
+            uint64_t _pstart; \
+            int _pprev = moloch_parsers_stats_start(thread, id, len, &_pstart); \
+            stmt; \
+            moloch_parsers_stats_end(thread, id, _pstart, _pprev); \
+        } else { \
+            stmt; \
+        } \
+    } while (0)
+
 void  moloch_parsers_classifier_register_tcp_internal(const char *name, void *uw, int offset, const unsigned char *match, int matchlen, MolochClassifyFunc func, size_t sessionsize, int apiversion);
 #define moloch_parsers_classifier_register_tcp(name, uw, offset, match, matchlen, func) moloch_parsers_classifier_register_tcp_internal(name, uw, offset, match, matchlen, func, sizeof(MolochSession_t), MOLOCH_API_VERSION)
 
@@ -988,7 +1104,9 @@ char    *moloch_session_id_string (uint8_t *sessionId, char *buf);
 uint32_t moloch_session_hash(const void *key);
 
 MolochSession_t *moloch_session_find(int ses, uint8_t *sessionId);
-MolochSession_t *moloch_session_find_or_create(int mProtocol, uint32_t hash, uint8_t *sessionId, int *isNew);
+MolochSession_t *moloch_session_find_or_create(int thread, int mProtocol, uint32_t hash, uint8_t *sessionId, int *isNew);
+void     moloch_session_prefetch_bucket(int thread, int mProtocol, uint32_t hash);
+void     moloch_session_prefetch_session(int thread, int mProtocol, uint32_t hash);
 
 void     moloch_session_init();
 void     moloch_session_exit();
@@ -996,16 +1114,18 @@ void     moloch_session_add_protocol(MolochSession_t *session, const char *proto
 gboolean moloch_session_has_protocol(MolochSession_t *session, const char *protocol);
 void     moloch_session_add_tag(MolochSession_t *session, const char *tag);
 
-#define  moloch_session_incr_outstanding(session) (session)->outstandingQueries++
+#define  moloch_session_incr_outstanding(session) (session)->cold->outstandingQueries++
 gboolean moloch_session_decr_outstanding(MolochSession_t *session);
 
 void     moloch_session_mark_for_close(MolochSession_t *session, SessionTypes ses);
 
 void     moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec);
+void     moloch_session_long_open(MolochSession_t *session);
 
 int      moloch_session_watch_count(SessionTypes ses);
 int      moloch_session_idle_seconds(SessionTypes ses);
 int      moloch_session_close_outstanding();
+void     moloch_session_memory_check(float memUse);
 
 void     moloch_session_flush();
 void     moloch_session_flush_internal(int thread);
@@ -1042,6 +1162,8 @@ typedef enum {
 
 typedef MolochPacketRC (*MolochPacketEnqueue_cb)(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 
+typedef void (*MolochPacketRelease_cb)(MolochPacket_t * const packet);
+
 typedef int (*MolochPacketSessionId_cb)(uint8_t *sessionId, MolochPacket_t * const packet, const uint8_t *data, int len);
 
 void     moloch_packet_init();
@@ -1065,8 +1187,17 @@ void     moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const
 void     moloch_packet_batch_process(MolochPacketBatch_t * batch, MolochPacket_t * const packet, int thread);
 
 void     moloch_packet_set_dltsnap(int dlt, int snaplen);
+void     moloch_packet_set_reader_dlt(int readerPos, int dlt);
+void     moloch_packet_set_cpu(int thread, int cpu);
+void     moloch_packet_add_producers(int cnt);
+uint32_t moloch_packet_hash_thread(uint32_t hash, int readerPos);
+int      moloch_packet_hash_threads(uint32_t hash, int *threads);
+uint8_t  moloch_packet_zerocopy_register(MolochPacketRelease_cb releaseCb);
+void     moloch_packet_zerocopy_flush();
+void     moloch_packet_free(MolochPacket_t *packet);
 void     moloch_packet_set_linksnap(int linktype, int snaplen); // Don't use, backwards compat
 uint32_t moloch_packet_dlt_to_linktype(int dlt);
+int      moloch_packet_linktype_to_dlt(uint32_t linktype);
 void     moloch_packet_drophash_add(MolochSession_t *session, int which, int min);
 
 void     moloch_packet_save_ethernet(MolochPacket_t * const packet, uint16_t type);
@@ -1308,6 +1439,11 @@ void moloch_readers_start();
 void moloch_readers_add(char *name, MolochReaderInit func);
 void moloch_readers_exit();
 
+gboolean moloch_reader_flow_blocked();
+void moloch_reader_flow_wait();
+void moloch_reader_flow_resume(GSourceFunc func);
+void moloch_reader_flow_signal();
+
 /******************************************************************************/
 /*
  * rules.c
@@ -1324,6 +1460,7 @@ typedef enum {
 
 void moloch_rules_init();
 void moloch_rules_recompile();
+void moloch_rules_add_dlt(int dlt);
 void moloch_rules_run_field_set(MolochSession_t *session, int pos, const gpointer value);
 int moloch_rules_run_every_packet(MolochPacket_t *packet);
 void moloch_rules_session_create(MolochSession_t *session);
@@ -1360,7 +1497,6 @@ typedef struct MolochPQ_t MolochPQ_t;
 MolochPQ_t *moloch_pq_alloc(int maxSeconds, MolochPQ_cb cb);
 void moloch_pq_upsert(MolochPQ_t *pq, MolochSession_t *session, int seconds,  void *uw);
 void moloch_pq_remove(MolochPQ_t *pq, MolochSession_t *session);
-void moloch_pq_run(int thread, int max);
 void moloch_pq_free(MolochSession_t *session);
 void moloch_pq_flush(int thread);
 
@@ -22,6 +22,10 @@
 #include <net/ethernet.h>
 #include <errno.h>
 #include "pcap.h"
+#ifdef __linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 //#define DEBUG_PACKET
 
@@ -54,15 +58,34 @@ LOCAL uint64_t               droppedFrags;
 time_t                       currentTime[MOLOCH_MAX_PACKET_THREADS];
 time_t                       lastPacketSecs[MOLOCH_MAX_PACKET_THREADS];
 LOCAL int                    inProgress[MOLOCH_MAX_PACKET_THREADS];
+LOCAL int                    packetCpu[MOLOCH_MAX_PACKET_THREADS];
+
+// With numaPlacement packet threads run on the numa node of the interfaces,
+// and when the interfaces are on more then one node each reader only sends
+// to the threads on its node
+LOCAL int                    packetNode[MOLOCH_MAX_PACKET_THREADS];
+LOCAL int                    numaNodeCnt;
+LOCAL uint8_t                readerNuma[256];
+LOCAL int                    numaThreads[MOLOCH_MAX_NUMA_NODES][MOLOCH_MAX_PACKET_THREADS];
+LOCAL int                    numaThreadCnt[MOLOCH_MAX_NUMA_NODES];
 
 LOCAL patricia_tree_t       *ipTree4 = 0;
 LOCAL patricia_tree_t       *ipTree6 = 0;
 
 extern MolochFieldOps_t      readerFieldOps[256];
+extern int                   readerDlt[256];
 
 LOCAL MolochPacketEnqueue_cb ethernetCbs[0x10000];
 LOCAL MolochPacketEnqueue_cb ipCbs[MOLOCH_IPPROTO_MAX];
 
+// Readers that hand us their own buffers register how to give them back
+LOCAL MolochPacketRelease_cb zeroCopyCbs[0x80];
+LOCAL int                    zeroCopyCnt = 1;
+LOCAL int                    zeroCopyMaxAge;
+LOCAL uint32_t               zeroCopyMaxQueue;
+LOCAL MolochPacketHead_t     zeroCopyHeld[MOLOCH_MAX_PACKET_THREADS];
+LOCAL volatile uint8_t       zeroCopyFlush[MOLOCH_MAX_PACKET_THREADS];
+
 int                          tcpMProtocol;
 int                          udpMProtocol;
 
@@ -74,24 +97,78 @@ MolochProtocol_t             mProtocols[0x100];
 uint64_t                     packetStats[MOLOCH_PACKET_MAX];
 
 /******************************************************************************/
-LOCAL  MolochPacketHead_t    packetQ[MOLOCH_MAX_PACKET_THREADS];
+/* Each packet thread has a bounded single producer/single consumer ring per
+ * reader thread, so readers never take a lock or contend with each other to
+ * hand off packets.  count is the total across all of a thread's rings and is
+ * what maxPacketsInQueue is checked against, each ring only holds a reader's
+ * share of it.  There is room for every producer the readers said they would
+ * add plus MOLOCH_PACKET_EXTRA_PRODUCERS for readers that don't say.
+ */
+#define MOLOCH_PACKET_EXTRA_PRODUCERS 64
+#define MOLOCH_PACKET_RING_FAIR     64
+#define MOLOCH_PACKET_MIN_SPIN      16
+#define MOLOCH_PACKET_MAX_SPIN      4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MOLOCH_CPU_RELAX()          __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define MOLOCH_CPU_RELAX()          __asm__ __volatile__("yield")
+#else
+#define MOLOCH_CPU_RELAX()          do {} while (0)
+#endif
+
+typedef struct {
+    uint32_t               head;           // only written by the producer
+    uint32_t               mask;
+    MolochPacket_t       **packets;
+    uint32_t               tail __attribute__((aligned(64))); // only written by the consumer
+} MolochPacketRing_t;
+
+typedef struct {
+    MolochPacketRing_t   **rings;
+    uint32_t               count;
+    int                    sleeping;
+    int                    futex;
+    int                    spin;
+    int                    cur;
+    int                    curCnt;
+#ifndef __linux
+    MOLOCH_LOCK_EXTERN(lock);
+    MOLOCH_COND_EXTERN(lock);
+#endif
+} MolochPacketQueue_t;
+
+LOCAL  MolochPacketQueue_t   packetQ[MOLOCH_MAX_PACKET_THREADS];
 LOCAL  uint32_t              overloadDrops[MOLOCH_MAX_PACKET_THREADS];
+LOCAL  int                   numProducers;
+LOCAL  int                   expectedProducers;
+LOCAL  int                   maxProducers;
+LOCAL  __thread int          producerId = -1;
+LOCAL  uint32_t              packetRingSize;
+
+#define MOLOCH_PACKET_MAX_PREFETCH  64
+LOCAL  int                   packetPrefetch;
 
-LOCAL  MOLOCH_LOCK_DEFINE(frags);
 
 LOCAL MolochPacketRC moloch_packet_ip4(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL MolochPacketRC moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL MolochPacketRC moloch_packet_frame_relay(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 LOCAL MolochPacketRC moloch_packet_ether(MolochPacketBatch_t * batch, MolochPacket_t * const packet, const uint8_t *data, int len);
 
+// ip4 keys are src/dst/id, ip6 keys are src/dst/id
+#define MOLOCH_FRAG4_KEY_LEN 10
+#define MOLOCH_FRAG6_KEY_LEN 36
+
 typedef struct molochfrags_t {
     struct molochfrags_t  *fragh_next, *fragh_prev;
     struct molochfrags_t  *fragl_next, *fragl_prev;
     uint32_t               fragh_bucket;
     uint32_t               fragh_hash;
     MolochPacketHead_t     packets;
-    char                   key[10];
+    char                   key[MOLOCH_FRAG6_KEY_LEN];
     uint32_t               secs;
+    uint8_t                slot;
+    char                   v6;
     char                   haveNoFlags;
 } MolochFrags_t;
 
@@ -103,10 +180,47 @@ typedef struct {
     uint32_t               fragl_count;
 } MolochFragsHead_t;
 
-typedef HASH_VAR(h_, MolochFragsHash_t, MolochFragsHead_t, 199337);
+typedef HASHP_VAR(h_, MolochFragsHash_t, MolochFragsHead_t);
+
+// Reassembled packets are built in pooled buffers, power of 2 sizes from 2k
+#define MOLOCH_FRAGS_BUF_MIN_SHIFT 11
+#define MOLOCH_FRAGS_BUF_CLASSES   6
+#define MOLOCH_FRAGS_BUF_KEEP      64
+
+typedef struct molochfragsbuf_t {
+    struct molochfragsbuf_t   *next;
+    struct molochfragsshard_t *shard;
+    uint8_t                    sizeClass;
+    uint8_t                    data[] __attribute__((aligned(8)));
+} MolochFragsBuf_t;
 
-LOCAL MolochFragsHash_t          fragsHash;
-LOCAL MolochFragsHead_t          fragsList;
+// Frags are bucketed by creation time so expiring is a slot at a time
+#define MOLOCH_FRAGS_WHEEL 64
+
+/* Fragments are spread over shards by a hash of their addresses and id, so
+ * all of a packet's fragments meet in the same shard whichever reader thread
+ * they arrived on.  Each shard has its own lock.
+ */
+#define MOLOCH_FRAGS_SHARDS 16
+
+typedef struct molochfragsshard_t {
+    MOLOCH_LOCK_EXTERN(lock);
+    MolochFragsHash_t          hash4;
+    MolochFragsHash_t          hash6;
+    MolochFragsHead_t          wheel[MOLOCH_FRAGS_WHEEL];
+    int64_t                    tick;      // Last expired tick
+    uint8_t                    started;
+    uint32_t                   count;
+    MolochFragsBuf_t          *bufs[MOLOCH_FRAGS_BUF_CLASSES];
+    int                        numBufs[MOLOCH_FRAGS_BUF_CLASSES];
+    MolochFragsBuf_t *volatile returned;  // Freed by packet threads
+} MolochFragsShard_t;
+
+LOCAL MolochFragsShard_t        *fragsShards[MOLOCH_FRAGS_SHARDS];
+LOCAL uint32_t                   fragsMaxPerShard;
+LOCAL int                        fragsTickSecs;
+LOCAL uint32_t                   fragsHashSize;
+LOCAL uint8_t                    fragsZeroCopy;
 
 // These are in network byte order
 LOCAL MolochDropHashGroup_t      packetDrop4;
@@ -120,25 +234,40 @@ LOCAL MolochDropHashGroup_t      packetDrop6;
 void moloch_packet_free(MolochPacket_t *packet)
 {
     if (packet->copied) {
-        free(packet->pkt);
+        MOLOCH_SIZE_FREE(pkt, packet->pkt);
+    } else if (packet->zeroCopy) {
+        if (packet->zeroCopyHeld) {
+            DLL_REMOVE(packet_, &zeroCopyHeld[moloch_packet_hash_thread(packet->hash, packet->readerPos)], packet);
+        }
+        zeroCopyCbs[packet->zeroCopy](packet);
     }
     packet->pkt = 0;
     MOLOCH_TYPE_FREE(MolochPacket_t, packet);
 }
 /******************************************************************************/
+LOCAL void moloch_packet_copy(MolochPacket_t *packet)
+{
+    uint8_t *pkt = MOLOCH_SIZE_ALLOC(pkt, packet->pktlen);
+    memcpy(pkt, packet->pkt, packet->pktlen);
+    if (packet->zeroCopy) {
+        zeroCopyCbs[packet->zeroCopy](packet);
+        packet->zeroCopy = 0;
+        packet->zeroCopyHeld = 0;
+    }
+    packet->pkt = pkt;
+    packet->copied = 1;
+}
+/******************************************************************************/
 void moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, int len, int which)
 {
     int i;
 
     for (i = 0; i < session->parserNum; i++) {
         if (session->parserInfo[i].parserFunc) {
-            int consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data, len, which);
+            int consumed = moloch_parsers_call(session, &session->parserInfo[i], data, len, which);
             if (consumed) {
                 if (consumed == MOLOCH_PARSER_UNREGISTER) {
-                    if (session->parserInfo[i].parserFreeFunc) {
-                        session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
-                    }
-                    memset(&session->parserInfo[i], 0, sizeof(session->parserInfo[i]));
+                    moloch_parsers_free_info(session, &session->parserInfo[i]);
                     continue;
                 }
                 session->consumed[which] += consumed;
@@ -150,11 +279,98 @@ void moloch_packet_process_data(MolochSession_t *session, const uint8_t *data, i
     }
 }
 /******************************************************************************/
+LOCAL void moloch_packet_queue_wake(MolochPacketQueue_t *q)
+{
+    __atomic_add_fetch(&q->futex, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux
+    syscall(SYS_futex, &q->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    MOLOCH_LOCK(q->lock);
+    MOLOCH_COND_SIGNAL(q->lock);
+    MOLOCH_UNLOCK(q->lock);
+#endif
+}
+/******************************************************************************/
+/* Sleep until a producer wakes us or timeout passes.  sleeping is set before
+ * count is checked and producers check sleeping after adding to count, so one
+ * of the two sides always sees the other.
+ */
+LOCAL void moloch_packet_queue_sleep(MolochPacketQueue_t *q, const struct timespec *timeout)
+{
+    int seq = __atomic_load_n(&q->futex, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&q->count, __ATOMIC_SEQ_CST) == 0) {
+#ifdef __linux
+        syscall(SYS_futex, &q->futex, FUTEX_WAIT_PRIVATE, seq, timeout, NULL, 0);
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout->tv_sec;
+        ts.tv_nsec += timeout->tv_nsec;
+        ts.tv_sec += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        MOLOCH_LOCK(q->lock);
+        if (q->futex == seq)
+            MOLOCH_COND_TIMEDWAIT(q->lock, ts);
+        MOLOCH_UNLOCK(q->lock);
+#endif
+    }
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+}
+/******************************************************************************/
+LOCAL MolochPacket_t *moloch_packet_queue_pop(MolochPacketQueue_t *q)
+{
+    int num = __atomic_load_n(&numProducers, __ATOMIC_ACQUIRE);
+    int i;
+
+    if (num == 0)
+        return NULL;
+    if (num > maxProducers)
+        num = maxProducers;
+
+    // Stay on a ring for a little while, but don't let a busy reader starve the others
+    for (i = 0; i <= num; i++) {
+        MolochPacketRing_t *ring = __atomic_load_n(&q->rings[q->cur], __ATOMIC_ACQUIRE);
+        if (ring && q->curCnt < MOLOCH_PACKET_RING_FAIR) {
+            uint32_t tail = ring->tail;
+            if (tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+                MolochPacket_t *packet = ring->packets[tail & ring->mask];
+                __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+                __atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+                q->curCnt++;
+                return packet;
+            }
+        }
+        q->cur = (q->cur + 1) % num;
+        q->curCnt = 0;
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Spin a bit before going to sleep, how long adapts to if spinning has been
+ * finding packets lately.
+ */
+LOCAL MolochPacket_t *moloch_packet_queue_spin(MolochPacketQueue_t *q)
+{
+    int i;
+    for (i = 0; i < q->spin; i++) {
+        MOLOCH_CPU_RELAX();
+        if (__atomic_load_n(&q->count, __ATOMIC_RELAXED) > 0) {
+            MolochPacket_t *packet = moloch_packet_queue_pop(q);
+            if (packet) {
+                q->spin = MIN(q->spin * 2, MOLOCH_PACKET_MAX_SPIN);
+                return packet;
+            }
+        }
+    }
+    q->spin = MAX(q->spin / 2, MOLOCH_PACKET_MIN_SPIN);
+    return NULL;
+}
+/******************************************************************************/
 void moloch_packet_thread_wake(int thread)
 {
-    MOLOCH_LOCK(packetQ[thread].lock);
-    MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-    MOLOCH_UNLOCK(packetQ[thread].lock);
+    moloch_packet_queue_wake(&packetQ[thread]);
 }
 /******************************************************************************/
 /* Only called on main thread, we busy block until all packet threads are empty.
@@ -168,40 +384,35 @@ void moloch_packet_flush()
         flushed = !moloch_session_cmd_outstanding();
 
         for (t = 0; t < config.packetThreads; t++) {
-            MOLOCH_LOCK(packetQ[t].lock);
-            if (DLL_COUNT(packet_, &packetQ[t]) > 0) {
+            if (__atomic_load_n(&packetQ[t].count, __ATOMIC_ACQUIRE) > 0) {
                 flushed = 0;
             }
-            MOLOCH_UNLOCK(packetQ[t].lock);
             usleep(10000);
         }
     }
 }
 /******************************************************************************/
+/* sessionId must already be filled in with createSessionId */
 SUPPRESS_ALIGNMENT
-LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
+LOCAL void moloch_packet_process_id(MolochPacket_t *packet, int thread, uint8_t *sessionId)
 {
 #ifdef DEBUG_PACKET
     LOG("Processing %p %d", packet, packet->pktlen);
 #endif
 
-    lastPacketSecs[thread] = packet->ts.tv_sec;
-
-    moloch_pq_run(thread, 10);
+    // With parallel offline readers files are interleaved, so only let time move forward
+    if (config.offlineThreads == 1 || packet->ts.tv_sec > lastPacketSecs[thread])
+        lastPacketSecs[thread] = packet->ts.tv_sec;
 
     MolochSession_t     *session;
     struct ip           *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
     struct ip6_hdr      *ip6 = (struct ip6_hdr*)(packet->pkt + packet->ipOffset);
-    uint8_t              sessionId[MOLOCH_SESSIONID_LEN];
-
-
-    mProtocols[packet->mProtocol].createSessionId(sessionId, packet);
 
     // Try at most 2 times
     int isNew;
 
     for (int i = 0; i < 2; i++) {
-        session = moloch_session_find_or_create(packet->mProtocol, packet->hash, sessionId, &isNew);
+        session = moloch_session_find_or_create(thread, packet->mProtocol, packet->hash, sessionId, &isNew);
 
         if (isNew) {
             session->saveTime = packet->ts.tv_sec + config.tcpSaveTimeout;
@@ -283,8 +494,7 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
             if (session->lastFileNum != packet->writerFileNum) {
                 session->lastFileNum = packet->writerFileNum;
                 g_array_append_val(session->fileNumArray, packet->writerFileNum);
-                int64_t pos = -1LL * packet->writerFileNum;
-                g_array_append_val(session->filePosArray, pos);
+                moloch_filepos_add(&session->filePos, -1LL * packet->writerFileNum);
 
                 if (config.enablePacketLen) {
                     len = 0;
@@ -292,7 +502,7 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
                 }
             }
 
-            g_array_append_val(session->filePosArray, packet->writerFilePos);
+            moloch_filepos_add(&session->filePos, packet->writerFilePos);
 
             if (config.enablePacketLen) {
                 len = 16 + packet->pktlen;
@@ -316,7 +526,7 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
     if (session->packets[packet->direction] <= 10) {
         const uint8_t *pcapData = packet->pkt;
 
-        if (pcapFileHeader.dlt == DLT_EN10MB) {
+        if (readerDlt[packet->readerPos] == DLT_EN10MB) {
             if (packet->direction == 1) {
                 moloch_field_macoui_add(session, mac1Field, oui1Field, pcapData+0);
                 moloch_field_macoui_add(session, mac2Field, oui2Field, pcapData+6);
@@ -369,6 +579,11 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
 
         if (mProtocols[packet->mProtocol].process(session, packet))
             moloch_packet_free(packet);
+        else if (packet->zeroCopy) {
+            // Held on to, track it so the reader buffer can be copied out if held too long
+            packet->zeroCopyHeld = 1;
+            DLL_PUSH_TAIL(packet_, &zeroCopyHeld[thread], packet);
+        }
 
     } else {
         // No process callback, always free
@@ -377,46 +592,138 @@ LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
     }
 }
 /******************************************************************************/
+LOCAL void moloch_packet_process(MolochPacket_t *packet, int thread)
+{
+    uint8_t              sessionId[MOLOCH_SESSIONID_LEN];
+
+    mProtocols[packet->mProtocol].createSessionId(sessionId, packet);
+    moloch_packet_process_id(packet, thread, sessionId);
+}
+/******************************************************************************/
+/* Packets that point into reader owned buffers and are being held, usually
+ * waiting for tcp reassembly, keep the reader from reusing that buffer.  Once
+ * they are older than zeroCopyMaxAge ms, or a reader has asked for its
+ * buffers back, copy them so the buffer can go back.
+ */
+LOCAL void moloch_packet_zerocopy_expire(int thread)
+{
+    MolochPacket_t *packet;
+    struct timespec ts;
+    int64_t expire;
+
+    if (zeroCopyFlush[thread]) {
+        zeroCopyFlush[thread] = 0;
+        expire = INT64_MAX;
+    } else {
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        expire = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - zeroCopyMaxAge;
+    }
+
+    while ((packet = DLL_PEEK_HEAD(packet_, &zeroCopyHeld[thread])) &&
+           (int64_t)packet->ts.tv_sec * 1000 + packet->ts.tv_usec / 1000 < expire) {
+        DLL_REMOVE(packet_, &zeroCopyHeld[thread], packet);
+        moloch_packet_copy(packet);
+    }
+}
+/******************************************************************************/
 #ifndef FUZZLOCH
+/* Pull up to packetPrefetch packets off the queue and create all their session
+ * ids, then start loading their hash buckets and sessions before processing any
+ * of them, so the session lookups don't each wait on a cache miss.
+ */
+LOCAL void moloch_packet_process_prefetch(MolochPacketQueue_t *q, MolochPacket_t *packet, int thread)
+{
+    MolochPacket_t *packets[MOLOCH_PACKET_MAX_PREFETCH];
+    uint8_t         sessionIds[MOLOCH_PACKET_MAX_PREFETCH][MOLOCH_SESSIONID_LEN];
+    int             cnt = 1;
+    int             i;
+
+    packets[0] = packet;
+    while (cnt < packetPrefetch && (packets[cnt] = moloch_packet_queue_pop(q))) {
+        cnt++;
+    }
+    inProgress[thread] = cnt;
+
+    for (i = 0; i < cnt; i++) {
+        mProtocols[packets[i]->mProtocol].createSessionId(sessionIds[i], packets[i]);
+        moloch_session_prefetch_bucket(thread, packets[i]->mProtocol, packets[i]->hash);
+    }
+
+    for (i = 0; i < cnt; i++) {
+        moloch_session_prefetch_session(thread, packets[i]->mProtocol, packets[i]->hash);
+    }
+
+    for (i = 0; i < cnt; i++) {
+        moloch_packet_process_id(packets[i], thread, sessionIds[i]);
+    }
+}
+/******************************************************************************/
 LOCAL void *moloch_packet_thread(void *threadp)
 {
     int thread = (long)threadp;
     const uint32_t maxPackets75 = config.maxPackets*0.75;
     uint32_t skipCount = 0;
+    uint32_t flowCount = 0;
+
+    MolochPacketQueue_t *q = &packetQ[thread];
+
+    if (packetCpu[thread])
+        moloch_thread_set_cpu(packetCpu[thread] - 1);
+    else if (packetNode[thread])
+        moloch_thread_set_numa_node(packetNode[thread] - 1);
 
     while (1) {
         MolochPacket_t  *packet;
 
-        MOLOCH_LOCK(packetQ[thread].lock);
         inProgress[thread] = 0;
-        if (DLL_COUNT(packet_, &packetQ[thread]) == 0) {
+        // Let a waiting reader know when drained and every 64 packets, not on every packet
+        if (q->count == 0 || (++flowCount & 0x3f) == 0)
+            moloch_reader_flow_signal();
+        packet = moloch_packet_queue_pop(q);
+        if (!packet)
+            packet = moloch_packet_queue_spin(q);
+
+        if (!packet) {
             struct timespec ts;
             clock_gettime(CLOCK_REALTIME_COARSE, &ts);
             currentTime[thread] = ts.tv_sec;
-            ts.tv_sec++;
-            MOLOCH_COND_TIMEDWAIT(packetQ[thread].lock, ts);
+
+            struct timespec timeout = {1, 0};
+            if (DLL_COUNT(packet_, &zeroCopyHeld[thread]) > 0) {
+                timeout.tv_sec = zeroCopyMaxAge / 1000;
+                timeout.tv_nsec = (zeroCopyMaxAge % 1000) * 1000000L;
+            }
+            moloch_packet_queue_sleep(q, &timeout);
 
             /* If we are in live capture mode and we haven't received any packets for 10 seconds we set current time to 10
              * seconds in the past so moloch_session_process_commands will clean things up.  10 seconds is arbitrary but
              * we want to make sure we don't set the time ahead of any packets that are currently being read off the wire
              */
-            if (!config.pcapReadOffline && DLL_COUNT(packet_, &packetQ[thread]) == 0 && ts.tv_sec - 10 > lastPacketSecs[thread]) {
+            clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+            if (!config.pcapReadOffline && q->count == 0 && ts.tv_sec - 10 > lastPacketSecs[thread]) {
                 lastPacketSecs[thread] = ts.tv_sec - 10;
             }
+            packet = moloch_packet_queue_pop(q);
         }
         inProgress[thread] = 1;
-        DLL_POP_HEAD(packet_, &packetQ[thread], packet);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
+
+        if (DLL_COUNT(packet_, &zeroCopyHeld[thread]) > 0)
+            moloch_packet_zerocopy_expire(thread);
+        else if (zeroCopyFlush[thread])
+            zeroCopyFlush[thread] = 0;
 
         // Only process commands if the packetQ is less then 75% full or every 8 packets
-        if (likely(DLL_COUNT(packet_, &packetQ[thread]) < maxPackets75) || (skipCount & 0x7) == 0) {
+        if (likely(q->count < maxPackets75) || (skipCount & 0x7) == 0) {
             moloch_session_process_commands(thread);
             if (!packet)
                 continue;
         } else {
             skipCount++;
         }
-        moloch_packet_process(packet, thread);
+        if (packetPrefetch > 1)
+            moloch_packet_process_prefetch(q, packet, thread);
+        else
+            moloch_packet_process(packet, thread);
     }
 
     return NULL;
@@ -458,65 +765,207 @@ LOCAL void moloch_packet_save_unknown_packet(int type, MolochPacket_t * const pa
 }
 
 /******************************************************************************/
-void moloch_packet_frags_free(MolochFrags_t * const frags)
+SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
+LOCAL uint32_t moloch_packet_frag_hash(const void *key)
+{
+    int i;
+    uint32_t n = 0;
+    for (i = 0; i < MOLOCH_FRAG4_KEY_LEN; i++) {
+        n = (n << 5) - n + ((unsigned char*)key)[i];
+    }
+    return n;
+}
+/******************************************************************************/
+LOCAL int moloch_packet_frag_cmp(const void *keyv, const MolochFrags_t *element)
+{
+    return memcmp(keyv, element->key, MOLOCH_FRAG4_KEY_LEN) == 0;
+}
+/******************************************************************************/
+SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
+LOCAL uint32_t moloch_packet_frag6_hash(const void *key)
+{
+    int i;
+    uint32_t n = 0;
+    for (i = 0; i < MOLOCH_FRAG6_KEY_LEN; i++) {
+        n = (n << 5) - n + ((unsigned char*)key)[i];
+    }
+    return n;
+}
+/******************************************************************************/
+LOCAL int moloch_packet_frag6_cmp(const void *keyv, const MolochFrags_t *element)
+{
+    return memcmp(keyv, element->key, MOLOCH_FRAG6_KEY_LEN) == 0;
+}
+/******************************************************************************/
+/* Called by whichever thread frees the reassembled packet, push the buffer
+ * back on its shard's returned list.
+ */
+LOCAL void moloch_packet_frags_buf_release(MolochPacket_t * const packet)
+{
+    MolochFragsBuf_t *buf = (MolochFragsBuf_t *)(packet->pkt - offsetof(MolochFragsBuf_t, data));
+    MolochFragsShard_t *shard = buf->shard;
+    MolochFragsBuf_t *head;
+
+    do {
+        head = shard->returned;
+        buf->next = head;
+    } while (!__sync_bool_compare_and_swap(&shard->returned, head, buf));
+}
+/******************************************************************************/
+LOCAL uint8_t *moloch_packet_frags_buf_alloc(MolochFragsShard_t *shard, int len)
+{
+    int sizeClass = 0;
+    while ((1 << (MOLOCH_FRAGS_BUF_MIN_SHIFT + sizeClass)) < len)
+        sizeClass++;
+
+    MolochFragsBuf_t *buf = shard->bufs[sizeClass];
+
+    if (!buf && shard->returned) {
+        // Only the shard lock holder takes from returned, so swapping the whole list out is safe
+        MolochFragsBuf_t *next = __sync_lock_test_and_set(&shard->returned, NULL);
+        while ((buf = next)) {
+            next = buf->next;
+            if (shard->numBufs[buf->sizeClass] >= MOLOCH_FRAGS_BUF_KEEP) {
+                free(buf);
+                continue;
+            }
+            buf->next = shard->bufs[buf->sizeClass];
+            shard->bufs[buf->sizeClass] = buf;
+            shard->numBufs[buf->sizeClass]++;
+        }
+        buf = shard->bufs[sizeClass];
+    }
+
+    if (buf) {
+        shard->bufs[sizeClass] = buf->next;
+        shard->numBufs[sizeClass]--;
+    } else {
+        buf = malloc(sizeof(MolochFragsBuf_t) + (1 << (MOLOCH_FRAGS_BUF_MIN_SHIFT + sizeClass)));
+        buf->shard = shard;
+        buf->sizeClass = sizeClass;
+    }
+    return buf->data;
+}
+/******************************************************************************/
+LOCAL void moloch_packet_frags_free(MolochFragsShard_t *shard, MolochFrags_t * const frags)
 {
     MolochPacket_t *packet;
 
+    if (frags->v6)
+        HASH_REMOVE(fragh_, shard->hash6, frags);
+    else
+        HASH_REMOVE(fragh_, shard->hash4, frags);
+
     while (DLL_POP_HEAD(packet_, &frags->packets, packet)) {
         moloch_packet_free(packet);
     }
-    HASH_REMOVE(fragh_, fragsHash, frags);
-    DLL_REMOVE(fragl_, &fragsList, frags);
+    DLL_REMOVE(fragl_, &shard->wheel[frags->slot], frags);
+    shard->count--;
     MOLOCH_TYPE_FREE(MolochFrags_t, frags);
 }
 /******************************************************************************/
+/* Byte offset of a fragment's data and if more fragments follow it.  For ip6
+ * payloadOffset is just past the fragment header.
+ */
 SUPPRESS_ALIGNMENT
-LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
+LOCAL inline int moloch_packet_frag_offset(const MolochPacket_t * const packet, int *more)
+{
+    uint16_t off;
+
+    if (packet->v6) {
+        const uint8_t *fraghdr = packet->pkt + packet->payloadOffset - 8;
+        off = fraghdr[2] << 8 | fraghdr[3];
+        *more = off & 0x0001;
+        return off & 0xfff8;
+    }
+
+    const struct ip *ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    off = ntohs(ip4->ip_off);
+    *more = (off & IP_MF) != 0;
+    return (off & IP_OFFMASK) * 8;
+}
+/******************************************************************************/
+/* Free all the frags created in ticks that are now older than fragsTimeout,
+ * or if over this shard's share of maxFrags the oldest ones.  Shard must be
+ * locked.
+ */
+LOCAL void moloch_packet_frags_expire(MolochFragsShard_t *shard, int64_t secs)
+{
+    MolochFrags_t *frags;
+    int64_t        expireTick = (secs - config.fragsTimeout) / fragsTickSecs - 1;
+    int64_t        t;
+
+    if (!shard->started) {
+        shard->tick = expireTick;
+        shard->started = 1;
+        return;
+    }
+
+    for (t = shard->tick + 1; t <= expireTick && t <= shard->tick + MOLOCH_FRAGS_WHEEL; t++) {
+        while ((frags = DLL_PEEK_HEAD(fragl_, &shard->wheel[t % MOLOCH_FRAGS_WHEEL]))) {
+            MOLOCH_THREAD_INCR(droppedFrags);
+            moloch_packet_frags_free(shard, frags);
+        }
+    }
+    if (expireTick > shard->tick)
+        shard->tick = expireTick;
+
+    for (t = shard->tick + 1; shard->count >= fragsMaxPerShard; t++) {
+        while (shard->count >= fragsMaxPerShard && (frags = DLL_PEEK_HEAD(fragl_, &shard->wheel[t % MOLOCH_FRAGS_WHEEL]))) {
+            MOLOCH_THREAD_INCR(droppedFrags);
+            moloch_packet_frags_free(shard, frags);
+        }
+    }
+}
+/******************************************************************************/
+/* Add a fragment to its shard, once all the fragments have arrived the
+ * packet is rebuilt in a pooled buffer and TRUE is returned.  nxtOffset is
+ * where the ip6 next header that pointed at the fragment header is.
+ */
+SUPPRESS_ALIGNMENT
+LOCAL gboolean moloch_packet_frags_process(MolochFragsShard_t *shard, MolochPacket_t * const packet, const char *key, int nxtOffset)
 {
     MolochPacket_t * fpacket;
     MolochFrags_t   *frags;
-    char             key[10];
+    int              more;
 
-    struct ip * const ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
-    memcpy(key, &ip4->ip_src.s_addr, 4);
-    memcpy(key+4, &ip4->ip_dst.s_addr, 4);
-    memcpy(key+8, &ip4->ip_id, 2);
-
-    HASH_FIND(fragh_, fragsHash, key, frags);
+    if (packet->v6)
+        HASH_FIND(fragh_, shard->hash6, key, frags);
+    else
+        HASH_FIND(fragh_, shard->hash4, key, frags);
 
     if (!frags) {
+        moloch_packet_frags_expire(shard, packet->ts.tv_sec);
+
         frags = MOLOCH_TYPE_ALLOC0(MolochFrags_t);
-        memcpy(frags->key, key, 10);
+        memcpy(frags->key, key, packet->v6?MOLOCH_FRAG6_KEY_LEN:MOLOCH_FRAG4_KEY_LEN);
         frags->secs = packet->ts.tv_sec;
-        HASH_ADD(fragh_, fragsHash, key, frags);
-        DLL_PUSH_TAIL(fragl_, &fragsList, frags);
+        frags->v6 = packet->v6;
+
+        // Old timestamps go in the next slot to expire
+        frags->slot = MAX(frags->secs / fragsTickSecs, shard->tick + 1) % MOLOCH_FRAGS_WHEEL;
+
+        if (packet->v6)
+            HASH_ADD(fragh_, shard->hash6, key, frags);
+        else
+            HASH_ADD(fragh_, shard->hash4, key, frags);
+        DLL_PUSH_TAIL(fragl_, &shard->wheel[frags->slot], frags);
+        shard->count++;
         DLL_INIT(packet_, &frags->packets);
         DLL_PUSH_TAIL(packet_, &frags->packets, packet);
-
-        if (DLL_COUNT(fragl_, &fragsList) > config.maxFrags) {
-            droppedFrags++;
-            moloch_packet_frags_free(DLL_PEEK_HEAD(fragl_, &fragsList));
-        }
         return FALSE;
-    } else {
-        DLL_MOVE_TAIL(fragl_, &fragsList, frags);
     }
 
-    uint16_t          ip_off = ntohs(ip4->ip_off);
-    uint16_t          ip_flags = ip_off & ~IP_OFFMASK;
-    ip_off &= IP_OFFMASK;
-
+    int off = moloch_packet_frag_offset(packet, &more);
 
-    // we might be done once we receive the packets with no flags
-    if (ip_flags == 0) {
+    // we might be done once we receive the last packet
+    if (!more) {
         frags->haveNoFlags = 1;
     }
 
     // Insert this packet in correct location sorted by offset
     DLL_FOREACH_REVERSE(packet_, &frags->packets, fpacket) {
-        struct ip *fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
-        if (ip_off >= fip_off) {
+        if (off >= moloch_packet_frag_offset(fpacket, &more)) {
             DLL_ADD_AFTER(packet_, &frags->packets, fpacket, packet);
             break;
         }
@@ -525,99 +974,165 @@ LOCAL gboolean moloch_packet_frags_process(MolochPacket_t * const packet)
         DLL_PUSH_HEAD(packet_, &frags->packets, packet);
     }
 
-    // Don't bother checking until we get a packet with no flags
+    // Don't bother checking until we get the last packet
     if (!frags->haveNoFlags) {
         return FALSE;
     }
 
-    int off = 0;
-    struct ip *fip4;
+    off = 0;
 
     int payloadLen = 0;
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
+        int fip_off = moloch_packet_frag_offset(fpacket, &more);
         if (fip_off != off)
             break;
-        off += fpacket->payloadLen/8;
-        payloadLen = MAX(payloadLen, fip_off*8 + fpacket->payloadLen);
+        off += fpacket->payloadLen & ~7;
+        payloadLen = MAX(payloadLen, fip_off + fpacket->payloadLen);
     }
     // We have a hole
     if ((void*)fpacket != (void*)&frags->packets) {
         return FALSE;
     }
 
+    // The ip6 fragment header isn't part of the rebuilt packet
+    const int hdrLen = packet->v6?packet->payloadOffset - 8:packet->payloadOffset;
+
     // Packet is too large, hacker
-    if (payloadLen + packet->payloadOffset >= MOLOCH_PACKET_MAX_LEN) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+    if (payloadLen + hdrLen >= MOLOCH_PACKET_MAX_LEN) {
+        MOLOCH_THREAD_INCR(droppedFrags);
+        moloch_packet_frags_free(shard, frags);
         return FALSE;
     }
 
-    // Now alloc the full packet
-    packet->pktlen = packet->payloadOffset + payloadLen;
-    uint8_t *pkt = malloc(packet->pktlen);
+    // Now get a buffer for the full packet
+    packet->pktlen = hdrLen + payloadLen;
+    uint8_t *pkt = moloch_packet_frags_buf_alloc(shard, packet->pktlen);
 
     // Copy packet header
-    memcpy(pkt, packet->pkt, packet->payloadOffset);
+    memcpy(pkt, packet->pkt, hdrLen);
 
     // Fix header of new packet
-    fip4 = (struct ip*)(pkt + packet->ipOffset);
-    fip4->ip_len = htons(payloadLen + 4*ip4->ip_hl);
-    fip4->ip_off = 0;
+    if (packet->v6) {
+        struct ip6_hdr *fip6 = (struct ip6_hdr*)(pkt + packet->ipOffset);
+        fip6->ip6_plen = htons(hdrLen - packet->ipOffset - sizeof(struct ip6_hdr) + payloadLen);
+        pkt[nxtOffset] = packet->pkt[packet->payloadOffset - 8];
+    } else {
+        struct ip *fip4 = (struct ip*)(pkt + packet->ipOffset);
+        fip4->ip_len = htons(payloadLen + 4*fip4->ip_hl);
+        fip4->ip_off = 0;
+    }
 
     // Copy payload
     DLL_FOREACH(packet_, &frags->packets, fpacket) {
-        fip4 = (struct ip*)(fpacket->pkt + fpacket->ipOffset);
-        uint16_t fip_off = ntohs(fip4->ip_off) & IP_OFFMASK;
+        int fip_off = moloch_packet_frag_offset(fpacket, &more);
 
-        if (packet->payloadOffset+(fip_off*8) + fpacket->payloadLen <= packet->pktlen)
-            memcpy(pkt+packet->payloadOffset+(fip_off*8), fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
+        if (hdrLen + fip_off + fpacket->payloadLen <= packet->pktlen)
+            memcpy(pkt + hdrLen + fip_off, fpacket->pkt+fpacket->payloadOffset, fpacket->payloadLen);
         else
-            LOG("WARNING - Not enough room for frag %d > %d", packet->payloadOffset+(fip_off*8) + fpacket->payloadLen, packet->pktlen);
+            LOG("WARNING - Not enough room for frag %d > %d", hdrLen + fip_off + fpacket->payloadLen, packet->pktlen);
     }
 
     // Set all the vars in the current packet to new defraged packet
+    DLL_REMOVE(packet_, &frags->packets, packet); // Remove from list so we don't get freed in frags_free
+    moloch_packet_frags_free(shard, frags);
+
     if (packet->copied)
-        free(packet->pkt);
+        MOLOCH_SIZE_FREE(pkt, packet->pkt);
+    else if (packet->zeroCopy)
+        zeroCopyCbs[packet->zeroCopy](packet);
     packet->pkt = pkt;
-    packet->copied = 1;
+    packet->copied = 0;
+    packet->zeroCopy = fragsZeroCopy;
+    packet->zeroCopyHeld = 0;
     packet->wasfrag = 1;
+    packet->payloadOffset = hdrLen;
     packet->payloadLen = payloadLen;
-    DLL_REMOVE(packet_, &frags->packets, packet); // Remove from list so we don't get freed in frags_free
-    moloch_packet_frags_free(frags);
     return TRUE;
 }
 /******************************************************************************/
+LOCAL MolochFragsShard_t *moloch_packet_frags_shard(uint32_t hash)
+{
+    MolochFragsShard_t *shard = fragsShards[hash % MOLOCH_FRAGS_SHARDS];
+    MOLOCH_LOCK(shard->lock);
+    return shard;
+}
+/******************************************************************************/
+/* Shards only expire as fragments arrive, so every tick expire them all using
+ * the newest packet time any packet thread has seen.
+ */
+LOCAL gboolean moloch_packet_frags_gfunc(gpointer UNUSED(user_data))
+{
+    int64_t secs = 0;
+    int     t;
+
+    for (t = 0; t < config.packetThreads; t++) {
+        secs = MAX(secs, (int64_t)lastPacketSecs[t]);
+    }
+    if (!secs)
+        return G_SOURCE_CONTINUE;
+
+    for (t = 0; t < MOLOCH_FRAGS_SHARDS; t++) {
+        MOLOCH_LOCK(fragsShards[t]->lock);
+        if (fragsShards[t]->count)
+            moloch_packet_frags_expire(fragsShards[t], secs);
+        MOLOCH_UNLOCK(fragsShards[t]->lock);
+    }
+    return G_SOURCE_CONTINUE;
+}
+/******************************************************************************/
+SUPPRESS_ALIGNMENT
 LOCAL void moloch_packet_frags4(MolochPacketBatch_t *batch, MolochPacket_t * const packet)
 {
-    MolochFrags_t *frags;
+    char key[MOLOCH_FRAG4_KEY_LEN];
 
     // ALW - Should change frags_process to make the copy when needed
     if (!packet->copied) {
-        uint8_t *pkt = malloc(packet->pktlen);
-        memcpy(pkt, packet->pkt, packet->pktlen);
-        packet->pkt = pkt;
-        packet->copied = 1;
+        moloch_packet_copy(packet);
     }
 
-    MOLOCH_LOCK(frags);
-    // Remove expired entries
-    while ((frags = DLL_PEEK_HEAD(fragl_, &fragsList)) && (frags->secs + config.fragsTimeout < packet->ts.tv_sec)) {
-        droppedFrags++;
-        moloch_packet_frags_free(frags);
+    struct ip * const ip4 = (struct ip*)(packet->pkt + packet->ipOffset);
+    memcpy(key, &ip4->ip_src.s_addr, 4);
+    memcpy(key+4, &ip4->ip_dst.s_addr, 4);
+    memcpy(key+8, &ip4->ip_id, 2);
+
+    MolochFragsShard_t *shard = moloch_packet_frags_shard(moloch_packet_frag_hash(key));
+    gboolean done = moloch_packet_frags_process(shard, packet, key, 0);
+    MOLOCH_UNLOCK(shard->lock);
+
+    if (done)
+        moloch_packet_batch(batch, packet);
+}
+/******************************************************************************/
+LOCAL void moloch_packet_frags6(MolochPacketBatch_t *batch, MolochPacket_t * const packet, int nxtOffset)
+{
+    char key[MOLOCH_FRAG6_KEY_LEN];
+
+    if (!packet->copied) {
+        moloch_packet_copy(packet);
     }
 
-    gboolean process = moloch_packet_frags_process(packet);
-    MOLOCH_UNLOCK(frags);
+    struct ip6_hdr * const ip6 = (struct ip6_hdr*)(packet->pkt + packet->ipOffset);
+    memcpy(key, &ip6->ip6_src, 16);
+    memcpy(key+16, &ip6->ip6_dst, 16);
+    memcpy(key+32, packet->pkt + packet->payloadOffset - 4, 4);
+
+    MolochFragsShard_t *shard = moloch_packet_frags_shard(moloch_packet_frag6_hash(key));
+    gboolean done = moloch_packet_frags_process(shard, packet, key, nxtOffset);
+    MOLOCH_UNLOCK(shard->lock);
 
-    if (process)
+    if (done)
         moloch_packet_batch(batch, packet);
 }
 /******************************************************************************/
 int moloch_packet_frags_size()
 {
-    return DLL_COUNT(fragl_, &fragsList);
+    int t;
+    int size = 0;
+
+    for (t = 0; t < MOLOCH_FRAGS_SHARDS; t++) {
+        size += fragsShards[t]->count;
+    }
+    return size;
 }
 /******************************************************************************/
 int moloch_packet_frags_outstanding()
@@ -927,6 +1442,7 @@ LOCAL MolochPacketRC moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket
     LOG("Got ip6 header %p %d", packet, packet->pktlen);
 #endif
     int nxt = ip6->ip6_nxt;
+    int nxtOffset = offsetof(struct ip6_hdr, ip6_nxt); // Where nxt came from, for fragments
     int done = 0;
     do {
         packet->ipProtocol = nxt;
@@ -942,6 +1458,7 @@ LOCAL MolochPacketRC moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket
                 return MOLOCH_PACKET_CORRUPT;
             }
             nxt = data[ip_hdr_len];
+            nxtOffset = ip_hdr_len;
             ip_hdr_len += ((data[ip_hdr_len+1] + 1) << 3);
 
             packet->payloadOffset = packet->ipOffset + ip_hdr_len;
@@ -963,10 +1480,25 @@ LOCAL MolochPacketRC moloch_packet_ip6(MolochPacketBatch_t * batch, MolochPacket
 
             break;
         case IPPROTO_FRAGMENT:
+            if (len < ip_hdr_len + 8 || ip_len + (int)sizeof(struct ip6_hdr) < ip_hdr_len + 8) {
 #ifdef DEBUG_PACKET
-            LOG("ERROR - Don't support ip6 fragements yet!");
+                LOG("ERROR - %d < %d + 8", len, ip_hdr_len);
 #endif
-            return MOLOCH_PACKET_UNKNOWN;
+                return MOLOCH_PACKET_CORRUPT;
+            }
+            // nxtOffset stays on the field that pointed at this header, it gets this header's nxt when rebuilt
+            nxt = data[ip_hdr_len];
+            ip_hdr_len += 8;
+
+            packet->payloadOffset = packet->ipOffset + ip_hdr_len;
+            packet->payloadLen = ip_len + sizeof(struct ip6_hdr) - ip_hdr_len;
+
+            // Atomic fragment, offset 0 and no more, just skip the header
+            if (((data[ip_hdr_len-6] << 8 | data[ip_hdr_len-5]) & 0xfff9) == 0)
+                break;
+
+            moloch_packet_frags6(batch, packet, packet->ipOffset + nxtOffset);
+            return MOLOCH_PACKET_DONT_PROCESS_OR_FREE;
 
         case IPPROTO_TCP:
             if (len < ip_hdr_len + (int)sizeof(struct tcphdr)) {
@@ -1195,17 +1727,63 @@ void moloch_packet_batch_init(MolochPacketBatch_t *batch)
     batch->count = 0;
 }
 /******************************************************************************/
+LOCAL void moloch_packet_overload_drop(uint32_t thread, MolochPacket_t * const packet)
+{
+    uint32_t drops = MOLOCH_THREAD_INCRNEW(overloadDrops[thread]);
+    if ((drops % 10000) == 1) {
+        LOG("WARNING - Packet Q %u is overflowing, total dropped so far %u.  See https://arkime.com/faq#why-am-i-dropping-packets and modify %s", thread, drops, config.configFile);
+    }
+    MOLOCH_THREAD_INCR(packetStats[MOLOCH_PACKET_OVERLOAD_DROPPED]);
+    moloch_packet_free(packet);
+}
+/******************************************************************************/
+/* Find or create the ring from the calling reader thread to a packet thread */
+LOCAL MolochPacketRing_t *moloch_packet_ring(int thread)
+{
+    if (unlikely(producerId == -1)) {
+        producerId = MOLOCH_THREAD_INCROLD(numProducers);
+        if (producerId >= maxProducers)
+            LOGEXIT("ERROR - More then %d threads adding packets", maxProducers);
+    }
+
+    MolochPacketRing_t *ring = packetQ[thread].rings[producerId];
+    if (unlikely(!ring)) {
+        ring = MOLOCH_TYPE_ALLOC0(MolochPacketRing_t);
+        ring->mask = packetRingSize - 1;
+        ring->packets = malloc(packetRingSize * sizeof(MolochPacket_t *));
+        __atomic_store_n(&packetQ[thread].rings[producerId], ring, __ATOMIC_RELEASE);
+    }
+    return ring;
+}
+/******************************************************************************/
 void moloch_packet_batch_flush(MolochPacketBatch_t *batch)
 {
+    MolochPacket_t *packet;
     int t;
 
     for (t = 0; t < config.packetThreads; t++) {
-        if (DLL_COUNT(packet_, &batch->packetQ[t]) > 0) {
-            MOLOCH_LOCK(packetQ[t].lock);
-            DLL_PUSH_TAIL_DLL(packet_, &packetQ[t], &batch->packetQ[t]);
-            MOLOCH_COND_SIGNAL(packetQ[t].lock);
-            MOLOCH_UNLOCK(packetQ[t].lock);
+        if (DLL_COUNT(packet_, &batch->packetQ[t]) == 0)
+            continue;
+
+        MolochPacketRing_t *ring = moloch_packet_ring(t);
+        uint32_t head = ring->head;
+        uint32_t space = packetRingSize - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+        uint32_t cnt = 0;
+
+        while (DLL_POP_HEAD(packet_, &batch->packetQ[t], packet)) {
+            if (unlikely(cnt == space)) {
+                moloch_packet_overload_drop(t, packet);
+                continue;
+            }
+            ring->packets[(head + cnt) & ring->mask] = packet;
+            cnt++;
         }
+
+        // Count first, so the consumer can't take them off count before they are on it
+        __atomic_add_fetch(&packetQ[t].count, cnt, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&ring->head, head + cnt, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&packetQ[t].sleeping, __ATOMIC_SEQ_CST))
+            moloch_packet_queue_wake(&packetQ[t]);
     }
     batch->count = 0;
 }
@@ -1213,13 +1791,14 @@ void moloch_packet_batch_flush(MolochPacketBatch_t *batch)
 void moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const packet)
 {
     MolochPacketRC rc;
+    const int dlt = readerDlt[packet->readerPos];
 
 #ifdef DEBUG_PACKET
-    LOG("enter %p %u %d", packet, pcapFileHeader.dlt, packet->pktlen);
+    LOG("enter %p %u %d", packet, dlt, packet->pktlen);
     moloch_print_hex_string(packet->pkt, packet->pktlen);
 #endif
 
-    switch(pcapFileHeader.dlt) {
+    switch(dlt) {
     case DLT_NULL: // NULL
         if (packet->pktlen > 4) {
             if (packet->pkt[0] == 30)
@@ -1267,7 +1846,7 @@ void moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const pac
         if (config.ignoreErrors)
             rc = MOLOCH_PACKET_CORRUPT;
         else
-            LOGEXIT("ERROR - Unsupported pcap link type %u", pcapFileHeader.dlt);
+            LOGEXIT("ERROR - Unsupported pcap link type %u", dlt);
     }
 
     if (likely(rc == MOLOCH_PACKET_DO_PROCESS) && unlikely(packet->mProtocol == 0)) {
@@ -1313,29 +1892,19 @@ void moloch_packet_batch(MolochPacketBatch_t * batch, MolochPacket_t * const pac
         moloch_packet_log(mProtocols[packet->mProtocol].ses);
     }
 
-    uint32_t thread = packet->hash % config.packetThreads;
+    uint32_t thread = moloch_packet_hash_thread(packet->hash, packet->readerPos);
 
     totalBytes[thread] += packet->pktlen;
 
-    if (DLL_COUNT(packet_, &packetQ[thread]) >= config.maxPacketsInQueue) {
-        MOLOCH_LOCK(packetQ[thread].lock);
-        overloadDrops[thread]++;
-        if ((overloadDrops[thread] % 10000) == 1) {
-            LOG("WARNING - Packet Q %u is overflowing, total dropped so far %u.  See https://arkime.com/faq#why-am-i-dropping-packets and modify %s", thread, overloadDrops[thread], config.configFile);
-        }
-        packet->pkt = 0;
-        MOLOCH_COND_SIGNAL(packetQ[thread].lock);
-        MOLOCH_UNLOCK(packetQ[thread].lock);
-        MOLOCH_THREAD_INCR(packetStats[rc]);
-        moloch_packet_free(packet);
+    if (packetQ[thread].count >= config.maxPacketsInQueue) {
+        moloch_packet_overload_drop(thread, packet);
         return;
     }
 
-    if (!packet->copied) {
-        uint8_t *pkt = malloc(packet->pktlen);
-        memcpy(pkt, packet->pkt, packet->pktlen);
-        packet->pkt = pkt;
-        packet->copied = 1;
+    // Zero copy buffers stay owned by the reader until moloch_packet_free,
+    // unless the packet thread is backed up and would hold them too long
+    if (!packet->copied && (!packet->zeroCopy || packetQ[thread].count > zeroCopyMaxQueue)) {
+        moloch_packet_copy(packet);
     }
 
 #ifdef FUZZLOCH
@@ -1353,28 +1922,12 @@ int moloch_packet_outstanding()
     int t;
 
     for (t = 0; t < config.packetThreads; t++) {
-        count += DLL_COUNT(packet_, &packetQ[t]);
+        count += packetQ[t].count;
         count += inProgress[t];
     }
     return count;
 }
 /******************************************************************************/
-SUPPRESS_UNSIGNED_INTEGER_OVERFLOW
-LOCAL uint32_t moloch_packet_frag_hash(const void *key)
-{
-    int i;
-    uint32_t n = 0;
-    for (i = 0; i < 10; i++) {
-        n = (n << 5) - n + ((unsigned char*)key)[i];
-    }
-    return n;
-}
-/******************************************************************************/
-LOCAL int moloch_packet_frag_cmp(const void *keyv, const MolochFrags_t *element)
-{
-    return memcmp(keyv, element->key, 10) == 0;
-}
-/******************************************************************************/
 LOCAL gboolean moloch_packet_save_drophash(gpointer UNUSED(user_data))
 {
     if (packetDrop4.changed)
@@ -1461,6 +2014,50 @@ void moloch_packet_set_ip_cb(uint16_t type, MolochPacketEnqueue_cb enqueueCb)
     ipCbs[type] = enqueueCb;
 }
 /******************************************************************************/
+/* Find the numa node of each interface and spread the packet threads across
+ * those nodes.  Threads pin themselves to their node when they start, so the
+ * memory they allocate (slabs, session tables, sessions) comes from it too.
+ */
+LOCAL void moloch_packet_numa_init()
+{
+    int nodes[MOLOCH_MAX_NUMA_NODES];
+    int i, n, t;
+
+    if (config.pcapReadOffline || !config.interface)
+        return;
+
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        int node = moloch_numa_interface_node(config.interface[i]);
+        if (node < 0) {
+            LOG("WARNING: Couldn't find the numa node of %s, not using numaPlacement", config.interface[i]);
+            numaNodeCnt = 0;
+            return;
+        }
+
+        for (n = 0; n < numaNodeCnt && nodes[n] != node; n++);
+        if (n == numaNodeCnt) {
+            if (numaNodeCnt == MOLOCH_MAX_NUMA_NODES)
+                LOGEXIT("ERROR - numaPlacement supports interfaces on up to %d numa nodes", MOLOCH_MAX_NUMA_NODES);
+            nodes[numaNodeCnt++] = node;
+        }
+        readerNuma[i] = n;
+    }
+
+    if (numaNodeCnt > config.packetThreads)
+        LOGEXIT("ERROR - numaPlacement needs at least %d packetThreads, one per numa node with an interface", numaNodeCnt);
+
+    for (t = 0; t < config.packetThreads; t++) {
+        n = t % numaNodeCnt;
+        numaThreads[n][numaThreadCnt[n]++] = t;
+        if (!packetCpu[t])
+            packetNode[t] = nodes[n] + 1;
+    }
+
+    for (n = 0; n < numaNodeCnt; n++) {
+        LOG("numa node %d has %d packet threads", nodes[n], numaThreadCnt[n]);
+    }
+}
+/******************************************************************************/
 void moloch_packet_init()
 {
     pcapFileHeader.magic = 0xa1b2c3d4;
@@ -1595,20 +2192,50 @@ void moloch_packet_init()
         "fieldECS", "network.community_id",
         (char *)NULL);
 
+    zeroCopyMaxAge = moloch_config_int(NULL, "zeroCopyMaxAge", 50, 1, 10000);
+    packetPrefetch = moloch_config_int(NULL, "packetPrefetch", 1, 1, MOLOCH_PACKET_MAX_PREFETCH);
+    zeroCopyMaxQueue = config.maxPacketsInQueue / 4;
+    // maxPacketsInQueue plus room for batches in flight is split across the readers
+    packetRingSize = moloch_get_next_powerof2(MAX((config.maxPacketsInQueue + 10000) / MAX(expectedProducers, 1), 4096));
+    maxProducers = expectedProducers + MOLOCH_PACKET_EXTRA_PRODUCERS;
+
+    if (config.numaPlacement)
+        moloch_packet_numa_init();
+
     int t;
     for (t = 0; t < config.packetThreads; t++) {
         char name[100];
-        DLL_INIT(packet_, &packetQ[t]);
+        DLL_INIT(packet_, &zeroCopyHeld[t]);
+        packetQ[t].rings = MOLOCH_SIZE_ALLOC0("rings", maxProducers * sizeof(MolochPacketRing_t *));
+        packetQ[t].spin = MOLOCH_PACKET_MIN_SPIN;
+#ifndef __linux
         MOLOCH_LOCK_INIT(packetQ[t].lock);
         MOLOCH_COND_INIT(packetQ[t].lock);
+#endif
         snprintf(name, sizeof(name), "moloch-pkt%d", t);
 #ifndef FUZZLOCH
         g_thread_unref(g_thread_new(name, &moloch_packet_thread, (gpointer)(long)t));
 #endif
     }
 
-    HASH_INIT(fragh_, fragsHash, moloch_packet_frag_hash, (HASH_CMP_FUNC)moloch_packet_frag_cmp);
-    DLL_INIT(fragl_, &fragsList);
+    // Wheel covers fragsTimeout with a few slots to spare
+    fragsTickSecs = config.fragsTimeout / (MOLOCH_FRAGS_WHEEL - 4) + 1;
+    fragsMaxPerShard = MAX(config.maxFrags / MOLOCH_FRAGS_SHARDS, 1);
+    fragsHashSize = moloch_get_next_prime(fragsMaxPerShard / 4);
+    fragsZeroCopy = moloch_packet_zerocopy_register(moloch_packet_frags_buf_release);
+
+    for (t = 0; t < MOLOCH_FRAGS_SHARDS; t++) {
+        MolochFragsShard_t *shard = MOLOCH_TYPE_ALLOC0(MolochFragsShard_t);
+        int i;
+        MOLOCH_LOCK_INIT(shard->lock);
+        HASHP_INIT(fragh_, shard->hash4, fragsHashSize, moloch_packet_frag_hash, (HASH_CMP_FUNC)moloch_packet_frag_cmp);
+        HASHP_INIT(fragh_, shard->hash6, fragsHashSize, moloch_packet_frag6_hash, (HASH_CMP_FUNC)moloch_packet_frag6_cmp);
+        for (i = 0; i < MOLOCH_FRAGS_WHEEL; i++) {
+            DLL_INIT(fragl_, &shard->wheel[i]);
+        }
+        fragsShards[t] = shard;
+    }
+    g_timeout_add_seconds(fragsTickSecs, moloch_packet_frags_gfunc, 0);
 
     moloch_add_can_quit(moloch_packet_outstanding, "packet outstanding");
     moloch_add_can_quit(moloch_packet_frags_outstanding, "packet frags outstanding");
@@ -1674,19 +2301,97 @@ void moloch_packet_add_packet_ip(char *ipstr, int mode)
     node->data = (void *)(long)mode;
 }
 /******************************************************************************/
+/* Sets the default link type for every readerPos */
 void moloch_packet_set_dltsnap(int dlt, int snaplen)
 {
+    int i;
+
     pcapFileHeader.dlt = dlt;
     pcapFileHeader.snaplen = snaplen;
+    for (i = 0; i < 256; i++)
+        readerDlt[i] = dlt;
     moloch_rules_recompile();
 }
 /******************************************************************************/
+/* Readers with interfaces or files of different link types override the
+ * default per readerPos, before any of its packets are batched.
+ */
+void moloch_packet_set_reader_dlt(int readerPos, int dlt)
+{
+    readerDlt[readerPos] = dlt;
+    moloch_rules_add_dlt(dlt);
+}
+/******************************************************************************/
+/* Readers that steer flows to cpus call this before the packet threads are
+ * started so the thread processing the flows runs on the same cpu.
+ */
+void moloch_packet_set_cpu(int thread, int cpu)
+{
+    packetCpu[thread] = cpu + 1;
+}
+/******************************************************************************/
+/* The packet thread that owns sessions with this hash from this reader */
+uint32_t moloch_packet_hash_thread(uint32_t hash, int readerPos)
+{
+    if (likely(numaNodeCnt <= 1))
+        return hash % config.packetThreads;
+
+    int n = readerNuma[readerPos];
+    return numaThreads[n][hash % numaThreadCnt[n]];
+}
+/******************************************************************************/
+/* Every packet thread that might own sessions with this hash, one per numa
+ * node.  threads must have room for MOLOCH_MAX_NUMA_NODES.
+ */
+int moloch_packet_hash_threads(uint32_t hash, int *threads)
+{
+    if (likely(numaNodeCnt <= 1)) {
+        threads[0] = hash % config.packetThreads;
+        return 1;
+    }
+
+    int n;
+    for (n = 0; n < numaNodeCnt; n++) {
+        threads[n] = numaThreads[n][hash % numaThreadCnt[n]];
+    }
+    return numaNodeCnt;
+}
+/******************************************************************************/
 void moloch_packet_set_linksnap(int linktype, int snaplen)
 {
     // In theory you might need to do some mapping here, but we don't
     moloch_packet_set_dltsnap(linktype, snaplen);
 }
 /******************************************************************************/
+/* Readers say how many threads they will add packets from before
+ * moloch_packet_init, so the per reader rings can be sized.
+ */
+void moloch_packet_add_producers(int cnt)
+{
+    expectedProducers += cnt;
+}
+/******************************************************************************/
+uint8_t moloch_packet_zerocopy_register(MolochPacketRelease_cb releaseCb)
+{
+    if (zeroCopyCnt >= 0x80)
+        LOGEXIT("ERROR - Too many zero copy readers registered");
+
+    zeroCopyCbs[zeroCopyCnt] = releaseCb;
+    return zeroCopyCnt++;
+}
+/******************************************************************************/
+/* Called by a reader that needs a buffer back now, every packet thread copies
+ * all the zero copy packets it is holding the next time around its loop.
+ */
+void moloch_packet_zerocopy_flush()
+{
+    int t;
+    for (t = 0; t < config.packetThreads; t++) {
+        zeroCopyFlush[t] = 1;
+        moloch_packet_queue_wake(&packetQ[t]);
+    }
+}
+/******************************************************************************/
 // PCAP Header needs linktype when written
 // Code based on https://github.com/aol/moloch/issues/1303#issuecomment-554684749
 // Values from libpcap pcap-common.c
@@ -1714,6 +2419,28 @@ uint32_t moloch_packet_dlt_to_linktype(int dlt)
     return dlt;
 }
 /******************************************************************************/
+// Reverse of moloch_packet_dlt_to_linktype, for readers that parse file headers themselves
+int moloch_packet_linktype_to_dlt(uint32_t linktype)
+{
+    switch (linktype)
+    {
+#ifdef DLT_FR
+    case 107: return DLT_FR; // LINKTYPE_FRELAY
+#endif
+    case 100: return DLT_ATM_RFC1483; // LINKTYPE_ATM_RFC1483
+    case 101: return DLT_RAW; // LINKTYPE_RAW
+    case 102: return DLT_SLIP_BSDOS; // LINKTYPE_SLIP_BSDOS
+    case 103: return DLT_PPP_BSDOS; // LINKTYPE_PPP_BSDOS
+    case 104: return DLT_C_HDLC; // LINKTYPE_C_HDLC
+    case 106: return DLT_ATM_CLIP; // LINKTYPE_ATM_CLIP
+    case 50: return DLT_PPP_SERIAL; // LINKTYPE_PPP_HDLC
+    case 51: return DLT_PPP_ETHER; // LINKTYPE_PPP_ETHER
+    case 246: return DLT_PFSYNC; // LINKTYPE_PFSYNC
+    case 258: return DLT_PKTAP; // LINKTYPE_PKTAP
+    }
+    return linktype;
+}
+/******************************************************************************/
 void moloch_packet_drophash_add(MolochSession_t *session, int which, int min)
 {
     if (session->ses != SESSION_TCP)
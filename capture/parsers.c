@@ -37,6 +37,18 @@ enum MolochMagicMode { MOLOCH_MAGICMODE_LIBMAGIC, MOLOCH_MAGICMODE_BOTH, MOLOCH_
 
 LOCAL enum MolochMagicMode magicMode;
 
+typedef struct {
+    uint64_t             calls;
+    uint64_t             bytes;
+    uint64_t             sampled;
+    uint64_t             cycles;
+} MolochParserStat_t;
+
+LOCAL const char            *parserStatsNames[MOLOCH_PARSER_STATS_MAX] = {"unknown"};
+LOCAL int                    parserStatsNum = 1;
+LOCAL MolochParserStat_t    *parserStats[MOLOCH_MAX_PACKET_THREADS];
+LOCAL __thread int           parserStatsCurrent;
+
 /******************************************************************************/
 #define MAGIC_MATCH(offset, needle) memcmp(data+offset, needle, sizeof(needle)-1) == 0
 #define MAGIC_MATCH_LEN(offset, needle) ((len > (int)sizeof(needle)-1+offset) && (memcmp(data+offset, needle, sizeof(needle)-1) == 0))
@@ -592,6 +604,14 @@ void moloch_parsers_init()
     if (config.nodeClass)
         snprintf(classTag, sizeof(classTag), "class:%s", config.nodeClass);
 
+    if (config.parserStats) {
+        int t;
+        for (t = 0; t < config.packetThreads; t++) {
+            if (!parserStats[t])
+                parserStats[t] = calloc(MOLOCH_PARSER_STATS_MAX, sizeof(MolochParserStat_t));
+        }
+    }
+
     moloch_field_define("general", "integer",
         "session.segments", "Session Segments", "segmentCnt",
         "Number of segments in session so far",
@@ -829,6 +849,9 @@ void moloch_parsers_init()
 }
 /******************************************************************************/
 void moloch_parsers_exit() {
+    if (config.parserStats)
+        moloch_parsers_stats_dump();
+
     if (magicMode == MOLOCH_MAGICMODE_LIBMAGIC || magicMode == MOLOCH_MAGICMODE_BOTH) {
         int t;
         for (t = 0; t < config.packetThreads; t++) {
@@ -861,6 +884,155 @@ char *moloch_sprint_hex_string(char *buf, const unsigned char* data, unsigned in
     return buf;
 }
 /******************************************************************************/
+int moloch_parsers_stats_id(const char *name)
+{
+    int i;
+    for (i = 1; i < parserStatsNum; i++) {
+        if (strcmp(parserStatsNames[i], name) == 0)
+            return i;
+    }
+
+    if (parserStatsNum >= MOLOCH_PARSER_STATS_MAX) {
+        if (config.debug)
+            LOG("Too many parsers for stats, counting %s as unknown", name);
+        return 0;
+    }
+
+    parserStatsNames[parserStatsNum] = g_strdup(name);
+    return parserStatsNum++;
+}
+/******************************************************************************/
+LOCAL uint64_t moloch_parsers_stats_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cycles;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r" (cycles));
+    return cycles;
+#else
+    return 0;
+#endif
+}
+/******************************************************************************/
+/* Count the call and time every 16th one, start is 0 when not timing.  Returns
+ * the id that was current, calls can nest so stats_end puts it back.
+ */
+int moloch_parsers_stats_start(int thread, int id, int len, uint64_t *start)
+{
+    MolochParserStat_t *stat = &parserStats[thread][id];
+    int                 prev = parserStatsCurrent;
+
+    parserStatsCurrent = id;
+    stat->calls++;
+    stat->bytes += len;
+    *start = ((stat->calls & 0xf) == 0)?moloch_parsers_stats_cycles():0;
+    return prev;
+}
+/******************************************************************************/
+void moloch_parsers_stats_end(int thread, int id, uint64_t start, int prev)
+{
+    parserStatsCurrent = prev;
+    if (start) {
+        MolochParserStat_t *stat = &parserStats[thread][id];
+        stat->cycles += moloch_parsers_stats_cycles() - start;
+        stat->sampled++;
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_parsers_stats_total(MolochParserStat_t *total)
+{
+    int t, i;
+
+    memset(total, 0, sizeof(MolochParserStat_t) * MOLOCH_PARSER_STATS_MAX);
+    for (t = 0; t < config.packetThreads; t++) {
+        if (!parserStats[t])
+            continue;
+        for (i = 0; i < parserStatsNum; i++) {
+            total[i].calls   += parserStats[t][i].calls;
+            total[i].bytes   += parserStats[t][i].bytes;
+            total[i].sampled += parserStats[t][i].sampled;
+            total[i].cycles  += parserStats[t][i].cycles;
+        }
+    }
+
+    // Scale the timed calls up to all calls
+    for (i = 0; i < parserStatsNum; i++) {
+        if (total[i].sampled)
+            total[i].cycles = (double)total[i].cycles / total[i].sampled * total[i].calls;
+    }
+}
+/******************************************************************************/
+/* Append the parsers array and closing brace to the stats document */
+int moloch_parsers_stats_json(char *buf, int size)
+{
+    MolochParserStat_t total[MOLOCH_PARSER_STATS_MAX];
+    BSB                bsb;
+    int                i, cnt = 0;
+
+    moloch_parsers_stats_total(total);
+
+    BSB_INIT(bsb, buf, size);
+    BSB_EXPORT_cstr(bsb, ",\"parsers\": [");
+    for (i = 0; i < parserStatsNum; i++) {
+        if (!total[i].calls)
+            continue;
+        if (cnt)
+            BSB_EXPORT_u08(bsb, ',');
+        BSB_EXPORT_sprintf(bsb, "{\"name\": \"%s\", \"calls\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"cycles\": %" PRIu64 "}",
+                           parserStatsNames[i], total[i].calls, total[i].bytes, total[i].cycles);
+        cnt++;
+    }
+    BSB_EXPORT_cstr(bsb, "]}");
+
+    if (BSB_IS_ERROR(bsb)) {
+        buf[0] = '}';
+        return 1;
+    }
+    return BSB_LENGTH(bsb);
+}
+/******************************************************************************/
+LOCAL int moloch_parsers_stats_cmp(const void *a, const void *b, void *uw)
+{
+    const MolochParserStat_t *total = uw;
+    uint64_t ca = total[*(const int *)a].cycles;
+    uint64_t cb = total[*(const int *)b].cycles;
+
+    return (ca < cb) - (ca > cb);
+}
+/******************************************************************************/
+void moloch_parsers_stats_dump()
+{
+    MolochParserStat_t total[MOLOCH_PARSER_STATS_MAX];
+    int                order[MOLOCH_PARSER_STATS_MAX];
+    int                i, t;
+
+    moloch_parsers_stats_total(total);
+
+    for (i = 0; i < parserStatsNum; i++)
+        order[i] = i;
+    g_qsort_with_data(order, parserStatsNum, sizeof(int), moloch_parsers_stats_cmp, total);
+
+    LOG("%-20s %15s %18s %18s %10s", "parser", "calls", "bytes", "cycles", "cycles/call");
+    for (i = 0; i < parserStatsNum; i++) {
+        MolochParserStat_t *stat = &total[order[i]];
+        if (!stat->calls)
+            continue;
+        LOG("%-20s %15" PRIu64 " %18" PRIu64 " %18" PRIu64 " %10" PRIu64,
+            parserStatsNames[order[i]], stat->calls, stat->bytes, stat->cycles, stat->cycles / stat->calls);
+
+        if (config.debug) {
+            for (t = 0; t < config.packetThreads; t++) {
+                MolochParserStat_t *tstat = &parserStats[t][order[i]];
+                if (!tstat->calls)
+                    continue;
+                LOG("  thread %-11d %15" PRIu64 " %18" PRIu64 " %18" PRIu64, t, tstat->calls, tstat->bytes,
+                    tstat->sampled ? (uint64_t)((double)tstat->cycles / tstat->sampled * tstat->calls) : 0);
+            }
+        }
+    }
+}
+/******************************************************************************/
 void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc)
 {
     if (session->parserNum >= session->parserLen) {
@@ -876,20 +1048,137 @@ void  moloch_parsers_register2(MolochSession_t *session, MolochParserFunc func,
     session->parserInfo[session->parserNum].uw             = uw;
     session->parserInfo[session->parserNum].parserFreeFunc = ffunc;
     session->parserInfo[session->parserNum].parserSaveFunc = sfunc;
+    session->parserInfo[session->parserNum].stream         = NULL;
+    session->parserInfo[session->parserNum].statsId        = parserStatsCurrent;
 
     session->parserNum++;
 }
 /******************************************************************************/
+void  moloch_parsers_register_stream(MolochSession_t *session, MolochParserFunc func, void *uw, MolochParserFreeFunc ffunc, MolochParserSaveFunc sfunc)
+{
+    moloch_parsers_register2(session, func, uw, ffunc, sfunc);
+    session->parserInfo[session->parserNum - 1].stream = MOLOCH_TYPE_ALLOC0(MolochParserStream_t);
+}
+/******************************************************************************/
+/* What a stream parser hasn't consumed yet in a direction, for save functions
+ * that want to look at a partial record.
+ */
+const uint8_t *moloch_parsers_stream_leftover(MolochSession_t *session, void *uw, int which, int *len)
+{
+    int i;
+    for (i = 0; i < session->parserNum; i++) {
+        MolochParserInfo_t *info = &session->parserInfo[i];
+        if (info->uw == uw && info->parserFunc != 0 && info->stream) {
+            *len = info->stream->len[which];
+            return info->stream->buf[which];
+        }
+    }
+    *len = 0;
+    return NULL;
+}
+/******************************************************************************/
+/* Hand a stream parser one contiguous window.  When nothing is left over from
+ * before the window is the caller's data, otherwise the data is appended to the
+ * leftover.  Whatever isn't consumed is kept for the next call.
+ */
+LOCAL int moloch_parsers_stream_call(MolochSession_t *session, MolochParserInfo_t *info, const uint8_t *data, int len, int which)
+{
+    MolochParserStream_t *stream = info->stream;
+    const uint8_t        *window = data;
+    uint32_t              wlen = len;
+
+    if (stream->len[which]) {
+        uint32_t need = stream->len[which] + len;
+        if (need > stream->size[which]) {
+            uint32_t size = MAX(stream->size[which], 1024);
+            while (size < need)
+                size *= 2;
+            uint8_t *buf = MOLOCH_SIZE_ALLOC(parserStream, size);
+            memcpy(buf, stream->buf[which], stream->len[which]);
+            MOLOCH_SIZE_FREE(parserStream, stream->buf[which]);
+            stream->buf[which] = buf;
+            stream->size[which] = size;
+        }
+        memcpy(stream->buf[which] + stream->len[which], data, len);
+        window = stream->buf[which];
+        wlen = need;
+    }
+
+    int consumed = info->parserFunc(session, info->uw, window, wlen, which);
+    if (consumed == MOLOCH_PARSER_UNREGISTER)
+        return MOLOCH_PARSER_UNREGISTER;
+
+    // The parser unregistered itself, stream and window have been freed
+    if (info->stream != stream)
+        return 0;
+
+    if (consumed < 0)
+        consumed = 0;
+    if ((uint32_t)consumed > wlen)
+        consumed = wlen;
+
+    uint32_t left = wlen - consumed;
+    if (left > MOLOCH_PARSER_STREAM_MAX)
+        return MOLOCH_PARSER_UNREGISTER;
+
+    if (left == 0) {
+        stream->len[which] = 0;
+    } else if (window == stream->buf[which]) {
+        memmove(stream->buf[which], window + consumed, left);
+        stream->len[which] = left;
+    } else {
+        if (left > stream->size[which]) {
+            uint32_t size = MAX(stream->size[which], 1024);
+            while (size < left)
+                size *= 2;
+            if (stream->buf[which])
+                MOLOCH_SIZE_FREE(parserStream, stream->buf[which]);
+            stream->buf[which] = MOLOCH_SIZE_ALLOC(parserStream, size);
+            stream->size[which] = size;
+        }
+        memcpy(stream->buf[which], window + consumed, left);
+        stream->len[which] = left;
+    }
+
+    // What a stream parser holds on to is its own business, not the session's
+    return 0;
+}
+/******************************************************************************/
+int moloch_parsers_call(MolochSession_t *session, MolochParserInfo_t *info, const uint8_t *data, int len, int which)
+{
+    int consumed;
+
+    if (info->stream)
+        MOLOCH_PARSER_STATS(session->thread, info->statsId, len, consumed = moloch_parsers_stream_call(session, info, data, len, which));
+    else
+        MOLOCH_PARSER_STATS(session->thread, info->statsId, len, consumed = info->parserFunc(session, info->uw, data, len, which));
+
+    return consumed;
+}
+/******************************************************************************/
+void moloch_parsers_free_info(MolochSession_t *session, MolochParserInfo_t *info)
+{
+    if (info->parserFreeFunc) {
+        info->parserFreeFunc(session, info->uw);
+    }
+
+    if (info->stream) {
+        if (info->stream->buf[0])
+            MOLOCH_SIZE_FREE(parserStream, info->stream->buf[0]);
+        if (info->stream->buf[1])
+            MOLOCH_SIZE_FREE(parserStream, info->stream->buf[1]);
+        MOLOCH_TYPE_FREE(MolochParserStream_t, info->stream);
+    }
+
+    memset(info, 0, sizeof(*info));
+}
+/******************************************************************************/
 void  moloch_parsers_unregister(MolochSession_t *session, void *uw)
 {
     int i;
     for (i = 0; i < session->parserNum; i++) {
         if (session->parserInfo[i].uw == uw && session->parserInfo[i].parserFunc != 0) {
-            if (session->parserInfo[i].parserFreeFunc) {
-                session->parserInfo[i].parserFreeFunc(session, uw);
-            }
-
-            memset(&session->parserInfo[i], 0, sizeof(session->parserInfo[i]));
+            moloch_parsers_free_info(session, &session->parserInfo[i]);
             break;
         }
     }
@@ -903,6 +1192,7 @@ typedef struct moloch_classify_t
     const unsigned char *match;
     int                  matchlen;
     int                  minlen;
+    int                  statsId;
     MolochClassifyFunc   func;
 } MolochClassify_t;
 
@@ -913,15 +1203,28 @@ typedef struct
     short               cnt;
 } MolochClassifyHead_t;
 
+/* Classifiers that match at a non zero offset, indexed by the byte found at
+ * that offset so each new session does one lookup per distinct offset.
+ */
+typedef struct
+{
+    int                  offset;
+    MolochClassifyHead_t byte[256];
+} MolochClassifyOffset_t;
+
 LOCAL MolochClassifyHead_t classifersTcp0;
 LOCAL MolochClassifyHead_t classifersTcp1[256];
 LOCAL MolochClassifyHead_t classifersTcp2[256][256];
+LOCAL MolochClassifyOffset_t *classifersTcpOffset;
+LOCAL int                  classifersTcpOffsetNum;
 LOCAL MolochClassifyHead_t classifersTcpPortSrc[0x10000];
 LOCAL MolochClassifyHead_t classifersTcpPortDst[0x10000];
 
 LOCAL MolochClassifyHead_t classifersUdp0;
 LOCAL MolochClassifyHead_t classifersUdp1[256];
 LOCAL MolochClassifyHead_t classifersUdp2[256][256];
+LOCAL MolochClassifyOffset_t *classifersUdpOffset;
+LOCAL int                  classifersUdpOffsetNum;
 LOCAL MolochClassifyHead_t classifersUdpPortSrc[0x10000];
 LOCAL MolochClassifyHead_t classifersUdpPortDst[0x10000];
 
@@ -956,6 +1259,30 @@ void moloch_parsers_classifier_add(MolochClassifyHead_t *ch, MolochClassify_t *c
     ch->cnt++;
 }
 /******************************************************************************/
+LOCAL void moloch_parsers_classifier_call(MolochClassify_t *c, MolochSession_t *session, const unsigned char *data, int remaining, int which)
+{
+    MOLOCH_PARSER_STATS(session->thread, c->statsId, remaining, c->func(session, data, remaining, which, c->uw));
+}
+/******************************************************************************/
+LOCAL void moloch_parsers_classifier_add_offset(MolochClassifyOffset_t **offsets, int *num, MolochClassify_t *c)
+{
+    int i;
+    for (i = 0; i < *num && (*offsets)[i].offset < c->offset; i++);
+
+    if (i == *num || (*offsets)[i].offset != c->offset) {
+        *offsets = realloc(*offsets, sizeof(MolochClassifyOffset_t) * (*num + 1));
+        memmove(*offsets + i + 1, *offsets + i, sizeof(MolochClassifyOffset_t) * (*num - i));
+        memset(*offsets + i, 0, sizeof(MolochClassifyOffset_t));
+        (*offsets)[i].offset = c->offset;
+        (*num)++;
+    }
+
+    uint8_t first = c->match[0];
+    c->match++;
+    c->matchlen--;
+    moloch_parsers_classifier_add(&(*offsets)[i].byte[first], c);
+}
+/******************************************************************************/
 void moloch_parsers_classifier_register_port_internal(const char *name, void *uw, uint16_t port, uint32_t type, MolochClassifyFunc func, size_t sessionsize, int apiversion)
 {
     if (sizeof(MolochSession_t) != sessionsize) {
@@ -972,6 +1299,7 @@ void moloch_parsers_classifier_register_port_internal(const char *name, void *uw
 
     MolochClassify_t *c = MOLOCH_TYPE_ALLOC0(MolochClassify_t);
     c->name     = name;
+    c->statsId  = moloch_parsers_stats_id(name);
     c->uw       = uw;
     c->func     = func;
 
@@ -1004,6 +1332,7 @@ void moloch_parsers_classifier_register_tcp_internal(const char *name, void *uw,
 
     MolochClassify_t *c = MOLOCH_TYPE_ALLOC0(MolochClassify_t);
     c->name     = name;
+    c->statsId  = moloch_parsers_stats_id(name);
     c->uw       = uw;
     c->offset   = offset;
     c->match    = match;
@@ -1016,8 +1345,10 @@ void moloch_parsers_classifier_register_tcp_internal(const char *name, void *uw,
         moloch_sprint_hex_string(hex, match, matchlen);
         LOG("adding %s matchlen:%d offset:%d match %s (0x%s)", name, matchlen, offset, match, hex);
     }
-    if (matchlen == 0 || offset != 0) {
+    if (matchlen == 0) {
         moloch_parsers_classifier_add(&classifersTcp0, c);
+    } else if (offset != 0) {
+        moloch_parsers_classifier_add_offset(&classifersTcpOffset, &classifersTcpOffsetNum, c);
     } else if (matchlen == 1) {
         moloch_parsers_classifier_add(&classifersTcp1[(uint8_t)match[0]], c);
     } else  {
@@ -1039,6 +1370,7 @@ void moloch_parsers_classifier_register_udp_internal(const char *name, void *uw,
 
     MolochClassify_t *c = MOLOCH_TYPE_ALLOC0(MolochClassify_t);
     c->name     = name;
+    c->statsId  = moloch_parsers_stats_id(name);
     c->uw       = uw;
     c->offset   = offset;
     c->match    = match;
@@ -1048,8 +1380,10 @@ void moloch_parsers_classifier_register_udp_internal(const char *name, void *uw,
 
     if (config.debug)
         LOG("adding %s matchlen:%d offset:%d match %s ", name, matchlen, offset, match);
-    if (matchlen == 0 || offset != 0) {
+    if (matchlen == 0) {
         moloch_parsers_classifier_add(&classifersUdp0, c);
+    } else if (offset != 0) {
+        moloch_parsers_classifier_add_offset(&classifersUdpOffset, &classifersUdpOffsetNum, c);
     } else if (matchlen == 1) {
         moloch_parsers_classifier_add(&classifersUdp1[(uint8_t)match[0]], c);
     } else  {
@@ -1072,27 +1406,39 @@ void moloch_parsers_classify_udp(MolochSession_t *session, const unsigned char *
 #endif
 
     for (i = 0; i < classifersUdpPortSrc[session->port1].cnt; i++) {
-        classifersUdpPortSrc[session->port1].arr[i]->func(session, data, remaining, which, classifersUdpPortSrc[session->port1].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersUdpPortSrc[session->port1].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersUdpPortDst[session->port2].cnt; i++) {
-        classifersUdpPortDst[session->port2].arr[i]->func(session, data, remaining, which, classifersUdpPortDst[session->port2].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersUdpPortDst[session->port2].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersUdp0.cnt; i++) {
         MolochClassify_t *c = classifersUdp0.arr[i];
-        if (remaining >= c->minlen && memcmp(data + c->offset, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
+        if (remaining >= c->minlen) {
+            moloch_parsers_classifier_call(c, session, data, remaining, which);
+        }
+    }
+
+    for (i = 0; i < classifersUdpOffsetNum && classifersUdpOffset[i].offset < remaining; i++) {
+        MolochClassifyOffset_t *co = &classifersUdpOffset[i];
+        MolochClassifyHead_t   *ch = &co->byte[data[co->offset]];
+        int j;
+        for (j = 0; j < ch->cnt; j++) {
+            MolochClassify_t *c = ch->arr[j];
+            if (remaining >= c->minlen && memcmp(data + co->offset + 1, c->match, c->matchlen) == 0) {
+                moloch_parsers_classifier_call(c, session, data, remaining, which);
+            }
         }
     }
 
     for (i = 0; i < classifersUdp1[data[0]].cnt; i++)
-        classifersUdp1[data[0]].arr[i]->func(session, data, remaining, which, classifersUdp1[data[0]].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersUdp1[data[0]].arr[i], session, data, remaining, which);
 
     for (i = 0; i < classifersUdp2[data[0]][data[1]].cnt; i++) {
         MolochClassify_t *c = classifersUdp2[data[0]][data[1]].arr[i];
         if (remaining >= c->minlen && memcmp(data+2, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
+            moloch_parsers_classifier_call(c, session, data, remaining, which);
         }
     }
 
@@ -1114,28 +1460,40 @@ void moloch_parsers_classify_tcp(MolochSession_t *session, const unsigned char *
         return;
 
     for (i = 0; i < classifersTcpPortSrc[session->port1].cnt; i++) {
-        classifersTcpPortSrc[session->port1].arr[i]->func(session, data, remaining, which, classifersTcpPortSrc[session->port1].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersTcpPortSrc[session->port1].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersTcpPortDst[session->port2].cnt; i++) {
-        classifersTcpPortDst[session->port2].arr[i]->func(session, data, remaining, which, classifersTcpPortDst[session->port2].arr[i]->uw);
+        moloch_parsers_classifier_call(classifersTcpPortDst[session->port2].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersTcp0.cnt; i++) {
         MolochClassify_t *c = classifersTcp0.arr[i];
-        if (remaining >= c->minlen && memcmp(data + c->offset, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
+        if (remaining >= c->minlen) {
+            moloch_parsers_classifier_call(c, session, data, remaining, which);
+        }
+    }
+
+    for (i = 0; i < classifersTcpOffsetNum && classifersTcpOffset[i].offset < remaining; i++) {
+        MolochClassifyOffset_t *co = &classifersTcpOffset[i];
+        MolochClassifyHead_t   *ch = &co->byte[data[co->offset]];
+        int j;
+        for (j = 0; j < ch->cnt; j++) {
+            MolochClassify_t *c = ch->arr[j];
+            if (remaining >= c->minlen && memcmp(data + co->offset + 1, c->match, c->matchlen) == 0) {
+                moloch_parsers_classifier_call(c, session, data, remaining, which);
+            }
         }
     }
 
     for (i = 0; i < classifersTcp1[data[0]].cnt; i++) {
-        classifersTcp1[data[0]].arr[i]->func(session, data, remaining, which, classifersTcp1[data[0]].arr[i]);
+        moloch_parsers_classifier_call(classifersTcp1[data[0]].arr[i], session, data, remaining, which);
     }
 
     for (i = 0; i < classifersTcp2[data[0]][data[1]].cnt; i++) {
         MolochClassify_t *c = classifersTcp2[data[0]][data[1]].arr[i];
         if (remaining >= c->minlen && memcmp(data+2, c->match, c->matchlen) == 0) {
-            c->func(session, data, remaining, which, c->uw);
+            moloch_parsers_classifier_call(c, session, data, remaining, which);
         }
     }
 
@@ -22,12 +22,6 @@ LOCAL  int realmField;
 LOCAL  int cnameField;
 LOCAL  int snameField;
 
-#define KRB5_MAX_SIZE 4096
-typedef struct {
-    unsigned char  data[2][KRB5_MAX_SIZE];
-    int            pos[2];
-} KRB5Info_t;
-
 /******************************************************************************/
 /* wireshark: k5.asn which based on http://www.h5l.org/dist/src/heimdal-1.2.tar.gz
 --PrincipalName ::= SEQUENCE {
@@ -231,31 +225,18 @@ LOCAL void krb5_udp_classify(MolochSession_t *session, const unsigned char *data
     }
 }
 /******************************************************************************/
-LOCAL void krb5_free(MolochSession_t UNUSED(*session), void *uw)
-{
-    KRB5Info_t            *krb5          = uw;
-
-    MOLOCH_TYPE_FREE(KRB5Info_t, krb5);
-}
-/******************************************************************************/
-LOCAL int krb5_tcp_parser(MolochSession_t *session, void *uw, const unsigned char *data, int remaining, int which)
+LOCAL int krb5_tcp_parser(MolochSession_t *session, void *UNUSED(uw), const unsigned char *data, int remaining, int UNUSED(which))
 {
-    KRB5Info_t *krb5 = uw;
-
-    remaining = MIN(remaining, KRB5_MAX_SIZE - krb5->pos[which]);
-    memcpy(krb5->data[which] + krb5->pos[which], data, remaining);
-    krb5->pos[which] += remaining;
+    int used = 0;
 
-    if (krb5->pos[which] < 4)
-        return 0;
-
-    int len = (krb5->data[which][2] << 8) | krb5->data[which][3];
-    if (krb5->pos[which] < len + 4)
-        return 0;
-    krb5_parse(session, krb5->data[which]+4, len);
-    memmove(krb5->data[which], krb5->data[which]+len+4, krb5->pos[which] - len - 4);
-    krb5->pos[which] -= (len + 4);
-    return 0;
+    while (remaining - used >= 4) {
+        int len = (data[used + 2] << 8) | data[used + 3];
+        if (remaining - used < len + 4)
+            break;
+        krb5_parse(session, data + used + 4, len);
+        used += len + 4;
+    }
+    return used;
 }
 /******************************************************************************/
 LOCAL void krb5_tcp_classify(MolochSession_t *session, const unsigned char *data, int UNUSED(len), int UNUSED(which), void *UNUSED(uw))
@@ -263,10 +244,7 @@ LOCAL void krb5_tcp_classify(MolochSession_t *session, const unsigned char *data
     if (len < 2 || which != 0 || data[0] != 0 || data[1] != 0)
         return;
 
-    KRB5Info_t            *krb5          = MOLOCH_TYPE_ALLOC(KRB5Info_t);
-    krb5->pos[0] = krb5->pos[1] = 0;
-
-    moloch_parsers_register(session, krb5_tcp_parser, krb5, krb5_free);
+    moloch_parsers_register_stream(session, krb5_tcp_parser, 0, 0, 0);
 }
 /******************************************************************************/
 void moloch_parser_init()
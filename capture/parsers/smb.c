@@ -28,9 +28,7 @@ LOCAL  int shareField;
 
 #define MAX_SMB_BUFFER 8192
 typedef struct {
-    char               buf[2][MAX_SMB_BUFFER];
     uint32_t           remlen[2];
-    short              buflen[2];
     uint16_t           flags2[2];
     unsigned char      version[2];
     char               state[2];
@@ -478,98 +476,68 @@ LOCAL int smb_parser(MolochSession_t *session, void *uw, const unsigned char *da
 {
     SMBInfo_t            *smb          = uw;
     char                 *state        = &smb->state[which];
-    char                 *buf          = smb->buf[which];
-    short                *buflen       = &smb->buflen[which];
     uint32_t             *remlen       = &smb->remlen[which];
+    BSB                   bsb;
+    int                   done         = 0;
 
 #ifdef SMBDEBUG
-    LOG("ENTER: remaining: %d state: %d buflen: %d remlen: %u", remaining, *state, *buflen, *remlen);
+    LOG("ENTER: remaining: %d state: %d remlen: %u", remaining, *state, *remlen);
 #endif
 
-    while (remaining > 0) {
-        BSB bsb;
-        int done = 0;
-
-        if (*buflen == 0) {
-            BSB_INIT(bsb, data, remaining);
-            data += remaining;
-            remaining = 0;
-        } else {
-            int len = MIN(remaining, MAX_SMB_BUFFER - (*buflen));
-            memcpy(buf + (*buflen), data, len);
-            (*buflen) += len;
-            remaining -= len;
-            data += len;
-            BSB_INIT(bsb, buf, *buflen);
-        }
-
-        if (*state != SMB_SKIP && *remlen > MAX_SMB_BUFFER) {
+    if (*state != SMB_SKIP && *remlen > MAX_SMB_BUFFER) {
 #ifndef FUZZLOCH
-            LOG("ERROR - Not enough room for SMB packet %u", *remlen);
+        LOG("ERROR - Not enough room for SMB packet %u", *remlen);
 #endif
-            moloch_parsers_unregister(session, smb);
-            return 0;
-        }
+        return MOLOCH_PARSER_UNREGISTER;
+    }
+
+    BSB_INIT(bsb, data, remaining);
 
-        while (!done && BSB_REMAINING(bsb) > 0) {
+    while (!done && BSB_REMAINING(bsb) > 0) {
 #ifdef SMBDEBUG
-            LOG(" S: bsbremaining: %u remaining: %d state: %d buflen: %d remlen: %u done: %d", (uint32_t)BSB_REMAINING(bsb), remaining, *state, *buflen, *remlen, done);
+        LOG(" S: bsbremaining: %u state: %d remlen: %u done: %d", (uint32_t)BSB_REMAINING(bsb), *state, *remlen, done);
 #endif
-            switch (*state) {
-            case SMB_NETBIOS:
-                if(BSB_REMAINING(bsb) < 5) {
-                    done = 1;
-                    break;
-                }
-
-                BSB_IMPORT_skip(bsb, 1);
-                BSB_IMPORT_u24(bsb, *remlen);
-                // Peak at SMBHEADER for version
-                smb->version[which] = *(BSB_WORK_PTR(bsb));
-                *state = SMB_SMBHEADER;
-                break;
-            case SMB_SKIP:
-                if (BSB_REMAINING(bsb) < *remlen) {
-                    *remlen -= BSB_REMAINING(bsb);
-                    BSB_IMPORT_skip(bsb, BSB_REMAINING(bsb));
-                } else {
-                    BSB_IMPORT_skip(bsb, *remlen);
-                    *remlen = 0;
-                    *state = SMB_NETBIOS;
-                }
+        switch (*state) {
+        case SMB_NETBIOS:
+            if(BSB_REMAINING(bsb) < 5) {
+                done = 1;
                 break;
-            default:
-                if (smb->version[which] == 0xff) {
-                    done = smb1_parse(session, smb, &bsb, state, remlen, which);
-                } else {
-                    done = smb2_parse(session, smb, &bsb, state, remlen, which);
-                }
             }
 
-#ifdef SMBDEBUG
-            LOG(" E: bsbremaining: %u remaining: %d state: %d buflen: %d remlen: %u done: %d", (uint32_t)BSB_REMAINING(bsb), remaining, *state, *buflen, *remlen, done);
-#endif
-        }
-
-        if (BSB_IS_ERROR(bsb)) {
-            moloch_parsers_unregister(session, smb);
-            return 0;
+            BSB_IMPORT_skip(bsb, 1);
+            BSB_IMPORT_u24(bsb, *remlen);
+            // Peak at SMBHEADER for version
+            smb->version[which] = *(BSB_WORK_PTR(bsb));
+            *state = SMB_SMBHEADER;
+            break;
+        case SMB_SKIP:
+            if (BSB_REMAINING(bsb) < *remlen) {
+                *remlen -= BSB_REMAINING(bsb);
+                BSB_IMPORT_skip(bsb, BSB_REMAINING(bsb));
+            } else {
+                BSB_IMPORT_skip(bsb, *remlen);
+                *remlen = 0;
+                *state = SMB_NETBIOS;
+            }
+            break;
+        default:
+            if (smb->version[which] == 0xff) {
+                done = smb1_parse(session, smb, &bsb, state, remlen, which);
+            } else {
+                done = smb2_parse(session, smb, &bsb, state, remlen, which);
+            }
         }
 
-        if (BSB_REMAINING(bsb) > 0 && BSB_WORK_PTR(bsb) != (unsigned char *)buf) {
 #ifdef SMBDEBUG
-            //LOG("  Moving data %ld %s", BSB_REMAINING(bsb), moloch_session_id_string(session->protocol, session->addr1, session->port1, session->addr2, session->port2));
+        LOG(" E: bsbremaining: %u state: %d remlen: %u done: %d", (uint32_t)BSB_REMAINING(bsb), *state, *remlen, done);
 #endif
-            if (BSB_REMAINING(bsb) > MAX_SMB_BUFFER) {
-                LOG("ERROR - Not enough room for SMB packet %u", (uint32_t)BSB_REMAINING(bsb));
-                moloch_parsers_unregister(session, smb);
-                return 0;
-            }
-            memmove(buf, BSB_WORK_PTR(bsb), BSB_REMAINING(bsb));
-        }
-        *buflen = BSB_REMAINING(bsb);
     }
-    return 0;
+
+    if (BSB_IS_ERROR(bsb))
+        return MOLOCH_PARSER_UNREGISTER;
+
+    // A message that isn't all here yet is handed back with the next data
+    return BSB_WORK_PTR(bsb) - data;
 }
 /******************************************************************************/
 LOCAL void smb_free(MolochSession_t UNUSED(*session), void *uw)
@@ -591,7 +559,7 @@ LOCAL void smb_classify(MolochSession_t *session, const unsigned char *data, int
 
     SMBInfo_t            *smb          = MOLOCH_TYPE_ALLOC0(SMBInfo_t);
 
-    moloch_parsers_register(session, smb_parser, smb, smb_free);
+    moloch_parsers_register_stream(session, smb_parser, smb, smb_free, NULL);
 }
 /******************************************************************************/
 void moloch_parser_init()
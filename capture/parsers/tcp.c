@@ -29,29 +29,142 @@ extern MolochConfig_t        config;
 
 extern int                   tcpMProtocol;
 
-extern MolochSessionHead_t   tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
 LOCAL int                    maxTcpOutOfOrderPackets;
+LOCAL int                    tcpCopyPayload;
+// Queue order of copied payloads, which don't have the packet ts, per packet thread
+LOCAL __thread uint32_t      tcpArrival;
 extern uint32_t              pluginsCbs;
+extern int64_t               sessionMemory[MOLOCH_MAX_PACKET_THREADS];
 
 void moloch_packet_free(MolochPacket_t *packet);
 
+// Queued tcp data counts against the session thread's memory
+#define TCP_TD_MEMORY(td) (sizeof(MolochTcpData_t) + (tcpCopyPayload ? (td)->len : (td)->packet->pktlen))
+
+#define TCP_TD_DATA(td) ((tcpCopyPayload ? (td)->chunk->data : (td)->packet->pkt) + (td)->dataOffset)
+
+#define TCP_Q_FIRST_SIZE 8
+#define TCP_CHUNK_SIZE   4096
+
+/* With tcpCopyPayload only the payload of queued data is kept, copied into
+ * the direction's current chunk, and the packet is freed right away.  A
+ * chunk is freed once nothing queued points into it and it isn't current.
+ */
+typedef struct moloch_tcp_chunk {
+    uint32_t                 refs;
+    uint32_t                 used;
+    uint32_t                 size;
+    uint8_t                  data[];
+} MolochTcpChunk_t;
+
+/* Each direction's queue is an array sorted by seq.  In order data with
+ * nothing queued is processed without being queued at all, data past a hole
+ * is appended in O(1) when it is after everything queued, and anything else
+ * is placed with a binary search.  When both directions have data queued,
+ * the order between them is by seq against the other side's ack.
+ */
+
+/******************************************************************************/
+LOCAL void tcp_chunk_unref(MolochTcpChunk_t *chunk)
+{
+    chunk->refs--;
+    if (chunk->refs == 0)
+        MOLOCH_SIZE_FREE(tcpChunk, chunk);
+}
+/******************************************************************************/
+LOCAL void tcp_td_copy(MolochTcpDataQ_t *q, MolochTcpData_t *td, const uint8_t *data)
+{
+    MolochTcpChunk_t *chunk = q->chunk;
+
+    if (!chunk || chunk->used + td->len > chunk->size) {
+        if (chunk)
+            tcp_chunk_unref(chunk);
+
+        uint32_t size = MAX(TCP_CHUNK_SIZE, td->len);
+        chunk = MOLOCH_SIZE_ALLOC(tcpChunk, sizeof(MolochTcpChunk_t) + size);
+        chunk->refs = 1;
+        chunk->used = 0;
+        chunk->size = size;
+        q->chunk = chunk;
+    }
+
+    memcpy(chunk->data + chunk->used, data, td->len);
+    td->chunk = chunk;
+    td->dataOffset = chunk->used;
+    chunk->used += td->len;
+    chunk->refs++;
+}
+/******************************************************************************/
+LOCAL void tcp_td_free(MolochSession_t *session, MolochTcpData_t *td)
+{
+    sessionMemory[session->thread] -= TCP_TD_MEMORY(td);
+    if (tcpCopyPayload)
+        tcp_chunk_unref(td->chunk);
+    else
+        moloch_packet_free(td->packet);
+}
+/******************************************************************************/
+LOCAL inline int tcp_q_count(const MolochSession_t *session)
+{
+    return session->tcpData[0].count + session->tcpData[1].count;
+}
+/******************************************************************************/
+LOCAL inline void tcp_q_pop(MolochTcpDataQ_t *q)
+{
+    q->count--;
+    q->start = q->count ? q->start + 1 : 0;
+}
+/******************************************************************************/
+// Open a slot at pos, moving down the queue first when there is no room left
+LOCAL MolochTcpData_t *tcp_q_insert(MolochTcpDataQ_t *q, int pos)
+{
+    if (q->start + q->count == q->size) {
+        if (q->size && q->start >= q->size / 2) {
+            memmove(q->tds, q->tds + q->start, q->count * sizeof(MolochTcpData_t));
+        } else {
+            int              size = q->size ? q->size * 2 : TCP_Q_FIRST_SIZE;
+            MolochTcpData_t *tds = MOLOCH_SIZE_ALLOC(tcpData, size * sizeof(MolochTcpData_t));
+
+            if (q->count)
+                memcpy(tds, q->tds + q->start, q->count * sizeof(MolochTcpData_t));
+            MOLOCH_SIZE_FREE(tcpData, q->tds);
+            q->tds = tds;
+            q->size = size;
+        }
+        q->start = 0;
+    }
+
+    MolochTcpData_t *td = q->tds + q->start + pos;
+    memmove(td + 1, td, (q->count - pos) * sizeof(MolochTcpData_t));
+    q->count++;
+    return td;
+}
 /******************************************************************************/
 void tcp_session_free(MolochSession_t *session)
 {
-    if (session->tcpData.td_count == 1 && session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH] == 1) {
-        MolochTcpData_t *ftd = DLL_PEEK_HEAD(td_, &session->tcpData);
-        const int which = ftd->packet->direction;
-        const uint8_t *data = ftd->packet->pkt + ftd->dataOffset;
+    if (tcp_q_count(session) == 1 && session->tcpFlagCnt[MOLOCH_TCPFLAG_PSH] == 1) {
+        const int which = session->tcpData[0].count ? 0 : 1;
+        const MolochTcpDataQ_t *q = &session->tcpData[which];
+        const MolochTcpData_t *ftd = q->tds + q->start;
+        const uint8_t *data = TCP_TD_DATA(ftd);
         const int len = ftd->len;
 
         moloch_parsers_classify_tcp(session, data, len, which);
         moloch_packet_process_data(session, data, len, which);
     }
 
-    MolochTcpData_t *td;
-    while (DLL_POP_HEAD(td_, &session->tcpData, td)) {
-        moloch_packet_free(td->packet);
-        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
+    int which;
+    for (which = 0; which < 2; which++) {
+        MolochTcpDataQ_t *q = &session->tcpData[which];
+        int i;
+
+        for (i = 0; i < q->count; i++) {
+            tcp_td_free(session, q->tds + q->start + i);
+        }
+        MOLOCH_SIZE_FREE(tcpData, q->tds);
+        if (q->chunk)
+            tcp_chunk_unref(q->chunk);
+        memset(q, 0, sizeof(*q));
     }
 }
 
@@ -68,69 +181,129 @@ LOCAL int64_t tcp_sequence_diff (int64_t a, int64_t b)
     return b - a;
 }
 /******************************************************************************/
-void tcp_packet_finish(MolochSession_t *session)
+// First queued entry that isn't before seq
+LOCAL int tcp_q_find(const MolochTcpDataQ_t *q, uint32_t seq)
 {
-    MolochTcpData_t            *ftd;
-    MolochTcpData_t            *next;
+    int lo = 0;
+    int hi = q->count;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (tcp_sequence_diff(q->tds[q->start + mid].seq, seq) > 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+/******************************************************************************/
+/* Does td go after prev from the other direction, it does if it starts past
+ * what prev acked, or right at it and td acked some of prev.
+ */
+LOCAL inline int tcp_td_after(const MolochTcpData_t *td, const MolochTcpData_t *prev)
+{
+    int64_t diff = tcp_sequence_diff(prev->ack, td->seq);
+    return diff > 0 || (diff == 0 && tcp_sequence_diff(td->ack, prev->seq) < 0);
+}
+/******************************************************************************/
+// Which direction's first queued entry goes next, -1 if nothing is queued
+LOCAL int tcp_q_next(const MolochSession_t *session)
+{
+    const MolochTcpDataQ_t *q0 = &session->tcpData[0];
+    const MolochTcpDataQ_t *q1 = &session->tcpData[1];
 
-    MolochTcpDataHead_t * const tcpData = &session->tcpData;
+    if (!q1->count)
+        return q0->count ? 0 : -1;
+    if (!q0->count)
+        return 1;
 
-#ifdef DEBUG_TCP
-    LOG("START %u %u", session->tcpSeq[0], session->tcpSeq[1]);
-    DLL_FOREACH(td_, tcpData, ftd) {
-        LOG("dir: %u seq: %8u ack: %8u len: %4u", ftd->packet->direction, ftd->seq, ftd->ack, ftd->len);
-    }
-#endif
+    const MolochTcpData_t *td0 = q0->tds + q0->start;
+    const MolochTcpData_t *td1 = q1->tds + q1->start;
 
-    DLL_FOREACH_REMOVABLE(td_, tcpData, ftd, next) {
-        const int which = ftd->packet->direction;
-        const uint32_t tcpSeq = session->tcpSeq[which];
+    if (tcp_td_after(td1, td0))
+        return 0;
+    if (tcp_td_after(td0, td1))
+        return 1;
 
-        /* The sequence number we are looking for is past the start of the packet */
-        if (tcpSeq >= ftd->seq) {
+    // Each acked some of the other, the one that arrived last goes first
+    if (tcpCopyPayload)
+        return (int32_t)(td1->arrival - td0->arrival) > 0 ? 1 : 0;
+    return timercmp(&td1->packet->ts, &td0->packet->ts, <) ? 0 : 1;
+}
+/******************************************************************************/
+LOCAL void tcp_data_process(MolochSession_t *session, const uint8_t *data, int len, int which)
+{
+    if (session->firstBytesLen[which] < 8) {
+        int copy = MIN(8 - session->firstBytesLen[which], len);
+        memcpy(session->cold->firstBytes[which] + session->firstBytesLen[which], data, copy);
+        session->firstBytesLen[which] += copy;
+    }
 
-            /* The sequence number we are looking for is past the end of the packet, free it */
-            if (tcpSeq >= ftd->seq + ftd->len) {
-                DLL_REMOVE(td_, tcpData, ftd);
-                moloch_packet_free(ftd->packet);
-                MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
-                continue;
-            }
+    if (session->totalDatabytes[which] == session->consumed[which]) {
+        moloch_parsers_classify_tcp(session, data, len, which);
+    }
 
-            /* This packet has the sequence number we are looking for */
-            const int offset = tcpSeq - ftd->seq;
-            const uint8_t *data = ftd->packet->pkt + ftd->dataOffset + offset;
-            const int len = ftd->len - offset;
+    moloch_packet_process_data(session, data, len, which);
+    session->tcpSeq[which] += len;
+    session->databytes[which] += len;
+    session->totalDatabytes[which] += len;
 
-            if (session->firstBytesLen[which] < 8) {
-                int copy = MIN(8 - session->firstBytesLen[which], len);
-                memcpy(session->firstBytes[which] + session->firstBytesLen[which], data, copy);
-                session->firstBytesLen[which] += copy;
-            }
+    if (config.yara && config.yaraEveryPacket && !session->stopYara) {
+        moloch_yara_execute(session, data, len, 0);
+    }
 
-            if (session->totalDatabytes[which] == session->consumed[which]) {
-                moloch_parsers_classify_tcp(session, data, len, which);
-            }
+    if (pluginsCbs & MOLOCH_PLUGIN_TCP)
+        moloch_plugins_cb_tcp(session, data, len, which);
+}
+/******************************************************************************/
+/* Process queued data until the next entry is past a hole.  Returns 1 if
+ * packet was taken off the queue, the caller frees it then.
+ */
+int tcp_packet_finish(MolochSession_t *session, const MolochPacket_t *packet)
+{
+    int which;
+    int done = 0;
+
+#ifdef DEBUG_TCP
+    LOG("START %u %u", session->tcpSeq[0], session->tcpSeq[1]);
+    for (which = 0; which < 2; which++) {
+        const MolochTcpDataQ_t *q = &session->tcpData[which];
+        int i;
+        for (i = 0; i < q->count; i++) {
+            const MolochTcpData_t *ftd = q->tds + q->start + i;
+            LOG("dir: %u seq: %8u ack: %8u len: %4u", which, ftd->seq, ftd->ack, ftd->len);
+        }
+    }
+#endif
 
-            moloch_packet_process_data(session, data, len, which);
-            session->tcpSeq[which] += len;
-            session->databytes[which] += len;
-            session->totalDatabytes[which] += len;
+    while ((which = tcp_q_next(session)) != -1) {
+        MolochTcpDataQ_t * const q = &session->tcpData[which];
+        MolochTcpData_t * const ftd = q->tds + q->start;
+        const uint32_t tcpSeq = session->tcpSeq[which];
 
-            if (config.yara && config.yaraEveryPacket && !session->stopYara) {
-                moloch_yara_execute(session, data, len, 0);
-            }
+        /* The sequence number we are looking for is before the start of the packet */
+        if (tcpSeq < ftd->seq)
+            break;
 
-            if (pluginsCbs & MOLOCH_PLUGIN_TCP)
-                moloch_plugins_cb_tcp(session, data, len, which);
+        /* Unless the sequence number we are looking for is past the end of the packet, process it */
+        if (tcpSeq < ftd->seq + ftd->len) {
+            const int offset = tcpSeq - ftd->seq;
+            tcp_data_process(session, TCP_TD_DATA(ftd) + offset, ftd->len - offset, which);
+        }
 
-            DLL_REMOVE(td_, tcpData, ftd);
-            moloch_packet_free(ftd->packet);
-            MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
+        if (!tcpCopyPayload && ftd->packet == packet) {
+            sessionMemory[session->thread] -= TCP_TD_MEMORY(ftd);
+            done = 1;
         } else {
-            return;
+            tcp_td_free(session, ftd);
         }
+        tcp_q_pop(q);
+
+        // Start the current chunk over once nothing queued is using it
+        if (q->count == 0 && q->chunk && q->chunk->refs == 1)
+            q->chunk->used = 0;
     }
+    return done;
 }
 /******************************************************************************/
 SUPPRESS_ALIGNMENT
@@ -159,8 +332,8 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
     }
 
     // add to the long open
-    if (!session->tcp_next) {
-        DLL_PUSH_TAIL(tcp_, &tcpWriteQ[session->thread], session);
+    if (!session->saveTimer.tm_next) {
+        moloch_session_long_open(session);
     }
 
     if (tcphdr->th_flags & TH_SYN) {
@@ -231,9 +404,7 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
         session->tcpSeq[packet->direction] = seq;
     }
 
-    MolochTcpDataHead_t * const tcpData = &session->tcpData;
-
-    if (DLL_COUNT(td_, tcpData) > maxTcpOutOfOrderPackets) {
+    if (tcp_q_count(session) > maxTcpOutOfOrderPackets) {
         tcp_session_free(session);
         moloch_session_add_tag(session, "incomplete-tcp");
         session->stopTCP = 1;
@@ -275,69 +446,63 @@ int tcp_packet_process(MolochSession_t * const session, MolochPacket_t * const p
     if (session->haveTcpSession && diff <= 0)
         return 1;
 
-    MolochTcpData_t *ftd, *td = MOLOCH_TYPE_ALLOC(MolochTcpData_t);
-    const uint32_t ack = ntohl(tcphdr->th_ack);
-
-    td->packet = packet;
-    td->ack = ack;
-    td->seq = seq;
-    td->len = len;
-    td->dataOffset = packet->payloadOffset + 4*tcphdr->th_off;
+    const int which = packet->direction;
+    const uint16_t dataOffset = packet->payloadOffset + 4*tcphdr->th_off;
 
 #ifdef DEBUG_TCP
-    LOG("dir: %u seq: %u ack: %u len: %d diff0: %" PRIu64, packet->direction, seq, ack, len, diff);
+    LOG("dir: %u seq: %u ack: %u len: %d diff0: %" PRIu64, which, seq, ntohl(tcphdr->th_ack), len, diff);
 #endif
 
-    if (DLL_COUNT(td_, tcpData) == 0) {
-        DLL_PUSH_TAIL(td_, tcpData, td);
-    } else {
-        uint32_t sortA, sortB;
-        DLL_FOREACH_REVERSE(td_, tcpData, ftd) {
-            if (packet->direction == ftd->packet->direction) {
-                sortA = seq;
-                sortB = ftd->seq;
-            } else {
-                sortA = seq;
-                sortB = ftd->ack;
-            }
-
-            diff = tcp_sequence_diff(sortB, sortA);
-            if (diff == 0) {
-                if (packet->direction == ftd->packet->direction) {
-                    if (td->len > ftd->len) {
-                        DLL_ADD_AFTER(td_, tcpData, ftd, td);
-
-                        DLL_REMOVE(td_, tcpData, ftd);
-                        moloch_packet_free(ftd->packet);
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, ftd);
-                        ftd = td;
-                    } else {
-                        MOLOCH_TYPE_FREE(MolochTcpData_t, td);
-                        return 1;
-                    }
-                    break;
-                } else if (tcp_sequence_diff(ack, ftd->seq) < 0) {
-                    DLL_ADD_AFTER(td_, tcpData, ftd, td);
-                    break;
-                }
-            } else if (diff > 0) {
-                DLL_ADD_AFTER(td_, tcpData, ftd, td);
-                break;
-            }
+    // Nothing queued and no hole, no need to queue it
+    if (tcp_q_count(session) == 0 && session->tcpSeq[which] >= seq) {
+        const uint32_t tcpSeq = session->tcpSeq[which];
+        if (tcpSeq < seq + len) {
+            const int offset = tcpSeq - seq;
+            tcp_data_process(session, packet->pkt + dataOffset + offset, len - offset, which);
         }
+        return 1;
+    }
 
-        if ((void*)ftd == (void*)tcpData) {
-            DLL_PUSH_HEAD(td_, tcpData, td);
-        }
+    MolochTcpDataQ_t * const q = &session->tcpData[which];
+    const int queued = tcp_q_count(session);
+    MolochTcpData_t *td = NULL;
+    int pos = q->count;
+
+    if (q->count && tcp_sequence_diff(q->tds[q->start + q->count - 1].seq, seq) <= 0) {
+        pos = tcp_q_find(q, seq);
 
-        if (session->haveTcpSession && (session->outOfOrder & (1 << packet->direction)) == 0) {
-            static const char *tags[2] = {"out-of-order-src", "out-of-order-dst"};
-            moloch_session_add_tag(session, tags[packet->direction]);
-            session->outOfOrder |= (1 << packet->direction);
+        // Same seq, keep the longer one
+        if (pos < q->count && q->tds[q->start + pos].seq == seq) {
+            td = q->tds + q->start + pos;
+            if (len <= td->len)
+                return 1;
+            tcp_td_free(session, td);
+            pos = -1;
         }
     }
 
-    return 0;
+    if (pos != -1)
+        td = tcp_q_insert(q, pos);
+
+    td->ack = ntohl(tcphdr->th_ack);
+    td->seq = seq;
+    td->len = len;
+    if (tcpCopyPayload) {
+        td->arrival = tcpArrival++;
+        tcp_td_copy(q, td, packet->pkt + dataOffset);
+    } else {
+        td->packet = packet;
+        td->dataOffset = dataOffset;
+    }
+
+    if (queued && session->haveTcpSession && (session->outOfOrder & (1 << which)) == 0) {
+        static const char *tags[2] = {"out-of-order-src", "out-of-order-dst"};
+        moloch_session_add_tag(session, tags[which]);
+        session->outOfOrder |= (1 << which);
+    }
+
+    sessionMemory[session->thread] += TCP_TD_MEMORY(td);
+    return tcpCopyPayload;
 }
 
 /******************************************************************************/
@@ -413,13 +578,15 @@ int tcp_pre_process(MolochSession_t *session, MolochPacket_t * const packet, int
 int tcp_process(MolochSession_t *session, MolochPacket_t * const packet)
 {
     int freePacket = tcp_packet_process(session, packet);
-    tcp_packet_finish(session);
+    if (tcp_packet_finish(session, packet))
+        freePacket = 1;
     return freePacket;
 }
 /******************************************************************************/
 void moloch_parser_init()
 {
     maxTcpOutOfOrderPackets = moloch_config_int(NULL, "maxTcpOutOfOrderPackets", 256, 64, 10000);
+    tcpCopyPayload = moloch_config_boolean(NULL, "tcpCopyPayload", FALSE);
 
     tcpMProtocol = moloch_mprotocol_register("tcp",
                                              SESSION_TCP,
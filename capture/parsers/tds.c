@@ -14,50 +14,34 @@
  */
 #include "moloch.h"
 
-#define TDS_MAX_SIZE 4096
-typedef struct {
-    unsigned char  data[2][TDS_MAX_SIZE];
-    int            pos[2];
-} TDSInfo_t;
-
 extern MolochConfig_t        config;
 LOCAL  int userField;
 
 /******************************************************************************/
-LOCAL int tds_parser(MolochSession_t *session, void *uw, const unsigned char *data, int remaining, int which)
+LOCAL int tds_parser(MolochSession_t *session, void *UNUSED(uw), const unsigned char *data, int remaining, int which)
 {
-    TDSInfo_t *tds = uw;
-
-    remaining = MIN(remaining, TDS_MAX_SIZE - tds->pos[which]);
-    memcpy(tds->data[which] + tds->pos[which], data, remaining);
-    tds->pos[which] += remaining;
+    // Only the client login is interesting
+    if (which != 0)
+        return remaining;
 
     // Lots of info from http://www.freetds.org/tds.html
 
-    if (tds->pos[0] > 598) {
+    if (remaining <= 598)
+        return 0;
+
 #if 0
-        LOG("host:%.*s user:%.*s pass:%.*s process:%.*s app:%.*s server:%.*s lib:%.*s",
-                tds->data[0][38], tds->data[0] + 8,
-                tds->data[0][69], tds->data[0] + 39,
-                tds->data[0][100], tds->data[0] + 70,
-                tds->data[0][131], tds->data[0] + 101,
-                tds->data[0][178], tds->data[0] + 148,
-                tds->data[0][209], tds->data[0] + 179,
-                tds->data[0][480], tds->data[0] + 470
-                );
+    LOG("host:%.*s user:%.*s pass:%.*s process:%.*s app:%.*s server:%.*s lib:%.*s",
+            data[38], data + 8,
+            data[69], data + 39,
+            data[100], data + 70,
+            data[131], data + 101,
+            data[178], data + 148,
+            data[209], data + 179,
+            data[480], data + 470
+            );
 #endif
-        moloch_field_string_add_lower(userField, session, (const char *)tds->data[0] + 39, tds->data[0][69]);
-        moloch_parsers_unregister(session, uw);
-    }
-
-    return 0;
-}
-/******************************************************************************/
-LOCAL void tds_free(MolochSession_t UNUSED(*session), void *uw)
-{
-    TDSInfo_t            *tds          = uw;
-
-    MOLOCH_TYPE_FREE(TDSInfo_t, tds);
+    moloch_field_string_add_lower(userField, session, (const char *)data + 39, data[69]);
+    return MOLOCH_PARSER_UNREGISTER;
 }
 /******************************************************************************/
 LOCAL void tds_classify(MolochSession_t *session, const unsigned char *UNUSED(data), int len, int which, void *UNUSED(uw))
@@ -67,10 +51,7 @@ LOCAL void tds_classify(MolochSession_t *session, const unsigned char *UNUSED(da
 
     moloch_session_add_protocol(session, "tds");
 
-    TDSInfo_t            *tds          = MOLOCH_TYPE_ALLOC(TDSInfo_t);
-    tds->pos[0] = tds->pos[1] = 0;
-
-    moloch_parsers_register(session, tds_parser, tds, tds_free);
+    moloch_parsers_register_stream(session, tds_parser, NULL, NULL, NULL);
 }
 /******************************************************************************/
 void moloch_parser_init()
@@ -29,8 +29,6 @@ LOCAL  int                   ja3StrField;
 LOCAL  int                   ja3sStrField;
 
 typedef struct {
-    unsigned char       buf[8192];
-    uint16_t            len;
     char                which;
 } TLSInfo_t;
 
@@ -691,51 +689,39 @@ LOCAL int tls_parser(MolochSession_t *session, void *uw, const unsigned char *da
 
     // If not the server half ignore
     if (which != tls->which)
-        return 0;
-
-    // Copy the data we have
-    memcpy(tls->buf + tls->len, data, MIN(remaining, (int)sizeof(tls->buf)-tls->len));
-    tls->len += MIN(remaining, (int)sizeof(tls->buf)-tls->len);
-
-    // Make sure we have header
-    if (tls->len < 5)
-        return 0;
+        return remaining;
 
-    // Not handshake protocol, stop looking
-    if (tls->buf[0] != 0x16) {
-        tls->len = 0;
-        moloch_parsers_unregister(session, uw);
-        return 0;
-    }
-
-    // Need the whole record
-    int need = ((tls->buf[3] << 8) | tls->buf[4]) + 5;
-    if (need > tls->len)
-        return 0;
+    int used = 0;
+    while (remaining - used >= 5) {
+        // Not handshake protocol, stop looking
+        if (data[used] != 0x16)
+            return MOLOCH_PARSER_UNREGISTER;
 
-    if (tls_process_server_handshake_record(session, tls->buf + 5, need - 5)) {
-        tls->len = 0;
-        moloch_parsers_unregister(session, uw);
-        return 0;
-    }
-    tls->len -= need;
+        // Need the whole record
+        int need = ((data[used + 3] << 8) | data[used + 4]) + 5;
+        if (remaining - used < need)
+            break;
 
-    // Still more data to process
-    if (tls->len) {
-        memmove(tls->buf, tls->buf+need, tls->len);
-        return 0;
+        if (tls_process_server_handshake_record(session, data + used + 5, need - 5))
+            return MOLOCH_PARSER_UNREGISTER;
+        used += need;
     }
 
-    return 0;
+    return used;
 }
 /******************************************************************************/
-LOCAL void tls_save(MolochSession_t *session, void *uw, int UNUSED(final))
+LOCAL void tls_save(MolochSession_t *session, void *uw, int final)
 {
     TLSInfo_t            *tls          = uw;
 
-    if (tls->len > 5 && tls->buf[0] == 0x16) {
-        tls_process_server_handshake_record(session, tls->buf+5, tls->len-5);
-        tls->len = 0;
+    // The rest of the record isn't coming, use what there is
+    if (!final)
+        return;
+
+    int len;
+    const uint8_t *data = moloch_parsers_stream_leftover(session, uw, tls->which, &len);
+    if (len > 5 && data[0] == 0x16) {
+        tls_process_server_handshake_record(session, data + 5, len - 5);
     }
 }
 /******************************************************************************/
@@ -764,9 +750,8 @@ LOCAL void tls_classify(MolochSession_t *session, const unsigned char *data, int
         moloch_session_add_protocol(session, "tls");
 
         TLSInfo_t  *tls = MOLOCH_TYPE_ALLOC(TLSInfo_t);
-        tls->len        = 0;
 
-        moloch_parsers_register2(session, tls_parser, tls, tls_free, tls_save);
+        moloch_parsers_register_stream(session, tls_parser, tls, tls_free, tls_save);
 
         if (data[5] == 1) {
             tls_process_client(session, data, (int)len);
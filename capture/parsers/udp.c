@@ -85,7 +85,7 @@ int udp_process(MolochSession_t *session, MolochPacket_t * const packet)
 
     if (session->firstBytesLen[packet->direction] == 0) {
         session->firstBytesLen[packet->direction] = MIN(8, len);
-        memcpy(session->firstBytes[packet->direction], data, session->firstBytesLen[packet->direction]);
+        memcpy(session->cold->firstBytes[packet->direction], data, session->firstBytesLen[packet->direction]);
 
         moloch_parsers_classify_udp(session, data, len, packet->direction);
 
@@ -97,12 +97,12 @@ int udp_process(MolochSession_t *session, MolochPacket_t * const packet)
     int i;
     for (i = 0; i < session->parserNum; i++) {
         if (session->parserInfo[i].parserFunc) {
-            int consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data, len, packet->direction);
+            // Datagrams aren't a stream, stream parsers get each one as is
+            int consumed;
+            MOLOCH_PARSER_STATS(session->thread, session->parserInfo[i].statsId, len,
+                                consumed = session->parserInfo[i].parserFunc(session, session->parserInfo[i].uw, data, len, packet->direction));
             if (consumed == MOLOCH_PARSER_UNREGISTER) {
-                if (session->parserInfo[i].parserFreeFunc) {
-                    session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
-                }
-                memset(&session->parserInfo[i], 0, sizeof(session->parserInfo[i]));
+                moloch_parsers_free_info(session, &session->parserInfo[i]);
                 continue;
             }
         }
@@ -34,6 +34,7 @@ typedef struct moloch_plugin {
     short                        p_count;
 
     int                          num;
+    int                          statsId;
 
     MolochPluginIpFunc           ipFunc;
     MolochPluginUdpFunc          udpFunc;
@@ -150,6 +151,7 @@ int moloch_plugins_register_internal(const char *            name,
 
     plugin = MOLOCH_TYPE_ALLOC0(MolochPlugin_t);
     plugin->name = strdup(name);
+    plugin->statsId = moloch_parsers_stats_id(name);
     if (storeData) {
         plugin->num  = config.numPlugins++;
     } else {
@@ -323,7 +325,7 @@ void moloch_plugins_cb_pre_save(MolochSession_t *session, int final)
 
     HASH_FORALL(p_, plugins, plugin,
         if (plugin->preSaveFunc)
-            plugin->preSaveFunc(session, final);
+            MOLOCH_PARSER_STATS(session->thread, plugin->statsId, 0, plugin->preSaveFunc(session, final));
     );
 }
 /******************************************************************************/
@@ -333,7 +335,7 @@ void moloch_plugins_cb_save(MolochSession_t *session, int final)
 
     HASH_FORALL(p_, plugins, plugin,
         if (plugin->saveFunc)
-            plugin->saveFunc(session, final);
+            MOLOCH_PARSER_STATS(session->thread, plugin->statsId, 0, plugin->saveFunc(session, final));
     );
 }
 /******************************************************************************/
@@ -343,7 +345,7 @@ void moloch_plugins_cb_new(MolochSession_t *session)
 
     HASH_FORALL(p_, plugins, plugin,
         if (plugin->newFunc)
-            plugin->newFunc(session);
+            MOLOCH_PARSER_STATS(session->thread, plugin->statsId, 0, plugin->newFunc(session));
     );
 }
 /******************************************************************************/
@@ -353,7 +355,7 @@ void moloch_plugins_cb_tcp(MolochSession_t *session, const unsigned char *data,
 
     HASH_FORALL(p_, plugins, plugin,
         if (plugin->tcpFunc)
-            plugin->tcpFunc(session, data, len, which);
+            MOLOCH_PARSER_STATS(session->thread, plugin->statsId, len, plugin->tcpFunc(session, data, len, which));
     );
 }
 /******************************************************************************/
@@ -363,7 +365,7 @@ void moloch_plugins_cb_udp(MolochSession_t *session, const unsigned char *data,
 
     HASH_FORALL(p_, plugins, plugin,
         if (plugin->udpFunc)
-            plugin->udpFunc(session, data, len, which);
+            MOLOCH_PARSER_STATS(session->thread, plugin->statsId, len, plugin->udpFunc(session, data, len, which));
     );
 }
 /******************************************************************************/
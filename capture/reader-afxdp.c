@@ -0,0 +1,559 @@
+/******************************************************************************/
+/* reader-afxdp.c  -- Reader using AF_XDP sockets
+ *
+ * Copyright 2012-2017 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * One XSK socket per interface queue, each with its own UMEM.  Frames are
+ * handed to the packet threads without copying and only go back on the fill
+ * ring once moloch_packet_free is called on them.
+ *
+ * Ideas from
+ * https://www.kernel.org/doc/html/latest/networking/af_xdp.html
+ * linux samples/bpf/xdpsock_user.c
+ *
+ */
+
+#include "moloch.h"
+extern MolochConfig_t        config;
+
+#ifndef __linux
+void reader_afxdp_init(char *UNUSED(name))
+{
+    LOGEXIT("afxdp not supported");
+}
+#else
+
+#include "pcap.h"
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <poll.h>
+
+#ifndef XDP_UMEM_UNALIGNED_CHUNK_FLAG
+void reader_afxdp_init(char *UNUSED(name))
+{
+    LOGEXIT("afxdp not supported, might need newer kernel headers");
+}
+
+#else
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+/* Just enough of linux/bpf.h to load the redirect program, the real header
+ * can't be included with pcap.h since both define struct bpf_insn.
+ */
+#define MOLOCH_BPF_MAP_CREATE          0
+#define MOLOCH_BPF_MAP_UPDATE_ELEM     2
+#define MOLOCH_BPF_PROG_LOAD           5
+#define MOLOCH_BPF_PROG_TYPE_XDP       6
+#define MOLOCH_BPF_MAP_TYPE_XSKMAP     17
+#define MOLOCH_BPF_FUNC_REDIRECT_MAP   51
+#define MOLOCH_BPF_PSEUDO_MAP_FD       1
+#define MOLOCH_BPF_REG_1               1
+#define MOLOCH_BPF_REG_2               2
+#define MOLOCH_BPF_REG_3               3
+#define MOLOCH_XDP_PASS                2
+#define MOLOCH_XDP_MD_RX_QUEUE_INDEX   16
+
+typedef struct {
+    uint8_t   code;
+    uint8_t   dst_reg:4;
+    uint8_t   src_reg:4;
+    int16_t   off;
+    int32_t   imm;
+} MolochEbpfInsn_t;
+
+typedef struct {
+    uint32_t  map_type;
+    uint32_t  key_size;
+    uint32_t  value_size;
+    uint32_t  max_entries;
+    uint32_t  map_flags;
+} MolochBpfMapCreate_t;
+
+typedef struct {
+    uint32_t  map_fd;
+    uint32_t  pad;
+    uint64_t  key;
+    uint64_t  value;
+    uint64_t  flags;
+} MolochBpfMapUpdate_t;
+
+typedef struct {
+    uint32_t  prog_type;
+    uint32_t  insn_cnt;
+    uint64_t  insns;
+    uint64_t  license;
+    uint32_t  log_level;
+    uint32_t  log_size;
+    uint64_t  log_buf;
+} MolochBpfProgLoad_t;
+
+#define MOLOCH_AFXDP_MAX_QUEUES 64
+#define MOLOCH_AFXDP_BATCH      64
+
+typedef struct {
+    uint32_t            *producer;
+    uint32_t            *consumer;
+    void                *ring;
+    uint32_t             mask;
+    uint32_t             size;
+    void                *map;
+    size_t               mapLen;
+} MolochAfXdpRing_t;
+
+typedef struct {
+    int                  fd;
+    int                  interface;
+    int                  queue;
+    uint8_t             *umem;
+    MolochAfXdpRing_t    fill;
+    MolochAfXdpRing_t    comp;
+    MolochAfXdpRing_t    rx;
+    uint64_t             total;
+    MOLOCH_LOCK_EXTERN(fill);
+} MolochAfXdp_t;
+
+LOCAL MolochAfXdp_t     *xsks;
+LOCAL int                numXsks;
+LOCAL int                numQueues;
+LOCAL uint8_t           *umemBase;
+LOCAL uint64_t           umemSize;
+LOCAL uint32_t           frameSize;
+LOCAL uint32_t           numFrames;
+LOCAL uint32_t           xdpFlags;
+LOCAL uint8_t            zeroCopyId;
+
+LOCAL int                ifindexes[MAX_INTERFACES];
+LOCAL int                mapFds[MAX_INTERFACES];
+
+extern MolochPcapFileHdr_t   pcapFileHeader;
+LOCAL struct bpf_program     bpf;
+
+/******************************************************************************/
+LOCAL int reader_afxdp_bpf(int cmd, void *attr, int len)
+{
+    return syscall(__NR_bpf, cmd, attr, len);
+}
+/******************************************************************************/
+/* Load the smallest possible XDP program, which redirects every packet to the
+ * XSK bound to the rx queue it arrived on, or passes it to the stack if there
+ * isn't one.
+ */
+LOCAL int reader_afxdp_load_prog(int mapFd)
+{
+    MolochEbpfInsn_t prog[] = {
+        // r2 = ctx->rx_queue_index
+        { .code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = MOLOCH_BPF_REG_2, .src_reg = MOLOCH_BPF_REG_1, .off = MOLOCH_XDP_MD_RX_QUEUE_INDEX },
+        // r1 = xsks map
+        { .code = BPF_LD | 0x18 /*BPF_DW*/ | BPF_IMM, .dst_reg = MOLOCH_BPF_REG_1, .src_reg = MOLOCH_BPF_PSEUDO_MAP_FD, .imm = mapFd },
+        { .code = 0 },
+        // r3 = XDP_PASS, the action when no socket is at the index
+        { .code = 0x07 /*BPF_ALU64*/ | 0xb0 /*BPF_MOV*/ | BPF_K, .dst_reg = MOLOCH_BPF_REG_3, .imm = MOLOCH_XDP_PASS },
+        // r0 = bpf_redirect_map(r1, r2, r3)
+        { .code = BPF_JMP | 0x80 /*BPF_CALL*/, .imm = MOLOCH_BPF_FUNC_REDIRECT_MAP },
+        // return r0
+        { .code = BPF_JMP | 0x90 /*BPF_EXIT*/ }
+    };
+
+    char log[4096];
+    MolochBpfProgLoad_t attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = MOLOCH_BPF_PROG_TYPE_XDP;
+    attr.insns     = (uint64_t)(long)prog;
+    attr.insn_cnt  = sizeof(prog)/sizeof(prog[0]);
+    attr.license   = (uint64_t)(long)"Dual BSD/GPL";
+    attr.log_buf   = (uint64_t)(long)log;
+    attr.log_size  = sizeof(log);
+    attr.log_level = 1;
+    log[0] = 0;
+
+    int fd = reader_afxdp_bpf(MOLOCH_BPF_PROG_LOAD, &attr, sizeof(attr));
+    if (fd < 0)
+        LOGEXIT("ERROR - Couldn't load afxdp program: %s\n%s", strerror(errno), log);
+    return fd;
+}
+/******************************************************************************/
+/* Attach (or detach when progFd is -1) an XDP program to an interface using
+ * a RTM_SETLINK netlink request.
+ */
+LOCAL int reader_afxdp_set_link(int ifindex, int progFd, uint32_t flags)
+{
+    struct {
+        struct nlmsghdr  nh;
+        struct ifinfomsg ifinfo;
+        char             attrbuf[64];
+    } req;
+    char buf[4096];
+
+    int sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (sock < 0)
+        return -errno;
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len      = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_flags    = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_type     = RTM_SETLINK;
+    req.nh.nlmsg_seq      = 1;
+    req.ifinfo.ifi_family = AF_UNSPEC;
+    req.ifinfo.ifi_index  = ifindex;
+
+    struct rtattr *nest = (struct rtattr *)(((char *)&req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+    nest->rta_type = NLA_F_NESTED | IFLA_XDP;
+    nest->rta_len  = RTA_LENGTH(0);
+
+    struct rtattr *rta = (struct rtattr *)((char *)nest + RTA_ALIGN(nest->rta_len));
+    rta->rta_type = IFLA_XDP_FD;
+    rta->rta_len  = RTA_LENGTH(sizeof(int));
+    memcpy(RTA_DATA(rta), &progFd, sizeof(int));
+    nest->rta_len += RTA_ALIGN(rta->rta_len);
+
+    if (flags) {
+        rta = (struct rtattr *)((char *)nest + RTA_ALIGN(nest->rta_len));
+        rta->rta_type = IFLA_XDP_FLAGS;
+        rta->rta_len  = RTA_LENGTH(sizeof(uint32_t));
+        memcpy(RTA_DATA(rta), &flags, sizeof(uint32_t));
+        nest->rta_len += RTA_ALIGN(rta->rta_len);
+    }
+
+    req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + nest->rta_len;
+
+    int rc = 0;
+    if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+        rc = -errno;
+    } else {
+        int len = recv(sock, buf, sizeof(buf), 0);
+        if (len < 0) {
+            rc = -errno;
+        } else {
+            struct nlmsghdr *nh = (struct nlmsghdr *)buf;
+            if (NLMSG_OK(nh, (uint32_t)len) && nh->nlmsg_type == NLMSG_ERROR) {
+                rc = ((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+            }
+        }
+    }
+    close(sock);
+    return rc;
+}
+/******************************************************************************/
+LOCAL void reader_afxdp_map_ring(MolochAfXdp_t *xsk, MolochAfXdpRing_t *ring, struct xdp_ring_offset *off, size_t entrySize, off_t pgoff)
+{
+    ring->mapLen = off->desc + ring->size * entrySize;
+    ring->map = mmap(NULL, ring->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+    if (unlikely(ring->map == MAP_FAILED)) {
+        LOGEXIT("ERROR - MMap failure in reader_afxdp_init for %s queue %d, %d: %s", config.interface[xsk->interface], xsk->queue, errno, strerror(errno));
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->ring     = (uint8_t *)ring->map + off->desc;
+    ring->mask     = ring->size - 1;
+}
+/******************************************************************************/
+/* Only called with the xsk fill lock held, or before the reader threads start */
+LOCAL inline void reader_afxdp_fill(MolochAfXdp_t *xsk, uint64_t addr)
+{
+    uint32_t prod = *xsk->fill.producer;
+    ((uint64_t *)xsk->fill.ring)[prod & xsk->fill.mask] = addr;
+    __atomic_store_n(xsk->fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+/******************************************************************************/
+/* Called by moloch_packet_free from any packet thread when the last user of a
+ * frame is done with it.
+ */
+LOCAL void reader_afxdp_release(MolochPacket_t * const packet)
+{
+    uint64_t offset = packet->pkt - umemBase;
+    MolochAfXdp_t *xsk = &xsks[offset / umemSize];
+    uint64_t addr = (offset % umemSize) & ~((uint64_t)frameSize - 1);
+
+    MOLOCH_LOCK(xsk->fill);
+    reader_afxdp_fill(xsk, addr);
+    MOLOCH_UNLOCK(xsk->fill);
+}
+/******************************************************************************/
+int reader_afxdp_stats(MolochReaderStats_t *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < numXsks; i++) {
+        // Older kernels only fill in the first 3 counters of xdp_statistics
+        uint64_t xstats[6];
+        socklen_t len = sizeof(xstats);
+        memset(xstats, 0, sizeof(xstats));
+        if (getsockopt(xsks[i].fd, SOL_XDP, XDP_STATISTICS, xstats, &len) == 0) {
+            // rx_dropped + rx_ring_full + rx_fill_ring_empty_descs
+            stats->dropped += xstats[0] + xstats[3] + xstats[4];
+        }
+        stats->total += xsks[i].total;
+    }
+    stats->total += stats->dropped;
+    return 0;
+}
+/******************************************************************************/
+LOCAL void *reader_afxdp_thread(gpointer xskv)
+{
+    MolochAfXdp_t *xsk = xskv;
+    struct pollfd pfd;
+
+    memset(&pfd, 0, sizeof(pfd));
+    pfd.fd = xsk->fd;
+    pfd.events = POLLIN | POLLERR;
+
+    MolochPacketBatch_t batch;
+    moloch_packet_batch_init(&batch);
+
+    struct xdp_desc *descs = xsk->rx.ring;
+
+    while (!config.quitting) {
+        uint32_t cons = *xsk->rx.consumer;
+        uint32_t avail = __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE) - cons;
+
+        if (avail == 0) {
+            poll(&pfd, 1, 1000);
+            continue;
+        }
+
+        if (avail > MOLOCH_AFXDP_BATCH)
+            avail = MOLOCH_AFXDP_BATCH;
+
+        // AF_XDP doesn't timestamp packets, use one time for the whole batch
+        struct timeval ts;
+        gettimeofday(&ts, NULL);
+
+        uint32_t p;
+        for (p = 0; p < avail; p++) {
+            struct xdp_desc *desc = &descs[(cons + p) & xsk->rx.mask];
+            uint8_t *pkt = xsk->umem + desc->addr;
+
+            if (config.bpf && !bpf_filter(bpf.bf_insns, pkt, desc->len, desc->len)) {
+                MOLOCH_LOCK(xsk->fill);
+                reader_afxdp_fill(xsk, desc->addr & ~((uint64_t)frameSize - 1));
+                MOLOCH_UNLOCK(xsk->fill);
+                continue;
+            }
+
+            MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
+            packet->pkt           = pkt;
+            packet->pktlen        = desc->len;
+            packet->ts            = ts;
+            packet->readerPos     = xsk->interface;
+            packet->zeroCopy      = zeroCopyId;
+
+            moloch_packet_batch(&batch, packet);
+        }
+        __atomic_store_n(xsk->rx.consumer, cons + avail, __ATOMIC_RELEASE);
+        xsk->total += avail;
+
+        moloch_packet_batch_flush(&batch);
+    }
+    return NULL;
+}
+/******************************************************************************/
+void reader_afxdp_start() {
+    int i;
+    char name[100];
+    for (i = 0; i < numXsks; i++) {
+        snprintf(name, sizeof(name), "moloch-xdp%d-%d", xsks[i].interface, xsks[i].queue);
+        g_thread_unref(g_thread_new(name, &reader_afxdp_thread, &xsks[i]));
+    }
+}
+/******************************************************************************/
+void reader_afxdp_exit()
+{
+    int i;
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        reader_afxdp_set_link(ifindexes[i], -1, xdpFlags);
+        close(mapFds[i]);
+    }
+
+    for (i = 0; i < numXsks; i++) {
+        close(xsks[i].fd);
+    }
+}
+/******************************************************************************/
+LOCAL void reader_afxdp_xsk_init(MolochAfXdp_t *xsk, int ringSize, uint16_t bindFlags)
+{
+    MOLOCH_LOCK_INIT(xsk->fill);
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0)
+        LOGEXIT("ERROR - Couldn't create AF_XDP socket, might need a newer kernel: %s", strerror(errno));
+
+    struct xdp_umem_reg mr;
+    memset(&mr, 0, sizeof(mr));
+    mr.addr       = (uint64_t)(long)xsk->umem;
+    mr.len        = umemSize;
+    mr.chunk_size = frameSize;
+    mr.headroom   = 0;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0)
+        LOGEXIT("ERROR - Couldn't register UMEM: %s", strerror(errno));
+
+    xsk->fill.size = numFrames;
+    xsk->comp.size = 64;
+    xsk->rx.size   = ringSize;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &xsk->fill.size, sizeof(uint32_t)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &xsk->comp.size, sizeof(uint32_t)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &xsk->rx.size, sizeof(uint32_t)) < 0)
+        LOGEXIT("ERROR - Couldn't size AF_XDP rings: %s", strerror(errno));
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+        LOGEXIT("ERROR - Couldn't get AF_XDP mmap offsets: %s", strerror(errno));
+
+    reader_afxdp_map_ring(xsk, &xsk->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+    reader_afxdp_map_ring(xsk, &xsk->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+    reader_afxdp_map_ring(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+
+    // Every frame starts out owned by the kernel
+    uint32_t f;
+    for (f = 0; f < numFrames; f++) {
+        reader_afxdp_fill(xsk, (uint64_t)f * frameSize);
+    }
+
+    struct sockaddr_xdp sxdp;
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family   = AF_XDP;
+    sxdp.sxdp_flags    = bindFlags;
+    sxdp.sxdp_ifindex  = ifindexes[xsk->interface];
+    sxdp.sxdp_queue_id = xsk->queue;
+
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+        LOGEXIT("ERROR - Couldn't bind AF_XDP socket to %s queue %d: %s", config.interface[xsk->interface], xsk->queue, strerror(errno));
+
+    MolochBpfMapUpdate_t attr;
+    uint32_t key = xsk->queue;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = mapFds[xsk->interface];
+    attr.key    = (uint64_t)(long)&key;
+    attr.value  = (uint64_t)(long)&xsk->fd;
+    if (reader_afxdp_bpf(MOLOCH_BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr)) < 0)
+        LOGEXIT("ERROR - Couldn't add AF_XDP socket to xsks map: %s", strerror(errno));
+}
+/******************************************************************************/
+void reader_afxdp_init(char *UNUSED(name))
+{
+    int i, q;
+
+    numQueues = moloch_config_int(NULL, "afxdpNumQueues", 1, 1, MOLOCH_AFXDP_MAX_QUEUES);
+    frameSize = moloch_config_int(NULL, "afxdpFrameSize", 4096, 2048, 4096);
+    numFrames = moloch_config_int(NULL, "afxdpNumFrames", 16384, 1024, 1<<20);
+    int ringSize = moloch_config_int(NULL, "afxdpRingSize", 4096, 64, 1<<16);
+    char *mode = moloch_config_str(NULL, "afxdpMode", "auto");
+
+    // Kernel requires power of 2 sizes for everything
+    frameSize = moloch_get_next_powerof2(frameSize);
+    numFrames = moloch_get_next_powerof2(numFrames);
+    ringSize = moloch_get_next_powerof2(ringSize);
+    umemSize = (uint64_t)numFrames * frameSize;
+
+    uint16_t bindFlags = 0;
+    if (strcmp(mode, "auto") == 0) {
+        xdpFlags = 0;
+    } else if (strcmp(mode, "generic") == 0 || strcmp(mode, "skb") == 0) {
+        // Works with any driver, veth included
+        xdpFlags = XDP_FLAGS_SKB_MODE;
+        bindFlags = XDP_COPY;
+    } else if (strcmp(mode, "native") == 0 || strcmp(mode, "drv") == 0) {
+        xdpFlags = XDP_FLAGS_DRV_MODE;
+    } else if (strcmp(mode, "zerocopy") == 0) {
+        xdpFlags = XDP_FLAGS_DRV_MODE;
+        bindFlags = XDP_ZEROCOPY;
+    } else {
+        LOGEXIT("Unknown afxdpMode '%s', must be auto, generic, native or zerocopy", mode);
+    }
+    g_free(mode);
+
+    moloch_packet_set_dltsnap(DLT_EN10MB, config.snapLen);
+
+    pcap_t *dpcap = pcap_open_dead(pcapFileHeader.dlt, pcapFileHeader.snaplen);
+
+    if (config.bpf) {
+        if (pcap_compile(dpcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            LOGEXIT("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(dpcap));
+        }
+    }
+
+    // Older kernels charge bpf maps and umem against the memlock limit
+    struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
+    setrlimit(RLIMIT_MEMLOCK, &r);
+
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++);
+
+    if (i == MAX_INTERFACES) {
+        LOGEXIT("Only support up to %d interfaces", MAX_INTERFACES);
+    }
+
+    numXsks = i * numQueues;
+    xsks = calloc(numXsks, sizeof(MolochAfXdp_t));
+    moloch_packet_add_producers(numXsks);
+
+    // One allocation for all the UMEMs so release can find the owning xsk with math
+    umemBase = mmap(NULL, umemSize * numXsks, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (unlikely(umemBase == MAP_FAILED)) {
+        LOGEXIT("ERROR - MMap failure allocating %" PRIu64 " bytes of UMEM, %d: %s", umemSize * numXsks, errno, strerror(errno));
+    }
+
+    zeroCopyId = moloch_packet_zerocopy_register(reader_afxdp_release);
+
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        ifindexes[i] = if_nametoindex(config.interface[i]);
+        if (ifindexes[i] == 0)
+            LOGEXIT("ERROR - Unknown interface %s", config.interface[i]);
+
+        MolochBpfMapCreate_t attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.map_type    = MOLOCH_BPF_MAP_TYPE_XSKMAP;
+        attr.key_size    = sizeof(int);
+        attr.value_size  = sizeof(int);
+        attr.max_entries = MOLOCH_AFXDP_MAX_QUEUES;
+        mapFds[i] = reader_afxdp_bpf(MOLOCH_BPF_MAP_CREATE, &attr, sizeof(attr));
+        if (mapFds[i] < 0)
+            LOGEXIT("ERROR - Couldn't create xsks map: %s", strerror(errno));
+
+        int progFd = reader_afxdp_load_prog(mapFds[i]);
+        int rc = reader_afxdp_set_link(ifindexes[i], progFd, xdpFlags);
+        if (rc < 0)
+            LOGEXIT("ERROR - Couldn't attach XDP program to %s: %s", config.interface[i], strerror(-rc));
+        close(progFd);
+
+        for (q = 0; q < numQueues; q++) {
+            MolochAfXdp_t *xsk = &xsks[i * numQueues + q];
+            xsk->interface = i;
+            xsk->queue     = q;
+            xsk->umem      = umemBase + (i * numQueues + q) * umemSize;
+            reader_afxdp_xsk_init(xsk, ringSize, bindFlags);
+        }
+    }
+
+    moloch_reader_start         = reader_afxdp_start;
+    moloch_reader_exit          = reader_afxdp_exit;
+    moloch_reader_stats         = reader_afxdp_stats;
+}
+#endif // XDP_UMEM_UNALIGNED_CHUNK_FLAG
+#endif // _linux
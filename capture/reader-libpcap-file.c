@@ -24,24 +24,44 @@
 #include <pwd.h>
 #include <grp.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
 
-extern MolochPcapFileHdr_t   pcapFileHeader;
 
 extern MolochConfig_t        config;
 
-LOCAL  pcap_t               *pcap;
-LOCAL  FILE                 *offlineFile = 0;
+// Per reader state is thread local so offlineThreads readers can each own a file
+LOCAL  __thread pcap_t      *pcap;
+LOCAL  __thread FILE        *offlineFile = 0;
 
-extern void                 *esServer;
 LOCAL  MolochStringHead_t    monitorQ;
 
-LOCAL  char                  offlinePcapFilename[PATH_MAX+1];
-LOCAL  int                   pktsToRead;
-
-LOCAL void reader_libpcapfile_opened();
-
-LOCAL MolochPacketBatch_t   batch;
-LOCAL uint8_t               readerPos;
+LOCAL  __thread char         offlinePcapFilename[PATH_MAX+1];
+LOCAL  __thread int          pktsToRead;
+
+LOCAL int reader_libpcapfile_opened();
+LOCAL int reader_libpcapfile_opened_slot();
+
+LOCAL __thread MolochPacketBatch_t batch;
+LOCAL __thread uint8_t      readerPos;
+LOCAL uint8_t               readerPosNext;
+LOCAL uint8_t               readerPosUsed[256];
+LOCAL int                   readerPosCnt;
+LOCAL int                   readerPosWaiting;  // main thread waiting on a free slot
+LOCAL MOLOCH_LOCK_DEFINE(readerPosUsed);
+LOCAL MOLOCH_COND_DEFINE(readerPosUsed);
+// Leave a slot free so finding one always ends
+#define MOLOCH_READER_MAX_FILES 255
+LOCAL int                   offlineDlt = -1;
+LOCAL int                   offlineThreadsDone;
+LOCAL MOLOCH_LOCK_DEFINE(offlineFiles);
 extern char                *readerFileName[256];
 extern MolochFieldOps_t     readerFieldOps[256];
 extern uint32_t             readerOutputIds[256];
@@ -55,6 +75,98 @@ LOCAL struct {
 } filenameOps[100];
 LOCAL int                   filenameOpsNum;
 
+/* Native reader state, when offlineMmap is set the file is mapped and the
+ * pcap/pcapng records are parsed directly.  Packets point into the mapping,
+ * which stays around until the last zero copy packet is released.
+ */
+#define MOLOCH_PCAPNG_MAX_IFS 32
+
+/* Compressed files are decoded on a moloch-decomp thread into a ring of
+ * blocks that only hold whole records, the native parser then reads each
+ * block like a small mapping.  The viewer can't read packets back out of a
+ * compressed file, so they are only accepted with --copy.  Record positions
+ * are offsets in the decoded stream, not compressed block offsets.
+ */
+#define MOLOCH_DECOMP_BLOCKS      16
+#define MOLOCH_DECOMP_BLOCK_SIZE  (1024*1024)
+#define MOLOCH_DECOMP_IN_SIZE     (256*1024)
+
+enum { MOLOCH_DECOMP_GZIP = 1, MOLOCH_DECOMP_ZSTD, MOLOCH_DECOMP_LZ4 };
+LOCAL const char *decompNames[] = {"none", "gzip", "zstd", "lz4"};
+
+typedef struct {
+    uint8_t             *data;
+    uint32_t             len;
+    int                  refs;       // reader plus outstanding zero copy packets
+    uint8_t              ready;
+    uint64_t             decodedOff; // offset of data[0] in the decoded file
+} MolochDecompBlock_t;
+
+typedef struct {
+    uint8_t             *arena;      // MOLOCH_DECOMP_BLOCKS * MOLOCH_DECOMP_BLOCK_SIZE
+    uint8_t             *carry;      // partial record left at the end of the last block
+    uint32_t             carryLen;
+    uint64_t             decodedOff; // decoded bytes handed out in blocks so far
+    uint32_t             readBlock;  // next block sequence the reader takes
+    uint8_t              codec;
+    uint8_t              done;
+    uint8_t              failed;
+    uint8_t              quit;
+    uint8_t              pcapng;
+    uint8_t              swap;
+    uint8_t              header;     // next record is the pcap file header
+
+    uint8_t             *in;
+    uint32_t             inLen;
+    uint32_t             inPos;
+    uint64_t             inOffset;   // compressed offset of in[0]
+    uint8_t              eof;
+
+    z_stream             zs;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream        *zds;
+#endif
+#ifdef HAVE_LZ4
+    LZ4F_dctx           *lz4;
+#endif
+
+    MolochDecompBlock_t  blocks[MOLOCH_DECOMP_BLOCKS];
+    MOLOCH_LOCK_EXTERN(lock);
+    MOLOCH_COND_EXTERN(lock);
+} MolochDecomp_t;
+
+typedef struct {
+    uint32_t         linktype;
+    uint32_t         snaplen;
+    uint64_t         tsUnits;        // timestamp ticks per second
+    int64_t          tsOffset;       // seconds to add to timestamps
+    uint8_t          warned;         // linktype mismatch already logged
+} MolochPcapNgIf_t;
+
+typedef struct {
+    uint8_t         *data;
+    uint64_t         size;
+    uint64_t         pos;            // offset of the next record or block
+    int              refs;           // reader plus outstanding zero copy packets
+    int              fd;
+    uint32_t         linktype;
+    uint32_t         snaplen;
+    uint8_t          readerPos;
+    uint8_t          pcapng;
+    uint8_t          swap;
+    uint8_t          nsec;
+    uint16_t         numIfs;
+    MolochPcapNgIf_t ifs[MOLOCH_PCAPNG_MAX_IFS];
+    MolochDecomp_t  *decomp;         // set for compressed files, data is the current block
+} MolochMmapFile_t;
+
+LOCAL  int                  offlineMmap;
+LOCAL  __thread MolochMmapFile_t *mmapFile;
+LOCAL  MolochMmapFile_t    *mmapFiles[256];
+LOCAL  uint8_t              mmapZeroCopyId;
+LOCAL  __thread struct bpf_program mmapBpf;
+LOCAL  __thread int         mmapBpfSet;
+
 #ifdef HAVE_SYS_INOTIFY_H
 #include <sys/inotify.h>
 LOCAL int         monitorFd;
@@ -91,7 +203,9 @@ LOCAL void reader_libpcapfile_monitor_do(struct inotify_event *event)
 
     if (config.debug)
         LOG("Monitor enqueing %s", string->str);
+    MOLOCH_LOCK(offlineFiles);
     DLL_PUSH_TAIL(s_, &monitorQ, string);
+    MOLOCH_UNLOCK(offlineFiles);
     return;
 }
 /******************************************************************************/
@@ -181,6 +295,806 @@ LOCAL void reader_libpcapfile_init_monitor()
 }
 #endif
 /******************************************************************************/
+LOCAL inline uint16_t reader_libpcapfile_u16(const MolochMmapFile_t *file, const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return file->swap?__builtin_bswap16(v):v;
+}
+/******************************************************************************/
+LOCAL inline uint32_t reader_libpcapfile_u32(const MolochMmapFile_t *file, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return file->swap?__builtin_bswap32(v):v;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_decomp_free(MolochDecomp_t *d);
+LOCAL void reader_libpcapfile_decomp_block_unref(MolochDecomp_t *d, MolochDecompBlock_t *blk);
+LOCAL gboolean reader_libpcapfile_slot_gfunc(gpointer UNUSED(uw));
+
+/******************************************************************************/
+/* A readerPos slot stays in use until its file is closed and, for mmap files,
+ * every packet pointing into it has been released.  Returns -1 if none are
+ * free and wait isn't set, the main thread is called back when one frees up.
+ */
+LOCAL int reader_libpcapfile_slot_get(int wait)
+{
+    MOLOCH_LOCK(readerPosUsed);
+    while (readerPosCnt >= MOLOCH_READER_MAX_FILES) {
+        if (!wait) {
+            readerPosWaiting = 1;
+            MOLOCH_UNLOCK(readerPosUsed);
+            return -1;
+        }
+        MOLOCH_COND_WAIT(readerPosUsed);
+    }
+
+    do {
+        readerPosNext++;
+    } while (readerPosUsed[readerPosNext]);
+    readerPosUsed[readerPosNext] = 1;
+    readerPosCnt++;
+    int pos = readerPosNext;
+    MOLOCH_UNLOCK(readerPosUsed);
+    return pos;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_slot_free(uint8_t pos)
+{
+    MOLOCH_LOCK(readerPosUsed);
+    readerPosUsed[pos] = 0;
+    readerPosCnt--;
+    int waiting = readerPosWaiting;
+    readerPosWaiting = 0;
+    MOLOCH_COND_SIGNAL(readerPosUsed);
+    MOLOCH_UNLOCK(readerPosUsed);
+
+    if (waiting)
+        g_idle_add(reader_libpcapfile_slot_gfunc, NULL);
+}
+/******************************************************************************/
+
+LOCAL void reader_libpcapfile_mmap_unref(MolochMmapFile_t *file)
+{
+    if (__sync_sub_and_fetch(&file->refs, 1) == 0) {
+        if (file->decomp)
+            reader_libpcapfile_decomp_free(file->decomp);
+        else
+            munmap(file->data, file->size);
+        if (file->fd >= 0)
+            close(file->fd);
+        if (mmapFiles[file->readerPos] == file) {
+            mmapFiles[file->readerPos] = NULL;
+            reader_libpcapfile_slot_free(file->readerPos);
+        }
+        MOLOCH_TYPE_FREE(MolochMmapFile_t, file);
+    }
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_mmap_release(MolochPacket_t * const packet)
+{
+    MolochMmapFile_t *file = mmapFiles[packet->readerPos];
+    if (file->decomp) {
+        MolochDecomp_t *d = file->decomp;
+        reader_libpcapfile_decomp_block_unref(d, &d->blocks[(packet->pkt - d->arena) / MOLOCH_DECOMP_BLOCK_SIZE]);
+    }
+    reader_libpcapfile_mmap_unref(file);
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_pcapng_idb(MolochMmapFile_t *file, const uint8_t *p, uint32_t blen)
+{
+    if (file->numIfs >= MOLOCH_PCAPNG_MAX_IFS) {
+        LOG("WARNING - Only %d pcapng interfaces supported, ignoring the rest", MOLOCH_PCAPNG_MAX_IFS);
+        return;
+    }
+
+    MolochPcapNgIf_t *intf = &file->ifs[file->numIfs];
+    intf->linktype = reader_libpcapfile_u16(file, p + 8);
+    intf->snaplen = reader_libpcapfile_u32(file, p + 12);
+    intf->tsUnits = 1000000;
+    intf->tsOffset = 0;
+    intf->warned = 0;
+
+    // Options are code/len pairs padded to 4 bytes, before the trailing block length
+    const uint8_t *opt = p + 16;
+    const uint8_t *end = p + blen - 4;
+    while (opt + 4 <= end) {
+        uint16_t code = reader_libpcapfile_u16(file, opt);
+        uint16_t olen = reader_libpcapfile_u16(file, opt + 2);
+        if (code == 0 || opt + 4 + olen > end)
+            break;
+
+        if (code == 9 && olen == 1) { // if_tsresol
+            uint8_t v = opt[4];
+            if (v & 0x80) {
+                intf->tsUnits = 1ULL << MIN(v & 0x7f, 63);
+            } else {
+                int i;
+                intf->tsUnits = 1;
+                for (i = 0; i < MIN(v, 19); i++)
+                    intf->tsUnits *= 10;
+            }
+        } else if (code == 14 && olen == 8) { // if_tsoffset
+            uint64_t v;
+            memcpy(&v, opt + 4, 8);
+            intf->tsOffset = (int64_t)(file->swap?__builtin_bswap64(v):v);
+        }
+        opt += 4 + ((olen + 3) & ~3);
+    }
+    file->numIfs++;
+}
+/******************************************************************************/
+/* Find the next packet record, skipping pcapng blocks that don't carry packets.
+ * Returns 1 with h, data and recordPos filled in, 0 at end of file and -1 if
+ * the file is truncated or corrupt.
+ */
+LOCAL int reader_libpcapfile_mmap_next(MolochMmapFile_t *file, struct pcap_pkthdr *h, uint8_t **data, uint64_t *recordPos)
+{
+    if (!file->pcapng) {
+        if (file->pos == file->size)
+            return 0;
+
+        if (file->pos + 16 > file->size) {
+            LOG("ERROR - Truncated pcap record header at %" PRIu64, file->pos);
+            return -1;
+        }
+
+        const uint8_t *p = file->data + file->pos;
+        h->ts.tv_sec = reader_libpcapfile_u32(file, p);
+        h->ts.tv_usec = reader_libpcapfile_u32(file, p + 4);
+        if (file->nsec)
+            h->ts.tv_usec /= 1000;
+        h->caplen = reader_libpcapfile_u32(file, p + 8);
+        h->len = reader_libpcapfile_u32(file, p + 12);
+
+        // Same sanity limit libpcap uses for bogus records
+        if (h->caplen > 0x40000 || file->pos + 16 + h->caplen > file->size) {
+            LOG("ERROR - Truncated or corrupt pcap record at %" PRIu64 " caplen %u", file->pos, h->caplen);
+            return -1;
+        }
+
+        *data = (uint8_t *)p + 16;
+        *recordPos = file->pos;
+        file->pos += 16 + h->caplen;
+        return 1;
+    }
+
+    while (1) {
+        if (file->pos == file->size)
+            return 0;
+
+        if (file->pos + 12 > file->size) {
+            LOG("ERROR - Truncated pcapng block header at %" PRIu64, file->pos);
+            return -1;
+        }
+
+        const uint8_t *p = file->data + file->pos;
+        uint32_t type;
+        memcpy(&type, p, 4);
+
+        // Section header, the byte order magic decides how the rest of the section is read
+        if (type == 0x0A0D0D0A) {
+            uint32_t bom;
+            memcpy(&bom, p + 8, 4);
+            if (bom == 0x1A2B3C4D)
+                file->swap = 0;
+            else if (bom == 0x4D3C2B1A)
+                file->swap = 1;
+            else {
+                LOG("ERROR - Bad pcapng byte order magic at %" PRIu64, file->pos);
+                return -1;
+            }
+            file->numIfs = 0;
+        } else {
+            type = reader_libpcapfile_u32(file, p);
+        }
+
+        uint32_t blen = reader_libpcapfile_u32(file, p + 4);
+        if (blen < 12 || (blen & 3) || file->pos + blen > file->size) {
+            LOG("ERROR - Truncated or corrupt pcapng block at %" PRIu64 " len %u", file->pos, blen);
+            return -1;
+        }
+
+        uint32_t ifId = 0;
+        uint64_t ts = 0;
+
+        switch (type) {
+        case 1: // Interface Description Block
+            if (blen >= 20)
+                reader_libpcapfile_pcapng_idb(file, p, blen);
+            file->pos += blen;
+            continue;
+        case 2: // Packet Block (obsolete)
+        case 6: // Enhanced Packet Block
+            if (blen < 32)
+                goto corrupt;
+            ifId = (type == 2)?reader_libpcapfile_u16(file, p + 8):reader_libpcapfile_u32(file, p + 8);
+            ts = ((uint64_t)reader_libpcapfile_u32(file, p + 12) << 32) | reader_libpcapfile_u32(file, p + 16);
+            h->caplen = reader_libpcapfile_u32(file, p + 20);
+            h->len = reader_libpcapfile_u32(file, p + 24);
+            // Same sanity limit as pcap, checked so the sum can't wrap
+            if (h->caplen > 0x40000 || h->caplen > blen - 32)
+                goto corrupt;
+            *data = (uint8_t *)p + 28;
+            break;
+        case 3: // Simple Packet Block
+            if (blen < 16)
+                goto corrupt;
+            h->len = reader_libpcapfile_u32(file, p + 8);
+            h->caplen = MIN(h->len, blen - 16);
+            if (file->numIfs > 0 && file->ifs[0].snaplen > 0)
+                h->caplen = MIN(h->caplen, file->ifs[0].snaplen);
+            *data = (uint8_t *)p + 12;
+            break;
+        default:
+            file->pos += blen;
+            continue;
+        }
+
+        if (ifId >= file->numIfs) {
+            if (config.debug)
+                LOG("Skipping pcapng packet for unknown interface %u at %" PRIu64, ifId, file->pos);
+            file->pos += blen;
+            continue;
+        }
+
+        MolochPcapNgIf_t *intf = &file->ifs[ifId];
+
+        // Packets are decoded with the file's link type, which is the first interface's
+        if (intf->linktype != file->linktype) {
+            if (!intf->warned) {
+                LOG("WARNING - Skipping pcapng packets for interface %u, link type %u isn't the first interface's %u", ifId, intf->linktype, file->linktype);
+                intf->warned = 1;
+            }
+            file->pos += blen;
+            continue;
+        }
+
+        h->ts.tv_sec = ts / intf->tsUnits + intf->tsOffset;
+        if (intf->tsUnits == 1000000)
+            h->ts.tv_usec = ts % intf->tsUnits;
+        else
+            h->ts.tv_usec = (double)(ts % intf->tsUnits) * 1000000.0 / intf->tsUnits;
+
+        *recordPos = file->pos;
+        file->pos += blen;
+        return 1;
+
+corrupt:
+        LOG("ERROR - Corrupt pcapng block type %u at %" PRIu64 " len %u", type, file->pos, blen);
+        return -1;
+    }
+}
+/******************************************************************************/
+LOCAL inline uint32_t reader_libpcapfile_decomp_u32(const MolochDecomp_t *d, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return d->swap?__builtin_bswap32(v):v;
+}
+/******************************************************************************/
+/* Length of the pcap record or pcapng block at p, 0 if there aren't enough
+ * bytes to tell yet, -1 if it is corrupt.
+ */
+LOCAL int64_t reader_libpcapfile_decomp_record_len(MolochDecomp_t *d, const uint8_t *p, uint32_t avail)
+{
+    if (d->header) {
+        if (avail < 24)
+            return 0;
+
+        uint32_t magic;
+        memcpy(&magic, p, 4);
+        d->header = 0;
+        switch (magic) {
+        case 0xa1b2c3d4:
+        case 0xa1b23c4d:
+            return 24;
+        case 0xd4c3b2a1:
+        case 0x4d3cb2a1:
+            d->swap = 1;
+            return 24;
+        case 0x0A0D0D0A:
+            d->pcapng = 1;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (!d->pcapng) {
+        if (avail < 16)
+            return 0;
+        uint32_t caplen = reader_libpcapfile_decomp_u32(d, p + 8);
+        if (caplen > 0x40000)
+            return -1;
+        return 16 + caplen;
+    }
+
+    if (avail < 12)
+        return 0;
+
+    uint32_t type;
+    memcpy(&type, p, 4);
+    if (type == 0x0A0D0D0A) {
+        uint32_t bom;
+        memcpy(&bom, p + 8, 4);
+        if (bom == 0x1A2B3C4D)
+            d->swap = 0;
+        else if (bom == 0x4D3C2B1A)
+            d->swap = 1;
+        else
+            return -1;
+    }
+
+    uint32_t blen = reader_libpcapfile_decomp_u32(d, p + 4);
+    if (blen < 12 || (blen & 3))
+        return -1;
+    return blen;
+}
+/******************************************************************************/
+LOCAL int reader_libpcapfile_decomp_refill(MolochDecomp_t *d, int fd)
+{
+    if (d->inPos < d->inLen)
+        return 1;
+
+    d->inOffset += d->inLen;
+    d->inPos = 0;
+    d->inLen = 0;
+
+    int n = read(fd, d->in, MOLOCH_DECOMP_IN_SIZE);
+    if (n <= 0) {
+        if (n < 0)
+            LOG("ERROR - Couldn't read compressed file - %s", strerror(errno));
+        d->eof = 1;
+        return 0;
+    }
+    d->inLen = n;
+    return 1;
+}
+/******************************************************************************/
+/* Decode up to outLen bytes, returns bytes produced or -1 on error */
+LOCAL int reader_libpcapfile_decomp_fill(MolochDecomp_t *d, int fd, uint8_t *out, uint32_t outLen)
+{
+    if (!reader_libpcapfile_decomp_refill(d, fd))
+        return 0;
+
+    switch (d->codec) {
+    case MOLOCH_DECOMP_GZIP: {
+        d->zs.next_in = d->in + d->inPos;
+        d->zs.avail_in = d->inLen - d->inPos;
+        d->zs.next_out = out;
+        d->zs.avail_out = outLen;
+        int rc = inflate(&d->zs, Z_NO_FLUSH);
+        d->inPos = d->inLen - d->zs.avail_in;
+        if (rc == Z_STREAM_END) {
+            // Multi member gzip, start on the next member
+            inflateReset(&d->zs);
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            LOG("ERROR - gzip decode failed at %" PRIu64 " - %s", d->inOffset + d->inPos, d->zs.msg?d->zs.msg:"unknown");
+            return -1;
+        }
+        return outLen - d->zs.avail_out;
+    }
+#ifdef HAVE_ZSTD
+    case MOLOCH_DECOMP_ZSTD: {
+        ZSTD_inBuffer  ib = {d->in, d->inLen, d->inPos};
+        ZSTD_outBuffer ob = {out, outLen, 0};
+        size_t rc = ZSTD_decompressStream(d->zds, &ob, &ib);
+        if (ZSTD_isError(rc)) {
+            LOG("ERROR - zstd decode failed at %" PRIu64 " - %s", d->inOffset + d->inPos, ZSTD_getErrorName(rc));
+            return -1;
+        }
+        d->inPos = ib.pos;
+        return ob.pos;
+    }
+#endif
+#ifdef HAVE_LZ4
+    case MOLOCH_DECOMP_LZ4: {
+        size_t dstLen = outLen;
+        size_t srcLen = d->inLen - d->inPos;
+        size_t rc = LZ4F_decompress(d->lz4, out, &dstLen, d->in + d->inPos, &srcLen, NULL);
+        if (LZ4F_isError(rc)) {
+            LOG("ERROR - lz4 decode failed at %" PRIu64 " - %s", d->inOffset + d->inPos, LZ4F_getErrorName(rc));
+            return -1;
+        }
+        d->inPos += srcLen;
+        return dstLen;
+    }
+#endif
+    }
+    return -1;
+}
+/******************************************************************************/
+/* Fill one block with whole records, carrying any partial record over to the
+ * next block.  Returns 0 when there is nothing more to decode.
+ */
+LOCAL int reader_libpcapfile_decomp_block(MolochDecomp_t *d, int fd, MolochDecompBlock_t *blk)
+{
+    uint32_t len = 0;
+    blk->decodedOff = d->decodedOff;
+
+    if (d->carryLen) {
+        memcpy(blk->data, d->carry, d->carryLen);
+        len = d->carryLen;
+        d->carryLen = 0;
+    }
+
+    while (len < MOLOCH_DECOMP_BLOCK_SIZE && !d->eof) {
+        int n = reader_libpcapfile_decomp_fill(d, fd, blk->data + len, MOLOCH_DECOMP_BLOCK_SIZE - len);
+        if (n < 0) {
+            d->failed = 1;
+            d->eof = 1;
+            break;
+        }
+        len += n;
+    }
+
+    // Only hand whole records to the reader
+    uint32_t end = 0;
+    while (end < len) {
+        int64_t rlen = reader_libpcapfile_decomp_record_len(d, blk->data + end, len - end);
+        if (rlen < 0 || rlen > MOLOCH_DECOMP_BLOCK_SIZE) {
+            LOG("ERROR - Corrupt record in compressed file at decoded block offset %u", end);
+            d->failed = 1;
+            d->eof = 1;
+            len = end;
+            break;
+        }
+        if (rlen == 0 || end + rlen > len)
+            break;
+        end += rlen;
+    }
+
+    if (end < len) {
+        if (d->eof) {
+            LOG("ERROR - Truncated record at the end of the compressed file");
+            d->failed = 1;
+        } else {
+            d->carryLen = len - end;
+            memcpy(d->carry, blk->data + end, d->carryLen);
+        }
+    }
+
+    blk->len = end;
+    d->decodedOff += end;
+    return end > 0 || d->carryLen > 0 || !d->eof;
+}
+/******************************************************************************/
+LOCAL void *reader_libpcapfile_decomp_thread(gpointer filev)
+{
+    MolochMmapFile_t *file = filev;
+    MolochDecomp_t   *d = file->decomp;
+    uint32_t          seq = 0;
+
+    while (1) {
+        MolochDecompBlock_t *blk = &d->blocks[seq % MOLOCH_DECOMP_BLOCKS];
+
+        // Wait for the reader and packet threads to be done with this block
+        MOLOCH_LOCK(d->lock);
+        while ((blk->ready || blk->refs) && !d->quit)
+            MOLOCH_COND_WAIT(d->lock);
+        MOLOCH_UNLOCK(d->lock);
+
+        if (d->quit || config.quitting)
+            break;
+
+        if (!reader_libpcapfile_decomp_block(d, file->fd, blk))
+            break;
+
+        // Empty blocks happen when a frame has no records, skip them
+        if (blk->len == 0 && !d->eof)
+            continue;
+
+        MOLOCH_LOCK(d->lock);
+        blk->refs = 1;
+        blk->ready = 1;
+        MOLOCH_COND_BROADCAST(d->lock);
+        MOLOCH_UNLOCK(d->lock);
+        seq++;
+
+        if (d->eof && d->carryLen == 0)
+            break;
+    }
+
+    MOLOCH_LOCK(d->lock);
+    d->done = 1;
+    MOLOCH_COND_BROADCAST(d->lock);
+    MOLOCH_UNLOCK(d->lock);
+
+    reader_libpcapfile_mmap_unref(file);
+    return NULL;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_decomp_block_unref(MolochDecomp_t *d, MolochDecompBlock_t *blk)
+{
+    if (__sync_sub_and_fetch(&blk->refs, 1) == 0) {
+        MOLOCH_LOCK(d->lock);
+        MOLOCH_COND_BROADCAST(d->lock);
+        MOLOCH_UNLOCK(d->lock);
+    }
+}
+/******************************************************************************/
+/* Give back the block the reader is on and move to the next one, waiting for
+ * the decompress thread if needed.  Returns 0 once everything is read.
+ */
+LOCAL int reader_libpcapfile_decomp_next(MolochMmapFile_t *file)
+{
+    MolochDecomp_t      *d = file->decomp;
+    MolochDecompBlock_t *blk = &d->blocks[d->readBlock % MOLOCH_DECOMP_BLOCKS];
+
+    if (file->data) {
+        MOLOCH_LOCK(d->lock);
+        blk->ready = 0;
+        MOLOCH_UNLOCK(d->lock);
+        reader_libpcapfile_decomp_block_unref(d, blk);
+        file->data = NULL;
+        d->readBlock++;
+        blk = &d->blocks[d->readBlock % MOLOCH_DECOMP_BLOCKS];
+    }
+
+    MOLOCH_LOCK(d->lock);
+    while (!blk->ready && !d->done)
+        MOLOCH_COND_WAIT(d->lock);
+    int ready = blk->ready;
+    MOLOCH_UNLOCK(d->lock);
+
+    if (!ready)
+        return 0;
+
+    file->data = blk->data;
+    file->size = blk->len;
+    file->pos = 0;
+    return 1;
+}
+/******************************************************************************/
+/* Start decoding a compressed file, returns 0 if the codec isn't supported */
+LOCAL int reader_libpcapfile_decomp_start(MolochMmapFile_t *file, const char *filename, int codec)
+{
+    MolochDecomp_t *d = MOLOCH_TYPE_ALLOC0(MolochDecomp_t);
+    d->codec = codec;
+    d->header = 1;
+
+    switch (codec) {
+    case MOLOCH_DECOMP_GZIP:
+        if (inflateInit2(&d->zs, 16 + MAX_WBITS) != Z_OK) {
+            LOG("ERROR - Couldn't init gzip for %s", filename);
+            MOLOCH_TYPE_FREE(MolochDecomp_t, d);
+            return 0;
+        }
+        break;
+#ifdef HAVE_ZSTD
+    case MOLOCH_DECOMP_ZSTD:
+        d->zds = ZSTD_createDStream();
+        ZSTD_initDStream(d->zds);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case MOLOCH_DECOMP_LZ4:
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION))) {
+            LOG("ERROR - Couldn't init lz4 for %s", filename);
+            MOLOCH_TYPE_FREE(MolochDecomp_t, d);
+            return 0;
+        }
+        break;
+#endif
+    default:
+        LOG("ERROR - %s is %s compressed, but capture wasn't built with %s support", filename, decompNames[codec], decompNames[codec]);
+        MOLOCH_TYPE_FREE(MolochDecomp_t, d);
+        return 0;
+    }
+
+    d->arena = malloc(MOLOCH_DECOMP_BLOCKS * MOLOCH_DECOMP_BLOCK_SIZE);
+    d->carry = malloc(MOLOCH_DECOMP_BLOCK_SIZE);
+    d->in = malloc(MOLOCH_DECOMP_IN_SIZE);
+    int i;
+    for (i = 0; i < MOLOCH_DECOMP_BLOCKS; i++) {
+        d->blocks[i].data = d->arena + i * MOLOCH_DECOMP_BLOCK_SIZE;
+    }
+    MOLOCH_LOCK_INIT(d->lock);
+    MOLOCH_COND_INIT(d->lock);
+
+    file->decomp = d;
+    file->data = NULL;
+    file->size = 0;
+    file->refs++; // decompress thread
+
+    g_thread_unref(g_thread_new("moloch-decomp", &reader_libpcapfile_decomp_thread, file));
+
+    if (!reader_libpcapfile_decomp_next(file)) {
+        LOG("ERROR - Couldn't decode any pcap records from %s", filename);
+        return 0;
+    }
+    return 1;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_decomp_free(MolochDecomp_t *d)
+{
+    switch (d->codec) {
+    case MOLOCH_DECOMP_GZIP:
+        inflateEnd(&d->zs);
+        break;
+#ifdef HAVE_ZSTD
+    case MOLOCH_DECOMP_ZSTD:
+        ZSTD_freeDStream(d->zds);
+        break;
+#endif
+#ifdef HAVE_LZ4
+    case MOLOCH_DECOMP_LZ4:
+        LZ4F_freeDecompressionContext(d->lz4);
+        break;
+#endif
+    }
+    free(d->arena);
+    free(d->carry);
+    free(d->in);
+    MOLOCH_TYPE_FREE(MolochDecomp_t, d);
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_mmap_close(MolochMmapFile_t *file)
+{
+    if (file->decomp) {
+        MolochDecomp_t *d = file->decomp;
+        MolochDecompBlock_t *blk = &d->blocks[d->readBlock % MOLOCH_DECOMP_BLOCKS];
+
+        MOLOCH_LOCK(d->lock);
+        d->quit = 1;
+        if (file->data)
+            blk->ready = 0;
+        MOLOCH_COND_BROADCAST(d->lock);
+        MOLOCH_UNLOCK(d->lock);
+
+        if (file->data) {
+            reader_libpcapfile_decomp_block_unref(d, blk);
+            file->data = NULL;
+        }
+    } else {
+        close(file->fd);
+        file->fd = -1;
+    }
+    reader_libpcapfile_mmap_unref(file);
+}
+/******************************************************************************/
+/* Parse the pcap file header or walk the leading pcapng blocks to find the
+ * first interface.  Returns 0 if the format is one we parse.
+ */
+LOCAL int reader_libpcapfile_mmap_header(MolochMmapFile_t *file, const char *filename)
+{
+    uint32_t magic;
+    memcpy(&magic, file->data, 4);
+
+    switch (magic) {
+    case 0xa1b2c3d4:
+        break;
+    case 0xd4c3b2a1:
+        file->swap = 1;
+        break;
+    case 0xa1b23c4d:
+        file->nsec = 1;
+        break;
+    case 0x4d3cb2a1:
+        file->swap = 1;
+        file->nsec = 1;
+        break;
+    case 0x0A0D0D0A:
+        file->pcapng = 1;
+        break;
+    default:
+        return -1;
+    }
+
+    if (!file->pcapng) {
+        file->snaplen = reader_libpcapfile_u32(file, file->data + 16);
+        file->linktype = reader_libpcapfile_u32(file, file->data + 20) & 0x03ffffff;
+        file->pos = 24;
+        return 0;
+    }
+
+    if (file->size < 12)
+        return -1;
+
+    uint32_t bom;
+    memcpy(&bom, file->data + 8, 4);
+    if (bom == 0x4D3C2B1A)
+        file->swap = 1;
+    else if (bom != 0x1A2B3C4D)
+        return -1;
+
+    // Walk the leading blocks up to the first interface, then start over.  This
+    // can't use mmap_next since it skips packets that don't match file->linktype,
+    // which isn't known yet.
+    while (file->numIfs == 0 && file->pos + 12 <= file->size) {
+        const uint8_t *p = file->data + file->pos;
+        uint32_t type = reader_libpcapfile_u32(file, p);
+        uint32_t blen = reader_libpcapfile_u32(file, p + 4);
+        if (blen < 12 || (blen & 3) || file->pos + blen > file->size)
+            break;
+        if (type == 2 || type == 3 || type == 6) // packet before any interface
+            break;
+        if (type == 1 && blen >= 20)
+            reader_libpcapfile_pcapng_idb(file, p, blen);
+        file->pos += blen;
+    }
+
+    if (file->numIfs == 0) {
+        LOG("WARNING - No pcapng interface found in %s before first packet, using libpcap", filename);
+        return -1;
+    }
+    file->linktype = file->ifs[0].linktype;
+    file->snaplen = file->ifs[0].snaplen?file->ifs[0].snaplen:MOLOCH_PACKET_MAX_LEN;
+    file->pos = 0;
+    file->numIfs = 0;
+    return 0;
+}
+/******************************************************************************/
+/* Map or start decompressing the file and parse the file/section header.
+ * Returns NULL if the file can't be read natively, in which case libpcap is
+ * used.  Compressed files are always read natively, others only with offlineMmap.
+ */
+LOCAL MolochMmapFile_t *reader_libpcapfile_mmap_open(const char *filename)
+{
+    struct stat sb;
+    uint8_t     magic[4];
+
+    if (strcmp(filename, "-") == 0)
+        return NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < 24 || pread(fd, magic, 4, 0) != 4) {
+        close(fd);
+        return NULL;
+    }
+
+    int codec = 0;
+    if (magic[0] == 0x1f && magic[1] == 0x8b)
+        codec = MOLOCH_DECOMP_GZIP;
+    else if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+        codec = MOLOCH_DECOMP_ZSTD;
+    else if (memcmp(magic, "\x04\x22\x4d\x18", 4) == 0)
+        codec = MOLOCH_DECOMP_LZ4;
+
+    if (!codec && !offlineMmap) {
+        close(fd);
+        return NULL;
+    }
+
+    MolochMmapFile_t *file = MOLOCH_TYPE_ALLOC0(MolochMmapFile_t);
+    file->fd   = fd;
+    file->refs = 1;
+
+    if (codec) {
+        // Packet positions index the file as is, which the viewer can't do for compressed files
+        if (!config.copyPcap && !config.dryRun) {
+            LOGEXIT("ERROR - %s is %s compressed, reading compressed files requires --copy", filename, decompNames[codec]);
+        }
+        if (!reader_libpcapfile_decomp_start(file, filename, codec)) {
+            reader_libpcapfile_mmap_close(file);
+            return NULL;
+        }
+    } else {
+        uint8_t *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            if (config.debug)
+                LOG("Couldn't mmap %s, using libpcap - %s", filename, strerror(errno));
+            close(fd);
+            MOLOCH_TYPE_FREE(MolochMmapFile_t, file);
+            return NULL;
+        }
+        madvise(data, sb.st_size, MADV_SEQUENTIAL);
+        file->data = data;
+        file->size = sb.st_size;
+    }
+
+    if (reader_libpcapfile_mmap_header(file, filename) != 0) {
+        reader_libpcapfile_mmap_close(file);
+        return NULL;
+    }
+    return file;
+}
+/******************************************************************************/
 LOCAL int reader_libpcapfile_process(char *filename)
 {
     char         errbuf[1024];
@@ -260,23 +1174,28 @@ process:
     errbuf[0] = 0;
     LOG ("Processing %s", filename);
     pktsToRead = config.pktsToRead;
-    pcap = pcap_open_offline(filename, errbuf);
+
+    if ((mmapFile = reader_libpcapfile_mmap_open(filename))) {
+        pcap = pcap_open_dead(moloch_packet_linktype_to_dlt(mmapFile->linktype), mmapFile->snaplen);
+    } else {
+        pcap = pcap_open_offline(filename, errbuf);
+    }
 
     if (!pcap) {
         LOG("Couldn't process '%s' error '%s'", filename, errbuf);
         return 1;
     }
 
-    reader_libpcapfile_opened();
-    return 0;
+    return reader_libpcapfile_opened();
 }
 /******************************************************************************/
-LOCAL int reader_libpcapfile_next()
+/* Pop the next file name to process, the caller frees it.  With
+ * offlineThreads > 1 this is called with offlineFiles held.
+ */
+LOCAL gchar *reader_libpcapfile_next_name()
 {
     gchar       *fullfilename;
 
-    pcap = 0;
-
     if (config.pcapReadFiles) {
         static int pcapFilePos = 0;
 
@@ -287,11 +1206,7 @@ LOCAL int reader_libpcapfile_next()
         }
         pcapFilePos++;
 
-        if (reader_libpcapfile_process(fullfilename)) {
-            return reader_libpcapfile_next();
-        }
-
-        return 1;
+        return g_strdup(fullfilename);
     }
 
 filesDone:
@@ -312,20 +1227,20 @@ filesDone:
             pcapFileListsPos++;
             if (!file) {
                 LOG("ERROR - Couldn't open %s", config.pcapFileLists[pcapFileListsPos - 1]);
-                return reader_libpcapfile_next();
+                return reader_libpcapfile_next_name();
             }
         }
 
         if (feof(file)) {
             fclose(file);
             file = NULL;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         }
 
         if (!fgets(line, sizeof(line), file)) {
             fclose(file);
             file = NULL;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         }
 
         int lineLen = strlen(line);
@@ -335,13 +1250,9 @@ filesDone:
 
         g_strstrip(line);
         if (!line[0] || line[0] == '#')
-            return reader_libpcapfile_next();
-
-        if (reader_libpcapfile_process(line)) {
-            return reader_libpcapfile_next();
-        }
+            return reader_libpcapfile_next_name();
 
-        return 1;
+        return g_strdup(line);
     }
 
 
@@ -392,7 +1303,7 @@ fileListsDone:
                     continue;
                 pcapBase[pcapGDirLevel+1] = fullfilename;
                 pcapGDirLevel++;
-                return reader_libpcapfile_next();
+                return reader_libpcapfile_next_name();
             }
 
             if (!g_regex_match(config.offlineRegex, filename, 0, NULL)) {
@@ -400,13 +1311,7 @@ fileListsDone:
                 continue;
             }
 
-            if (reader_libpcapfile_process(fullfilename)) {
-                g_free(fullfilename);
-                continue;
-            }
-
-            g_free(fullfilename);
-            return 1;
+            return fullfilename;
         }
         g_dir_close(pcapGDir[pcapGDirLevel]);
         pcapGDir[pcapGDirLevel] = 0;
@@ -415,11 +1320,11 @@ fileListsDone:
             g_free(pcapBase[pcapGDirLevel]);
             pcapBase[pcapGDirLevel] = 0;
             pcapGDirLevel--;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         } else {
             pcapDirPos++;
             pcapGDirLevel = -1;
-            return reader_libpcapfile_next();
+            return reader_libpcapfile_next_name();
         }
 
     }
@@ -430,14 +1335,22 @@ dirsDone:
         DLL_POP_HEAD(s_, &monitorQ, string);
         fullfilename = string->str;
         MOLOCH_TYPE_FREE(MolochString_t, string);
+        return fullfilename;
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* Open the next file that can be processed, returns 0 if there are none */
+LOCAL int reader_libpcapfile_next()
+{
+    gchar *filename;
 
-        if (reader_libpcapfile_process(fullfilename)) {
-            g_free(fullfilename);
-            continue;
-        }
-
-        g_free(fullfilename);
-        return 1;
+    pcap = 0;
+    while ((filename = reader_libpcapfile_next_name())) {
+        int rc = reader_libpcapfile_process(filename);
+        g_free(filename);
+        if (!rc)
+            return 1;
     }
     return 0;
 }
@@ -471,7 +1384,7 @@ LOCAL int reader_libpcapfile_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
-LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
+LOCAL void reader_libpcapfile_packet(const struct pcap_pkthdr *h, const u_char *bytes, uint64_t filePos, uint8_t zeroCopy)
 {
     MolochPacket_t *packet = MOLOCH_TYPE_ALLOC0(MolochPacket_t);
 
@@ -488,36 +1401,88 @@ LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pk
 
     packet->pkt           = (u_char *)bytes;
     packet->ts            = h->ts;
-    packet->readerFilePos = ftell(offlineFile) - 16 - h->len;
+    packet->readerFilePos = filePos;
     packet->readerPos     = readerPos;
+    packet->zeroCopy      = zeroCopy;
     moloch_packet_batch(&batch, packet);
 }
 /******************************************************************************/
-LOCAL gboolean reader_libpcapfile_read()
+LOCAL void reader_libpcapfile_pcap_cb(u_char *UNUSED(user), const struct pcap_pkthdr *h, const u_char *bytes)
 {
-    // pause reading if too many waiting disk operations
-    if (moloch_writer_queue_length() > 10) {
-        if (config.debug)
-            LOG("Waiting to process more packets, write q: %u", moloch_writer_queue_length());
-        return G_SOURCE_CONTINUE;
-    }
+    reader_libpcapfile_packet(h, bytes, ftell(offlineFile) - 16 - h->len, 0);
+}
+/******************************************************************************/
+/* Same contract as pcap_dispatch, but reading from the mapping.  File offsets
+ * come straight from the record positions instead of ftell.
+ */
+LOCAL int reader_libpcapfile_mmap_dispatch(int cnt)
+{
+    struct pcap_pkthdr h;
+    uint8_t           *data;
+    uint64_t           recordPos;
+    int                n = 0;
+    int                rc = 1;
 
-    // pause reading if too many waiting ES operations
-    if (moloch_http_queue_length(esServer) > 40) {
-        if (config.debug)
-            LOG("Waiting to process more packets, es q: %d", moloch_http_queue_length(esServer));
-        return G_SOURCE_CONTINUE;
-    }
+    while (n < cnt) {
+        rc = reader_libpcapfile_mmap_next(mmapFile, &h, &data, &recordPos);
 
-    // pause reading if too many packets are waiting to be processed
-    if (moloch_packet_outstanding() > 2048) {
-        if (config.debug)
-            LOG("Waiting to process more packets, packet q: %d", moloch_packet_outstanding());
-        return G_SOURCE_CONTINUE;
+        // End of a decoded block, move on to the next one
+        if (rc == 0 && mmapFile->decomp && reader_libpcapfile_decomp_next(mmapFile))
+            continue;
+
+        if (rc != 1)
+            break;
+
+        if (mmapBpfSet && !pcap_offline_filter(&mmapBpf, &h, data))
+            continue;
+
+        if (mmapFile->decomp) {
+            MolochDecomp_t *d = mmapFile->decomp;
+            MolochDecompBlock_t *blk = &d->blocks[d->readBlock % MOLOCH_DECOMP_BLOCKS];
+            recordPos += blk->decodedOff;
+            MOLOCH_THREAD_INCR(blk->refs);
+        }
+        MOLOCH_THREAD_INCR(mmapFile->refs);
+        reader_libpcapfile_packet(&h, data, recordPos, mmapZeroCopyId);
+        n++;
     }
 
+    if (rc == 0 && mmapFile->decomp && mmapFile->decomp->failed)
+        rc = -1;
+
+    if (n == 0 && rc < 0)
+        return -1;
+    return n;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_close()
+{
+    if (mmapFile) {
+        if (mmapBpfSet) {
+            pcap_freecode(&mmapBpf);
+            mmapBpfSet = 0;
+        }
+        reader_libpcapfile_mmap_close(mmapFile);
+        mmapFile = NULL;
+    }
+    pcap_close(pcap);
+}
+/******************************************************************************/
+/* Read up to offlineDispatchAfter packets from the current file and hand them
+ * to the packet threads.  Returns <= 0 when the file is finished.
+ */
+LOCAL int reader_libpcapfile_dispatch()
+{
     int r;
-    if (pktsToRead > 0) {
+    if (mmapFile) {
+        r = reader_libpcapfile_mmap_dispatch(pktsToRead > 0?MIN(pktsToRead, offlineDispatchAfter):offlineDispatchAfter);
+
+        if (r > 0 && pktsToRead > 0) {
+            pktsToRead -= r;
+            if (pktsToRead == 0)
+                r = 0;
+        }
+    } else if (pktsToRead > 0) {
         r = pcap_dispatch(pcap, MIN(pktsToRead, offlineDispatchAfter), reader_libpcapfile_pcap_cb, NULL);
 
         if (r > 0)
@@ -529,17 +1494,40 @@ LOCAL gboolean reader_libpcapfile_read()
         r = pcap_dispatch(pcap, offlineDispatchAfter, reader_libpcapfile_pcap_cb, NULL);
     }
     moloch_packet_batch_flush(&batch);
+    return r;
+}
+/******************************************************************************/
+LOCAL void reader_libpcapfile_finished(int r)
+{
+    if (config.pcapDelete && r == 0) {
+        if (config.debug)
+            LOG("Deleting %s", offlinePcapFilename);
+        int rc = unlink(offlinePcapFilename);
+        if (rc != 0)
+            LOG("Failed to delete file %s %s (%d)", offlinePcapFilename, strerror(errno), errno);
+    }
+    // mmap files give the slot back once all their packets are released
+    int mmaped = mmapFile != NULL;
+    reader_libpcapfile_close();
+    if (!mmaped)
+        reader_libpcapfile_slot_free(readerPos);
+}
+/******************************************************************************/
+LOCAL gboolean reader_libpcapfile_resume(gpointer UNUSED(uw));
+
+LOCAL gboolean reader_libpcapfile_read()
+{
+    // Stop watching until the packet threads, writer and ES drain
+    if (moloch_reader_flow_blocked()) {
+        moloch_reader_flow_resume(reader_libpcapfile_resume);
+        return G_SOURCE_REMOVE;
+    }
+
+    int r = reader_libpcapfile_dispatch();
 
     // Some kind of failure, move to the next file or quit
     if (r <= 0) {
-        if (config.pcapDelete && r == 0) {
-            if (config.debug)
-                LOG("Deleting %s", offlinePcapFilename);
-            int rc = unlink(offlinePcapFilename);
-            if (rc != 0)
-                LOG("Failed to delete file %s %s (%d)", offlinePcapFilename, strerror(errno), errno);
-        }
-        pcap_close(pcap);
+        reader_libpcapfile_finished(r);
         if (reader_libpcapfile_next()) {
             return G_SOURCE_REMOVE;
         }
@@ -555,7 +1543,62 @@ LOCAL gboolean reader_libpcapfile_read()
     return G_SOURCE_CONTINUE;
 }
 /******************************************************************************/
-LOCAL void reader_libpcapfile_opened()
+/* offlineThreads > 1, each thread owns one file at a time.  Per file ordering
+ * is kept since all of a file's packets go through the same producer rings.
+ */
+LOCAL void *reader_libpcapfile_thread(gpointer UNUSED(uw))
+{
+    moloch_packet_batch_init(&batch);
+
+    while (!config.quitting) {
+        // Only pop the name under the lock, opening the file and waiting for a slot isn't
+        MOLOCH_LOCK(offlineFiles);
+        gchar *filename = reader_libpcapfile_next_name();
+        MOLOCH_UNLOCK(offlineFiles);
+
+        if (!filename) {
+            if (config.pcapMonitor) {
+                usleep(100000);
+                continue;
+            }
+            break;
+        }
+
+        pcap = 0;
+        int rc = reader_libpcapfile_process(filename);
+        g_free(filename);
+        if (rc)
+            continue;
+
+        int r = 1;
+        while (!config.quitting && r > 0) {
+            if (moloch_reader_flow_blocked()) {
+                moloch_reader_flow_wait();
+                continue;
+            }
+            r = reader_libpcapfile_dispatch();
+        }
+        reader_libpcapfile_finished(r);
+    }
+
+    if (__sync_add_and_fetch(&offlineThreadsDone, 1) == config.offlineThreads)
+        moloch_quit();
+
+    return NULL;
+}
+/******************************************************************************/
+LOCAL gboolean reader_libpcapfile_resume(gpointer UNUSED(uw))
+{
+    int fd = mmapFile?mmapFile->fd:pcap_fileno(pcap);
+    if (fd == -1) {
+        g_timeout_add(100, reader_libpcapfile_read, NULL);
+    } else {
+        moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read, NULL);
+    }
+    return G_SOURCE_REMOVE;
+}
+/******************************************************************************/
+LOCAL int reader_libpcapfile_opened()
 {
     int moloch_db_can_quit();
 
@@ -573,11 +1616,22 @@ LOCAL void reader_libpcapfile_opened()
         }
     }
 
-    moloch_packet_set_dltsnap(pcap_datalink(pcap), pcap_snapshot(pcap));
+    // The first file sets the default link type, every file sets its readerPos below
+    MOLOCH_LOCK(offlineFiles);
+    if (offlineDlt == -1) {
+        moloch_packet_set_dltsnap(pcap_datalink(pcap), pcap_snapshot(pcap));
+        offlineDlt = pcap_datalink(pcap);
+    }
+    MOLOCH_UNLOCK(offlineFiles);
 
     offlineFile = pcap_file(pcap);
 
-    if (config.bpf && pcapFileHeader.dlt != DLT_NFLOG) {
+    if (config.bpf && pcap_datalink(pcap) != DLT_NFLOG && mmapFile) {
+        if (pcap_compile(pcap, &mmapBpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            LOGEXIT("ERROR - Couldn't compile filter: '%s' with %s", config.bpf, pcap_geterr(pcap));
+        }
+        mmapBpfSet = 1;
+    } else if (config.bpf && pcap_datalink(pcap) != DLT_NFLOG) {
         struct bpf_program   bpf;
 
         if (pcap_compile(pcap, &bpf, config.bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
@@ -590,21 +1644,32 @@ LOCAL void reader_libpcapfile_opened()
         pcap_freecode(&bpf);
     }
 
-    readerPos++;
+    // Reader threads can wait for a slot, the main thread is called back
+    int pos = reader_libpcapfile_slot_get(config.offlineThreads > 1);
+    if (pos == -1)
+        return 0;
+    readerPos = pos;
+    return reader_libpcapfile_opened_slot();
+}
+/******************************************************************************/
+LOCAL int reader_libpcapfile_opened_slot()
+{
     // We've wrapped around all 256 reader items, clear the previous file information
     if (readerFileName[readerPos]) {
         g_free(readerFileName[readerPos]);
         readerOutputIds[readerPos] = 0;
     }
     readerFileName[readerPos] = g_strdup(offlinePcapFilename);
+    moloch_packet_set_reader_dlt(readerPos, pcap_datalink(pcap));
 
-    int fd = pcap_fileno(pcap);
-    if (fd == -1) {
-        g_timeout_add(100, reader_libpcapfile_read, NULL);
-    } else {
-        moloch_watch_fd(fd, MOLOCH_GIO_READ_COND, reader_libpcapfile_read, NULL);
+    if (mmapFile) {
+        mmapFile->readerPos = readerPos;
+        mmapFiles[readerPos] = mmapFile;
     }
 
+    if (config.offlineThreads == 1)
+        reader_libpcapfile_resume(NULL);
+
     if (filenameOpsNum > 0) {
 
         // Free any previously allocated
@@ -633,8 +1698,19 @@ LOCAL void reader_libpcapfile_opened()
             g_match_info_free(match_info);
         }
     }
+    return 0;
 }
 
+/******************************************************************************/
+LOCAL gboolean reader_libpcapfile_slot_gfunc(gpointer UNUSED(uw))
+{
+    int pos = reader_libpcapfile_slot_get(FALSE);
+    if (pos != -1) {
+        readerPos = pos;
+        reader_libpcapfile_opened_slot();
+    }
+    return G_SOURCE_REMOVE;
+}
 /******************************************************************************/
 LOCAL void reader_libpcapfile_start() {
 
@@ -688,6 +1764,15 @@ LOCAL void reader_libpcapfile_start() {
     g_strfreev(filenameOpsStr);
 
     // Now actually start
+    if (config.offlineThreads > 1) {
+        for (i = 0; i < config.offlineThreads; i++) {
+            char name[100];
+            snprintf(name, sizeof(name), "moloch-offline%d", i);
+            g_thread_unref(g_thread_new(name, &reader_libpcapfile_thread, NULL));
+        }
+        return;
+    }
+
     reader_libpcapfile_next();
     if (!pcap) {
         if (config.pcapMonitor) {
@@ -701,10 +1786,17 @@ LOCAL void reader_libpcapfile_start() {
 void reader_libpcapfile_init(char *UNUSED(name))
 {
     offlineDispatchAfter        = moloch_config_int(NULL, "offlineDispatchAfter", 2500, 1, 0x7fff);
+    offlineMmap                 = moloch_config_boolean(NULL, "offlineMmap", FALSE);
+
+    mmapZeroCopyId = moloch_packet_zerocopy_register(reader_libpcapfile_mmap_release);
 
     moloch_reader_start         = reader_libpcapfile_start;
     moloch_reader_stats         = reader_libpcapfile_stats;
 
+    if (config.offlineThreads > 1 && config.flushBetween)
+        LOGEXIT("ERROR - flush between files isn't supported with offlineThreads > 1");
+    moloch_packet_add_producers(config.offlineThreads);
+
     if (config.pcapMonitor)
         reader_libpcapfile_init_monitor();
 
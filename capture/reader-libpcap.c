@@ -91,11 +91,13 @@ LOCAL void *reader_libpcap_thread(gpointer posv)
 }
 /******************************************************************************/
 void reader_libpcap_start() {
-    //ALW - Bug: assumes all linktypes are the same
+    // The first interface is the default, each interface then sets its own
     moloch_packet_set_dltsnap(pcap_datalink(pcaps[0]), pcap_snapshot(pcaps[0]));
 
     int i;
     for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        moloch_packet_set_reader_dlt(i, pcap_datalink(pcaps[i]));
+
         if (config.bpf) {
             struct bpf_program   bpf;
 
@@ -194,6 +196,7 @@ void reader_libpcap_init(char *UNUSED(name))
     if (i == MAX_INTERFACES && config.interface[MAX_INTERFACES]) {
         LOGEXIT("Only support up to %d interfaces", MAX_INTERFACES);
     }
+    moloch_packet_add_producers(i);
 
     moloch_reader_start         = reader_libpcap_start;
     moloch_reader_stop          = reader_libpcap_stop;
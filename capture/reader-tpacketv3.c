@@ -38,8 +38,10 @@ void reader_tpacketv3_init(char *UNUSED(name))
 #include <linux/if_packet.h>
 #include <linux/filter.h>
 #include <net/if.h>
+#include <sched.h>
 #include <netinet/in.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <errno.h>
 #include <poll.h>
 
@@ -51,20 +53,89 @@ void reader_tpacketv3_init(char *UNUSED(name))
 
 #else
 
+#ifndef PACKET_FANOUT_EBPF
+#define PACKET_FANOUT_EBPF 7
+#endif
+
+#ifndef PACKET_FANOUT_DATA
+#define PACKET_FANOUT_DATA 22
+#endif
+
+/* Just enough of linux/bpf.h to load the fanout program, the real header
+ * can't be included with pcap.h since both define struct bpf_insn.
+ */
+#define MOLOCH_BPF_PROG_LOAD               5
+#define MOLOCH_BPF_PROG_TYPE_SOCKET_FILTER 1
+#define MOLOCH_BPF_FUNC_SKB_LOAD_BYTES     26
+#define MOLOCH_BPF_ALU64                   0x07
+#define MOLOCH_BPF_MOV                     0xb0
+#define MOLOCH_BPF_JNE                     0x50
+#define MOLOCH_BPF_END                     0xd0
+#define MOLOCH_BPF_TO_BE                   0x08
+#define MOLOCH_BPF_CALL                    0x80
+#define MOLOCH_BPF_EXIT                    0x90
+#define MOLOCH_SKB_PROTOCOL                16
+
+typedef struct {
+    uint8_t   code;
+    uint8_t   dst_reg:4;
+    uint8_t   src_reg:4;
+    int16_t   off;
+    int32_t   imm;
+} MolochEbpfInsn_t;
+
+typedef struct {
+    uint32_t  prog_type;
+    uint32_t  insn_cnt;
+    uint64_t  insns;
+    uint64_t  license;
+    uint32_t  log_level;
+    uint32_t  log_size;
+    uint64_t  log_buf;
+} MolochBpfProgLoad_t;
+
+#define MOLOCH_EBPF_MAX_INSNS  512
+#define MOLOCH_EBPF_MAX_LABELS 16
+
+typedef struct {
+    MolochEbpfInsn_t     insns[MOLOCH_EBPF_MAX_INSNS];
+    uint8_t              isJump[MOLOCH_EBPF_MAX_INSNS];
+    int                  labels[MOLOCH_EBPF_MAX_LABELS];
+    int                  cnt;
+} MolochEbpfProg_t;
+
 typedef struct {
     int                  fd;
+    int                  interface;
+    int                  node;      // numa node of the interface, -1 unknown
     struct tpacket_req3  req;
     uint8_t             *map;
     struct iovec        *rd;
     int                  nextPos;
+    uint32_t            *refs;
+    int                  refsWaiting; // reader waiting on refs of a block
     MOLOCH_LOCK_EXTERN(lock);
+    MOLOCH_COND_EXTERN(lock);
 } MolochTPacketV3_t;
 
-LOCAL MolochTPacketV3_t infos[MAX_INTERFACES];
+LOCAL MolochTPacketV3_t infos[MAX_INTERFACES * MOLOCH_MAX_PACKET_THREADS];
+LOCAL int numInfos;
 
+// With ebpf fanout each interface has a ring per packet thread, otherwise one
+LOCAL int ringsPerInterface;
 LOCAL int numThreads;
+LOCAL uint8_t zeroCopyId;
+LOCAL int fanoutEbpf;
+
+// An interface's rings are mapped back to back so a packet's ring is one divide
+LOCAL uint8_t *interfaceMap[MAX_INTERFACES];
+LOCAL uint64_t ringMapLen;
+
+LOCAL int *cpus;
+LOCAL int numCpus;
 
 extern MolochPcapFileHdr_t   pcapFileHeader;
+extern uint32_t              hashSalt;
 LOCAL struct bpf_program     bpf;
 
 LOCAL MolochReaderStats_t gStats;
@@ -78,7 +149,7 @@ int reader_tpacketv3_stats(MolochReaderStats_t *stats)
     int i;
 
     struct tpacket_stats_v3 tpstats;
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+    for (i = 0; i < numInfos; i++) {
         socklen_t len = sizeof(tpstats);
         getsockopt(infos[i].fd, SOL_PACKET, PACKET_STATISTICS, &tpstats, &len);
 
@@ -90,12 +161,68 @@ int reader_tpacketv3_stats(MolochReaderStats_t *stats)
     return 0;
 }
 /******************************************************************************/
+/* A block is only given back to the kernel once the reader and every packet
+ * pointing into it are done with it.
+ */
+LOCAL inline void reader_tpacketv3_block_unref(int info, int pos)
+{
+    if (__sync_sub_and_fetch(&infos[info].refs[pos], 1) == 0) {
+        struct tpacket_block_desc *tbd = infos[info].rd[pos].iov_base;
+        __sync_synchronize();
+        tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+        if (infos[info].refsWaiting) {
+            MOLOCH_LOCK(infos[info].lock);
+            MOLOCH_COND_BROADCAST(infos[info].lock);
+            MOLOCH_UNLOCK(infos[info].lock);
+        }
+    }
+}
+/******************************************************************************/
+/* The block is still referenced from the last time around the ring, and the
+ * kernel is stalled behind it.  Have the packet threads copy out what they are
+ * holding and wait for the last release.
+ */
+LOCAL void reader_tpacketv3_block_wait(int info, int pos)
+{
+    struct timespec ts;
+
+    moloch_packet_zerocopy_flush();
+
+    MOLOCH_LOCK(infos[info].lock);
+    infos[info].refsWaiting++;
+    __sync_synchronize();
+    while (infos[info].refs[pos] != 0 && !config.quitting) {
+        // Timed so a quit isn't missed, the release wakes us
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        MOLOCH_COND_TIMEDWAIT(infos[info].lock, ts);
+    }
+    infos[info].refsWaiting--;
+    MOLOCH_UNLOCK(infos[info].lock);
+}
+/******************************************************************************/
+LOCAL void reader_tpacketv3_release(MolochPacket_t * const packet)
+{
+    // readerPos is the interface, find which of its rings the packet is in
+    const uint64_t offset = packet->pkt - interfaceMap[packet->readerPos];
+    const int info = packet->readerPos * ringsPerInterface + offset / ringMapLen;
+
+    reader_tpacketv3_block_unref(info, (offset % ringMapLen) / infos[info].req.tp_block_size);
+}
+/******************************************************************************/
 LOCAL void *reader_tpacketv3_thread(gpointer infov)
 {
     long info = (long)infov;
     struct pollfd pfd;
     int pos = -1;
 
+    // The ring's flows all hash to the packet thread with the same index
+    if (fanoutEbpf && numCpus)
+        moloch_thread_set_cpu(cpus[(info % ringsPerInterface) % numCpus]);
+    else if (infos[info].node >= 0)
+        moloch_thread_set_numa_node(infos[info].node);
+
     memset(&pfd, 0, sizeof(pfd));
     pfd.fd = infos[info].fd;
     pfd.events = POLLIN | POLLERR;
@@ -129,6 +256,12 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
             LOG("Stats pos:%d info:%ld status:%x waiting:%d total cnt:%d total waiting:%d", pos, info, tbd->hdr.bh1.block_status, tbd->hdr.bh1.num_pkts, cnt, waiting);
         }
 
+        // Still in use from the last time around the ring, the kernel is waiting on it too
+        if (infos[info].refs[pos] != 0) {
+            reader_tpacketv3_block_wait(info, pos);
+            continue;
+        }
+
         // Wait until the block is owned by moloch
         if ((tbd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
             poll(&pfd, 1, -1);
@@ -140,6 +273,10 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
         th = (struct tpacket3_hdr *) ((uint8_t *) tbd + tbd->hdr.bh1.offset_to_first_pkt);
         uint16_t p;
 
+        // One ref for each packet plus one for us while we are still batching
+        if (zeroCopyId)
+            infos[info].refs[pos] = tbd->hdr.bh1.num_pkts + 1;
+
         for (p = 0; p < tbd->hdr.bh1.num_pkts; p++) {
             if (unlikely(th->tp_snaplen != th->tp_len)) {
                 LOGEXIT("ERROR - Arkime requires full packet captures caplen: %d pktlen: %d\n"
@@ -152,7 +289,8 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
             packet->pktlen        = th->tp_len;
             packet->ts.tv_sec     = th->tp_sec;
             packet->ts.tv_usec    = th->tp_nsec/1000;
-            packet->readerPos     = info;
+            packet->readerPos     = infos[info].interface;
+            packet->zeroCopy      = zeroCopyId;
 
             if ((th->tp_status & TP_STATUS_VLAN_VALID) && th->hv1.tp_vlan_tci) {
                 packet->vlan = th->hv1.tp_vlan_tci & 0xfff;
@@ -164,7 +302,10 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
         }
         moloch_packet_batch_flush(&batch);
 
-        tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        if (zeroCopyId)
+            reader_tpacketv3_block_unref(info, pos);
+        else
+            tbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
         pos = -1;
     }
     return NULL;
@@ -173,9 +314,9 @@ LOCAL void *reader_tpacketv3_thread(gpointer infov)
 void reader_tpacketv3_start() {
     int i, t;
     char name[100];
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+    for (i = 0; i < numInfos; i++) {
         for (t = 0; t < numThreads; t++) {
-            snprintf(name, sizeof(name), "moloch-af3%d-%d", i, t);
+            snprintf(name, sizeof(name), "moloch-af3%d-%d", infos[i].interface, (i % ringsPerInterface) + t);
             g_thread_unref(g_thread_new(name, &reader_tpacketv3_thread, (gpointer)(long)i));
         }
     }
@@ -184,16 +325,329 @@ void reader_tpacketv3_start() {
 void reader_tpacketv3_exit()
 {
     int i;
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+    for (i = 0; i < numInfos; i++) {
         close(infos[i].fd);
     }
 }
 /******************************************************************************/
-void reader_tpacketv3_init(char *UNUSED(name))
+LOCAL void reader_tpacketv3_emit(MolochEbpfProg_t *prog, uint8_t code, int dst, int src, int off, int imm)
+{
+    if (prog->cnt == MOLOCH_EBPF_MAX_INSNS)
+        LOGEXIT("ERROR - tpacketv3 fanout program too large");
+
+    MolochEbpfInsn_t *insn = &prog->insns[prog->cnt++];
+    insn->code = code;
+    insn->dst_reg = dst;
+    insn->src_reg = src;
+    insn->off = off;
+    insn->imm = imm;
+}
+/******************************************************************************/
+/* Jumps are emitted with a label number as the offset and patched once the
+ * whole program has been generated.
+ */
+LOCAL void reader_tpacketv3_jump(MolochEbpfProg_t *prog, uint8_t code, int dst, int src, int imm, int label)
+{
+    prog->isJump[prog->cnt] = 1;
+    reader_tpacketv3_emit(prog, BPF_JMP | code, dst, src, label, imm);
+}
+/******************************************************************************/
+LOCAL void reader_tpacketv3_label(MolochEbpfProg_t *prog, int label)
+{
+    prog->labels[label] = prog->cnt;
+}
+/******************************************************************************/
+#define EMIT(code, dst, src, off, imm) reader_tpacketv3_emit(prog, code, dst, src, off, imm)
+#define MOV64_IMM(dst, imm)            EMIT(MOLOCH_BPF_ALU64 | MOLOCH_BPF_MOV | BPF_K, dst, 0, 0, imm)
+#define MOV64_REG(dst, src)            EMIT(MOLOCH_BPF_ALU64 | MOLOCH_BPF_MOV | BPF_X, dst, src, 0, 0)
+#define ADD64_IMM(dst, imm)            EMIT(MOLOCH_BPF_ALU64 | BPF_ADD | BPF_K, dst, 0, 0, imm)
+#define LDX(size, dst, src, off)       EMIT(BPF_LDX | size | BPF_MEM, dst, src, off, 0)
+#define STX(size, dst, src, off)       EMIT(BPF_STX | size | BPF_MEM, dst, src, off, 0)
+#define ST(size, dst, off, imm)        EMIT(BPF_ST | size | BPF_MEM, dst, 0, off, imm)
+#define SWAP_BE(dst, bits)             EMIT(BPF_ALU | MOLOCH_BPF_END | MOLOCH_BPF_TO_BE, dst, 0, 0, bits)
+#define JUMP(code, dst, src, imm, l)   reader_tpacketv3_jump(prog, code, dst, src, imm, l)
+
+#define R0  0
+#define R1  1
+#define R2  2
+#define R3  3
+#define R4  4
+#define R6  6
+#define R7  7
+#define R8  8
+#define R10 10
+
+// Stack layout
+#define FP_HDR   -96
+#define FP_PORTS -56
+#define FP_KEY   -48
+
+// Labels, each ip version has its own 5 starting at its base
+#define L_FAIL    0
+#define L_IP4     1
+#define L_IP6     6
+
+#define L_PORTS   1
+#define L_KEY     2
+#define L_SWAP    3
+#define L_ORDERED 4
+
+/* Emit the code for one ip version, which builds the same key as
+ * moloch_session_id/moloch_session_id6 on the stack and then hashes it like
+ * moloch_session_hash.  Protocols without ports use 0 like icmp and esp do.
+ */
+LOCAL void reader_tpacketv3_fanout_ip(MolochEbpfProg_t *prog, int base, int hdrLen, int protoOff, int srcOff, int addrLen)
+{
+    const int keyLen = 5 + 2*addrLen;
+    int i;
+
+    reader_tpacketv3_label(prog, base);
+
+    // bpf_skb_load_bytes(skb, 0, hdr, hdrLen), skb->data is at the ip header
+    MOV64_REG(R1, R6);
+    MOV64_IMM(R2, 0);
+    MOV64_REG(R3, R10);
+    ADD64_IMM(R3, FP_HDR);
+    MOV64_IMM(R4, hdrLen);
+    EMIT(BPF_JMP | MOLOCH_BPF_CALL, 0, 0, 0, MOLOCH_BPF_FUNC_SKB_LOAD_BYTES);
+    JUMP(MOLOCH_BPF_JNE, R0, 0, 0, L_FAIL);
+    ST(BPF_W, R10, FP_PORTS, 0);
+
+    // ip4 fragments don't have ports
+    if (addrLen == 4) {
+        LDX(BPF_H, R1, R10, FP_HDR + 6);
+        EMIT(BPF_ALU | BPF_AND | BPF_K, R1, 0, 0, htons(0x3fff));
+        JUMP(MOLOCH_BPF_JNE, R1, 0, 0, base + L_KEY);
+    }
+
+    LDX(BPF_B, R1, R10, FP_HDR + protoOff);
+    JUMP(BPF_JEQ | BPF_K, R1, 0, IPPROTO_TCP, base + L_PORTS);
+    JUMP(BPF_JEQ | BPF_K, R1, 0, IPPROTO_UDP, base + L_PORTS);
+    JUMP(BPF_JEQ | BPF_K, R1, 0, IPPROTO_SCTP, base + L_PORTS);
+    JUMP(BPF_JA, 0, 0, 0, base + L_KEY);
+
+    reader_tpacketv3_label(prog, base + L_PORTS);
+    if (addrLen == 4) {
+        LDX(BPF_B, R2, R10, FP_HDR);
+        EMIT(BPF_ALU | BPF_AND | BPF_K, R2, 0, 0, 0xf);
+        EMIT(BPF_ALU | BPF_LSH | BPF_K, R2, 0, 0, 2);
+    } else {
+        MOV64_IMM(R2, hdrLen);
+    }
+    MOV64_REG(R1, R6);
+    MOV64_REG(R3, R10);
+    ADD64_IMM(R3, FP_PORTS);
+    MOV64_IMM(R4, 4);
+    EMIT(BPF_JMP | MOLOCH_BPF_CALL, 0, 0, 0, MOLOCH_BPF_FUNC_SKB_LOAD_BYTES);
+    JUMP(MOLOCH_BPF_JNE, R0, 0, 0, L_FAIL);
+
+    // r7/r1 is the first addr/port, r8/r2 the second
+    reader_tpacketv3_label(prog, base + L_KEY);
+    MOV64_REG(R7, R10);
+    ADD64_IMM(R7, FP_HDR + srcOff);
+    MOV64_REG(R8, R10);
+    ADD64_IMM(R8, FP_HDR + srcOff + addrLen);
+    LDX(BPF_H, R1, R10, FP_PORTS);
+    LDX(BPF_H, R2, R10, FP_PORTS + 2);
+
+    // ip4 compares the raw uint32s, ip6 uses memcmp
+    for (i = 0; i < addrLen; i += 4) {
+        LDX(BPF_W, R3, R7, i);
+        LDX(BPF_W, R4, R8, i);
+        if (addrLen == 16) {
+            SWAP_BE(R3, 32);
+            SWAP_BE(R4, 32);
+        }
+        JUMP(BPF_JGT | BPF_X, R4, R3, 0, base + L_ORDERED);
+        JUMP(BPF_JGT | BPF_X, R3, R4, 0, base + L_SWAP);
+    }
+    MOV64_REG(R3, R1);
+    SWAP_BE(R3, 16);
+    MOV64_REG(R4, R2);
+    SWAP_BE(R4, 16);
+    JUMP(BPF_JGT | BPF_X, R4, R3, 0, base + L_ORDERED);
+
+    reader_tpacketv3_label(prog, base + L_SWAP);
+    MOV64_REG(R3, R7);
+    MOV64_REG(R7, R8);
+    MOV64_REG(R8, R3);
+    MOV64_REG(R3, R1);
+    MOV64_REG(R1, R2);
+    MOV64_REG(R2, R3);
+
+    // Stack access has to be aligned, so the key is written a byte at a time
+    reader_tpacketv3_label(prog, base + L_ORDERED);
+    ST(BPF_B, R10, FP_KEY, keyLen);
+    for (i = 0; i < addrLen; i++) {
+        LDX(BPF_B, R3, R7, i);
+        STX(BPF_B, R10, R3, FP_KEY + 1 + i);
+        LDX(BPF_B, R3, R8, i);
+        STX(BPF_B, R10, R3, FP_KEY + 3 + addrLen + i);
+    }
+    STX(BPF_B, R10, R1, FP_KEY + 1 + addrLen);
+    EMIT(BPF_ALU | BPF_RSH | BPF_K, R1, 0, 0, 8);
+    STX(BPF_B, R10, R1, FP_KEY + 2 + addrLen);
+    STX(BPF_B, R10, R2, FP_KEY + 3 + 2*addrLen);
+    EMIT(BPF_ALU | BPF_RSH | BPF_K, R2, 0, 0, 8);
+    STX(BPF_B, R10, R2, FP_KEY + 4 + 2*addrLen);
+
+    // moloch_session_hash
+    LDX(BPF_B, R0, R10, FP_KEY + keyLen - 1);
+    for (i = 0; i < keyLen - 4; i += 4) {
+        LDX(BPF_W, R1, R10, FP_KEY + i);
+#ifndef NEWHASH
+        EMIT(BPF_ALU | BPF_ADD | BPF_X, R0, R1, 0, 0);
+        EMIT(BPF_ALU | BPF_MUL | BPF_K, R0, 0, 0, (int32_t)0xc6a4a793);
+        EMIT(BPF_ALU | MOLOCH_BPF_MOV | BPF_X, R1, R0, 0, 0);
+        EMIT(BPF_ALU | BPF_RSH | BPF_K, R1, 0, 0, 16);
+        EMIT(BPF_ALU | BPF_XOR | BPF_X, R0, R1, 0, 0);
+#else
+        EMIT(BPF_ALU | BPF_XOR | BPF_X, R0, R1, 0, 0);
+#endif
+    }
+    EMIT(BPF_ALU | BPF_XOR | BPF_K, R0, 0, 0, (int32_t)hashSalt);
+    EMIT(BPF_JMP | MOLOCH_BPF_EXIT, 0, 0, 0, 0);
+}
+/******************************************************************************/
+/* The kernel picks fanout socket (return value % number of sockets), so with
+ * a socket per packet thread joined in order each ring only gets the flows
+ * its packet thread owns.
+ */
+LOCAL int reader_tpacketv3_fanout_prog()
 {
+    MolochEbpfProg_t *prog = MOLOCH_TYPE_ALLOC0(MolochEbpfProg_t);
     int i;
+
+    MOV64_REG(R6, R1);
+    LDX(BPF_W, R2, R6, MOLOCH_SKB_PROTOCOL);
+    JUMP(BPF_JEQ | BPF_K, R2, 0, htons(ETH_P_IP), L_IP4);
+    JUMP(BPF_JEQ | BPF_K, R2, 0, htons(ETH_P_IPV6), L_IP6);
+
+    // Everything else and short packets go to the first socket
+    reader_tpacketv3_label(prog, L_FAIL);
+    MOV64_IMM(R0, 0);
+    EMIT(BPF_JMP | MOLOCH_BPF_EXIT, 0, 0, 0, 0);
+
+    reader_tpacketv3_fanout_ip(prog, L_IP4, 20, 9, 12, 4);
+    reader_tpacketv3_fanout_ip(prog, L_IP6, 40, 6, 8, 16);
+
+    for (i = 0; i < prog->cnt; i++) {
+        if (prog->isJump[i])
+            prog->insns[i].off = prog->labels[prog->insns[i].off] - i - 1;
+    }
+
+    char log[4096];
+    MolochBpfProgLoad_t attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = MOLOCH_BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns     = (uint64_t)(long)prog->insns;
+    attr.insn_cnt  = prog->cnt;
+    attr.license   = (uint64_t)(long)"Dual BSD/GPL";
+    attr.log_buf   = (uint64_t)(long)log;
+    attr.log_size  = sizeof(log);
+    attr.log_level = 1;
+    log[0] = 0;
+
+    int fd = syscall(__NR_bpf, MOLOCH_BPF_PROG_LOAD, &attr, sizeof(attr));
+    if (fd < 0)
+        LOGEXIT("ERROR - Couldn't load tpacketv3 fanout program: %s\n%s", strerror(errno), log);
+
+    MOLOCH_TYPE_FREE(MolochEbpfProg_t, prog);
+    return fd;
+}
+#undef EMIT
+#undef MOV64_IMM
+#undef MOV64_REG
+#undef ADD64_IMM
+#undef LDX
+#undef STX
+#undef ST
+#undef SWAP_BE
+#undef JUMP
+/******************************************************************************/
+LOCAL void reader_tpacketv3_open(int info, int interface, int blocksize, int blocks, uint8_t *addr)
+{
+    int ifindex = if_nametoindex(config.interface[interface]);
+
+    MOLOCH_LOCK_INIT(infos[info].lock);
+    MOLOCH_COND_INIT(infos[info].lock);
+    infos[info].interface = interface;
+    infos[info].node = config.numaPlacement ? moloch_numa_interface_node(config.interface[interface]) : -1;
+    infos[info].fd = socket(AF_PACKET, SOCK_RAW, 0);
+
+    int version = TPACKET_V3;
+    if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        LOGEXIT("Error setting TPACKET_V3, might need a newer kernel: %s", strerror(errno));
+
+
+    memset(&infos[info].req, 0, sizeof(infos[info].req));
+    infos[info].req.tp_block_size = blocksize;
+    infos[info].req.tp_block_nr = blocks;
+    infos[info].req.tp_frame_size = config.snapLen;
+    infos[info].req.tp_frame_nr = (blocksize * infos[info].req.tp_block_nr) / infos[info].req.tp_frame_size;
+    infos[info].req.tp_retire_blk_tov = 60;
+    infos[info].req.tp_feature_req_word = 0;
+
+    // The kernel allocates the ring blocks from the node we are running on
+    cpu_set_t saved;
+    int       restore = infos[info].node >= 0 &&
+                        sched_getaffinity(0, sizeof(saved), &saved) == 0 &&
+                        moloch_thread_set_numa_node(infos[info].node) == 0;
+
+    if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_RX_RING, &infos[info].req, sizeof(infos[info].req)) < 0)
+        LOGEXIT("Error setting PACKET_RX_RING: %s", strerror(errno));
+
+    if (restore)
+        sched_setaffinity(0, sizeof(saved), &saved);
+
+    struct packet_mreq      mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type    = PACKET_MR_PROMISC;
+    if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+        LOGEXIT("Error setting PROMISC: %s", strerror(errno));
+
+    if (config.bpf) {
+        struct sock_fprog       fcode;
+        fcode.len = bpf.bf_len;
+        fcode.filter = (struct sock_filter *)bpf.bf_insns;
+        if (setsockopt(infos[info].fd, SOL_SOCKET, SO_ATTACH_FILTER, &fcode, sizeof(fcode)) < 0)
+            LOGEXIT("Error setting SO_ATTACH_FILTER: %s", strerror(errno));
+    }
+
+    infos[info].map = mmap64(addr, infos[info].req.tp_block_size * infos[info].req.tp_block_nr,
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_FIXED, infos[info].fd, 0);
+    if (unlikely(infos[info].map == MAP_FAILED)) {
+        LOGEXIT("ERROR - MMap64 failure in reader_tpacketv3_init, %d: %s",errno, strerror(errno));
+    }
+    infos[info].rd = malloc(infos[info].req.tp_block_nr * sizeof(struct iovec));
+    infos[info].refs = calloc(infos[info].req.tp_block_nr, sizeof(uint32_t));
+
+    uint16_t j;
+    for (j = 0; j < infos[info].req.tp_block_nr; j++) {
+        infos[info].rd[j].iov_base = infos[info].map + (j * infos[info].req.tp_block_size);
+        infos[info].rd[j].iov_len = infos[info].req.tp_block_size;
+    }
+
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = PF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex = ifindex;
+
+    if (bind(infos[info].fd, (struct sockaddr *) &ll, sizeof(ll)) < 0)
+        LOGEXIT("Error binding %s: %s", config.interface[interface], strerror(errno));
+}
+/******************************************************************************/
+void reader_tpacketv3_init(char *UNUSED(name))
+{
+    int i, r;
     int blocksize = moloch_config_int(NULL, "tpacketv3BlockSize", 1<<21, 1<<16, 1U<<31);
-    numThreads = moloch_config_int(NULL, "tpacketv3NumThreads", 2, 1, 6);
+    numThreads = moloch_config_int(NULL, "tpacketv3NumThreads", 2, 1, MOLOCH_MAX_PACKET_THREADS);
+
+    if (moloch_config_boolean(NULL, "tpacketv3ZeroCopy", TRUE)) {
+        zeroCopyId = moloch_packet_zerocopy_register(reader_tpacketv3_release);
+    }
 
     if (blocksize % getpagesize() != 0) {
         LOGEXIT("block size %d not divisible by pagesize %d", blocksize, getpagesize());
@@ -215,70 +669,88 @@ void reader_tpacketv3_init(char *UNUSED(name))
 
     int fanout_group_id = moloch_config_int(NULL, "tpacketv3ClusterId", 0x0000, 0x0000, 0xffff);
 
-    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
-        MOLOCH_LOCK_INIT(infos[i].lock);
-
-        int ifindex = if_nametoindex(config.interface[i]);
-
-        infos[i].fd = socket(AF_PACKET, SOCK_RAW, 0);
-
-        int version = TPACKET_V3;
-        if (setsockopt(infos[i].fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
-            LOGEXIT("Error setting TPACKET_V3, might need a newer kernel: %s", strerror(errno));
-
-
-        memset(&infos[i].req, 0, sizeof(infos[i].req));
-        infos[i].req.tp_block_size = blocksize;
-        infos[i].req.tp_block_nr = numThreads*64;
-        infos[i].req.tp_frame_size = config.snapLen;
-        infos[i].req.tp_frame_nr = (blocksize * infos[i].req.tp_block_nr) / infos[i].req.tp_frame_size;
-        infos[i].req.tp_retire_blk_tov = 60;
-        infos[i].req.tp_feature_req_word = 0;
-        if (setsockopt(infos[i].fd, SOL_PACKET, PACKET_RX_RING, &infos[i].req, sizeof(infos[i].req)) < 0)
-            LOGEXIT("Error setting PACKET_RX_RING: %s", strerror(errno));
-
-        struct packet_mreq      mreq;
-        memset(&mreq, 0, sizeof(mreq));
-        mreq.mr_ifindex = ifindex;
-        mreq.mr_type    = PACKET_MR_PROMISC;
-        if (setsockopt(infos[i].fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
-            LOGEXIT("Error setting PROMISC: %s", strerror(errno));
-
-        if (config.bpf) {
-            struct sock_fprog       fcode;
-            fcode.len = bpf.bf_len;
-            fcode.filter = (struct sock_filter *)bpf.bf_insns;
-            if (setsockopt(infos[i].fd, SOL_SOCKET, SO_ATTACH_FILTER, &fcode, sizeof(fcode)) < 0)
-                LOGEXIT("Error setting SO_ATTACH_FILTER: %s", strerror(errno));
+    char *fanoutMode = moloch_config_str(NULL, "tpacketv3FanoutMode", "hash");
+    if (strcmp(fanoutMode, "ebpf") == 0) {
+        fanoutEbpf = 1;
+    } else if (strcmp(fanoutMode, "hash") != 0) {
+        LOGEXIT("Unknown tpacketv3FanoutMode '%s', must be hash or ebpf", fanoutMode);
+    }
+    g_free(fanoutMode);
+
+    /* The ebpf program picks ring hash % packetThreads, but with interfaces on
+     * more than one numa node packet threads are picked per node.
+     */
+    if (fanoutEbpf && config.numaPlacement && !config.pcapReadOffline) {
+        int first = -1;
+        for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+            int node = moloch_numa_interface_node(config.interface[i]);
+            if (node < 0) {
+                first = -1;
+                break;
+            }
+            if (first == -1)
+                first = node;
+            else if (node != first)
+                first = -2;
         }
+        if (first == -2)
+            LOGEXIT("ERROR - tpacketv3FanoutMode=ebpf can't be used with numaPlacement when interfaces are on different numa nodes");
+    }
 
-        infos[i].map = mmap64(NULL, infos[i].req.tp_block_size * infos[i].req.tp_block_nr,
-                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, infos[i].fd, 0);
-        if (unlikely(infos[i].map == MAP_FAILED)) {
-            LOGEXIT("ERROR - MMap64 failure in reader_tpacketv3_init, %d: %s",errno, strerror(errno));
+    // A ring per packet thread, each read by a single thread
+    int progFd = -1;
+    if (fanoutEbpf) {
+        progFd = reader_tpacketv3_fanout_prog();
+        ringsPerInterface = config.packetThreads;
+        numThreads = 1;
+        if (fanout_group_id == 0)
+            fanout_group_id = (getpid() & 0x7fff) + 1;
+    } else {
+        ringsPerInterface = 1;
+    }
+
+    gchar **cpuList = moloch_config_str_list(NULL, "tpacketv3Cpus", NULL);
+    if (cpuList) {
+        for (numCpus = 0; cpuList[numCpus]; numCpus++);
+        cpus = malloc(numCpus * sizeof(int));
+        for (i = 0; i < numCpus; i++) {
+            cpus[i] = atoi(cpuList[i]);
         }
-        infos[i].rd = malloc(infos[i].req.tp_block_nr * sizeof(struct iovec));
+        g_strfreev(cpuList);
 
-        uint16_t j;
-        for (j = 0; j < infos[i].req.tp_block_nr; j++) {
-            infos[i].rd[j].iov_base = infos[i].map + (j * infos[i].req.tp_block_size);
-            infos[i].rd[j].iov_len = infos[i].req.tp_block_size;
+        for (i = 0; i < config.packetThreads && numCpus; i++) {
+            moloch_packet_set_cpu(i, cpus[i % numCpus]);
         }
+    }
 
-        struct sockaddr_ll ll;
-        memset(&ll, 0, sizeof(ll));
-        ll.sll_family = PF_PACKET;
-        ll.sll_protocol = htons(ETH_P_ALL);
-        ll.sll_ifindex = ifindex;
-
-        if (bind(infos[i].fd, (struct sockaddr *) &ll, sizeof(ll)) < 0)
-            LOGEXIT("Error binding %s: %s", config.interface[i], strerror(errno));
-        
-        if (fanout_group_id != 0) {
-            int fanout_type = PACKET_FANOUT_HASH;
-            int fanout_arg = ((fanout_group_id+i) | (fanout_type << 16));
-            if(setsockopt(infos[i].fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0)
-                LOGEXIT("Error setting packet fanout parameters: (%d,%s)", fanout_group_id, strerror(errno));
+    const int blocks = (fanoutEbpf?1:numThreads)*64;
+    ringMapLen = (uint64_t)blocksize * blocks;
+
+    for (i = 0; i < MAX_INTERFACES && config.interface[i]; i++) {
+        // Reserve the address space, each ring is mapped over its part of it
+        interfaceMap[i] = mmap64(NULL, ringMapLen * ringsPerInterface, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (unlikely(interfaceMap[i] == MAP_FAILED)) {
+            LOGEXIT("ERROR - MMap64 failure in reader_tpacketv3_init, %d: %s",errno, strerror(errno));
+        }
+
+        for (r = 0; r < ringsPerInterface; r++) {
+            int info = numInfos++;
+            reader_tpacketv3_open(info, i, blocksize, blocks, interfaceMap[i] + r * ringMapLen);
+
+            if (fanout_group_id != 0) {
+                int fanout_type = fanoutEbpf?PACKET_FANOUT_EBPF:PACKET_FANOUT_HASH;
+                int fanout_arg = ((fanout_group_id+i) | (fanout_type << 16));
+                if(setsockopt(infos[info].fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0)
+                    LOGEXIT("Error setting packet fanout parameters: (%d,%s)", fanout_group_id, strerror(errno));
+            }
+
+            // With ebpf fanout this is interfaces * packetThreads producers, the packet queues are sized from it
+            moloch_packet_add_producers(numThreads);
+
+            if (fanoutEbpf && r == 0) {
+                if (setsockopt(infos[info].fd, SOL_PACKET, PACKET_FANOUT_DATA, &progFd, sizeof(progFd)) < 0)
+                    LOGEXIT("Error setting packet fanout ebpf program: %s", strerror(errno));
+            }
         }
     }
 
@@ -286,6 +758,9 @@ void reader_tpacketv3_init(char *UNUSED(name))
         LOGEXIT("Only support up to %d interfaces", MAX_INTERFACES);
     }
 
+    if (progFd != -1)
+        close(progFd);
+
     moloch_reader_start         = reader_tpacketv3_start;
     moloch_reader_exit          = reader_tpacketv3_exit;
     moloch_reader_stats         = reader_tpacketv3_stats;
@@ -19,12 +19,14 @@
 #include "moloch.h"
 
 extern MolochConfig_t        config;
+extern void                 *esServer;
 
 LOCAL  MolochStringHashStd_t readersHash;
 
 void reader_libpcapfile_init(char*);
 void reader_libpcap_init(char*);
 void reader_tpacketv3_init(char*);
+void reader_afxdp_init(char*);
 void reader_null_init(char*);
 void reader_pcapoverip_init(char*);
 
@@ -36,8 +38,119 @@ MolochReaderExit   moloch_reader_exit;
 char              *readerFileName[256];
 MolochFieldOps_t   readerFieldOps[256];
 uint32_t           readerOutputIds[256];
+int                readerDlt[256];
 
 
+/******************************************************************************/
+/* Credit based flow control for readers that can outrun the rest of capture,
+ * like the offline reader.  Instead of polling, a blocked reader either sleeps
+ * in moloch_reader_flow_wait or registers a main thread callback with
+ * moloch_reader_flow_resume.  The packet threads, writer and http.c call
+ * moloch_reader_flow_signal as they drain so the reader resumes right away.
+ */
+LOCAL int                    flowPacketCredits;
+LOCAL uint32_t               flowWriterCredits;
+LOCAL int                    flowESCredits;
+LOCAL int                    flowWaiting;
+LOCAL GSourceFunc            flowResumeCb;
+LOCAL MOLOCH_LOCK_DEFINE(flow);
+LOCAL MOLOCH_COND_DEFINE(flow);
+
+/******************************************************************************/
+LOCAL gboolean moloch_reader_flow_check(gboolean debug)
+{
+    int outstanding = moloch_packet_outstanding();
+    if (outstanding > flowPacketCredits) {
+        if (debug)
+            LOG("Waiting to process more packets, packet q: %d", outstanding);
+        return TRUE;
+    }
+
+    uint32_t writerQ = moloch_writer_queue_length();
+    if (writerQ > flowWriterCredits) {
+        if (debug)
+            LOG("Waiting to process more packets, write q: %u", writerQ);
+        return TRUE;
+    }
+
+    int esQ = moloch_http_queue_length(esServer);
+    if (esQ > flowESCredits) {
+        if (debug)
+            LOG("Waiting to process more packets, es q: %d", esQ);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+/******************************************************************************/
+gboolean moloch_reader_flow_blocked()
+{
+    static time_t lastLog;
+    gboolean      debug = FALSE;
+
+    // Called for every dispatch, only say why we are waiting once a second
+    if (config.debug) {
+        time_t now = time(NULL);
+        if (now != lastLog) {
+            lastLog = now;
+            debug = TRUE;
+        }
+    }
+    return moloch_reader_flow_check(debug);
+}
+/******************************************************************************/
+/* Block the calling reader thread until there are credits again */
+void moloch_reader_flow_wait()
+{
+    MOLOCH_LOCK(flow);
+    // Full barrier, pairs with the one in moloch_reader_flow_signal
+    __sync_add_and_fetch(&flowWaiting, 1);
+    while (!config.quitting && moloch_reader_flow_check(FALSE)) {
+        // Timed only so quitting is noticed
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        MOLOCH_COND_TIMEDWAIT(flow, ts);
+    }
+    __sync_sub_and_fetch(&flowWaiting, 1);
+    MOLOCH_UNLOCK(flow);
+}
+/******************************************************************************/
+/* Main thread readers, func is added as an idle source once there are credits */
+void moloch_reader_flow_resume(GSourceFunc func)
+{
+    MOLOCH_LOCK(flow);
+    __sync_add_and_fetch(&flowWaiting, 1);
+    if (!moloch_reader_flow_check(FALSE)) {
+        __sync_sub_and_fetch(&flowWaiting, 1);
+        g_idle_add(func, NULL);
+    } else {
+        flowResumeCb = func;
+    }
+    MOLOCH_UNLOCK(flow);
+}
+/******************************************************************************/
+/* Callers should have already made their drain visible.  A waiter bumps
+ * flowWaiting before checking the queues and we read it after the barrier,
+ * so either we see the waiter or the waiter sees the drained queue.
+ */
+void moloch_reader_flow_signal()
+{
+    __sync_synchronize();
+    if (likely(!flowWaiting))
+        return;
+
+    MOLOCH_LOCK(flow);
+    if (flowWaiting && !moloch_reader_flow_check(FALSE)) {
+        if (flowResumeCb) {
+            g_idle_add(flowResumeCb, NULL);
+            flowResumeCb = NULL;
+            __sync_sub_and_fetch(&flowWaiting, 1);
+        }
+        MOLOCH_COND_BROADCAST(flow);
+    }
+    MOLOCH_UNLOCK(flow);
+}
 /******************************************************************************/
 void moloch_readers_set(char *name) {
     MolochString_t *str;
@@ -60,10 +173,17 @@ void moloch_readers_add(char *name, MolochReaderInit func) {
 void moloch_readers_init()
 {
     HASH_INIT(s_, readersHash, moloch_string_hash, moloch_string_cmp);
+
+    // Flow control limits scale with the number of packet threads draining
+    flowPacketCredits = 2048 * config.packetThreads;
+    flowWriterCredits = MAX(10, 2 * config.packetThreads);
+    flowESCredits     = MAX(40, 10 * config.packetThreads);
+
     moloch_readers_add("libpcap-file", reader_libpcapfile_init);
     moloch_readers_add("libpcap", reader_libpcap_init);
     moloch_readers_add("tpacketv3", reader_tpacketv3_init);
     moloch_readers_add("afpacketv3", reader_tpacketv3_init);
+    moloch_readers_add("afxdp", reader_afxdp_init);
     moloch_readers_add("null", reader_null_init);
     moloch_readers_add("pcapoveripclient", reader_pcapoverip_init);
     moloch_readers_add("pcap-over-ip-client", reader_pcapoverip_init);
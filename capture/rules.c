@@ -51,6 +51,9 @@ typedef struct {
     GPtrArray *values;
 } YamlNode_t;
 
+// How many different link types bpf rules can be compiled for
+#define MOLOCH_RULES_MAX_DLTS 8
+
 #define MOLOCH_SAVE_FLAG_MIDDLE 0x01
 #define MOLOCH_SAVE_FLAG_FINAL  0x02
 #define MOLOCH_SAVE_FLAG_BOTH   0x03
@@ -59,7 +62,7 @@ typedef struct {
     char                *filename;
     char                *name;
     char                *bpf;                      // String version of bpf
-    struct bpf_program   bpfp;
+    struct bpf_program   bpfp[MOLOCH_RULES_MAX_DLTS]; // Compiled for each of ruleDlts
     GHashTable          *hash[MOLOCH_FIELDS_MAX];  // For each non ip field in rule
     GPtrArray           *match[MOLOCH_FIELDS_MAX]; // For any string fields with , modifier
     patricia_tree_t     *tree4[MOLOCH_FIELDS_MAX];
@@ -97,8 +100,13 @@ LOCAL MolochRulesInfo_t    current;
 LOCAL MolochRulesInfo_t    loading;
 LOCAL char               **rulesFiles;
 
-LOCAL pcap_t              *deadPcap;
 extern MolochPcapFileHdr_t pcapFileHeader;
+extern int                 readerDlt[256];
+
+// The first is always pcapFileHeader.dlt, the rest are added by readers
+LOCAL int                  ruleDlts[MOLOCH_RULES_MAX_DLTS];
+LOCAL int                  numRuleDlts;
+LOCAL MOLOCH_LOCK_DEFINE(ruleDlts);
 
 #define MOLOCH_RULES_STR_MATCH_HEAD      1
 #define MOLOCH_RULES_STR_MATCH_TAIL      2
@@ -713,31 +721,82 @@ void moloch_rules_load(char **names)
     moloch_free_later(freeing, (GDestroyNotify) moloch_rules_free);
 }
 /******************************************************************************/
-/* Called at the start on main thread or each time a new file is open on single thread */
-void moloch_rules_recompile()
+LOCAL void moloch_rules_compile_dlt(int d)
 {
     int t, r;
 
-    if (deadPcap)
-        pcap_close(deadPcap);
-
-    deadPcap = pcap_open_dead(pcapFileHeader.dlt, pcapFileHeader.snaplen);
+    pcap_t *deadPcap = pcap_open_dead(ruleDlts[d], pcapFileHeader.snaplen);
     MolochRule_t *rule;
     for (t = 0; t < MOLOCH_RULE_TYPE_NUM; t++) {
         for (r = 0; (rule = current.rules[t][r]); r++) {
             if (!rule->bpf)
                 continue;
 
-            pcap_freecode(&rule->bpfp);
-            if (pcapFileHeader.dlt != DLT_NFLOG) {
-                if (pcap_compile(deadPcap, &rule->bpfp, rule->bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
+            pcap_freecode(&rule->bpfp[d]);
+            if (ruleDlts[d] != DLT_NFLOG) {
+                if (pcap_compile(deadPcap, &rule->bpfp[d], rule->bpf, 1, PCAP_NETMASK_UNKNOWN) == -1) {
                     LOGEXIT("ERROR - Couldn't compile filter %s: '%s' with %s", rule->filename, rule->bpf, pcap_geterr(deadPcap));
                 }
             } else {
-                rule->bpfp.bf_len = 0;
+                rule->bpfp[d].bf_len = 0;
             }
         }
     }
+    pcap_close(deadPcap);
+}
+/******************************************************************************/
+/* Called at the start on main thread or each time a new file is open on single thread */
+void moloch_rules_recompile()
+{
+    int d;
+
+    MOLOCH_LOCK(ruleDlts);
+    ruleDlts[0] = pcapFileHeader.dlt;
+    if (numRuleDlts == 0)
+        numRuleDlts = 1;
+
+    for (d = 0; d < numRuleDlts; d++) {
+        moloch_rules_compile_dlt(d);
+    }
+    MOLOCH_UNLOCK(ruleDlts);
+}
+/******************************************************************************/
+/* Compile the bpf rules for another link type, packet threads only look at
+ * the new programs once numRuleDlts includes them.
+ */
+void moloch_rules_add_dlt(int dlt)
+{
+    int d;
+
+    MOLOCH_LOCK(ruleDlts);
+    for (d = 0; d < numRuleDlts; d++) {
+        if (ruleDlts[d] == dlt) {
+            MOLOCH_UNLOCK(ruleDlts);
+            return;
+        }
+    }
+
+    if (numRuleDlts == MOLOCH_RULES_MAX_DLTS) {
+        LOG("WARNING - Too many link types, bpf rules won't match link type %d", dlt);
+    } else {
+        ruleDlts[numRuleDlts] = dlt;
+        moloch_rules_compile_dlt(numRuleDlts);
+        __sync_synchronize();
+        numRuleDlts++;
+    }
+    MOLOCH_UNLOCK(ruleDlts);
+}
+/******************************************************************************/
+LOCAL int moloch_rules_dlt_index(const MolochPacket_t * const packet)
+{
+    int d;
+    const int dlt = readerDlt[packet->readerPos];
+
+    for (d = 0; d < numRuleDlts; d++) {
+        if (ruleDlts[d] == dlt)
+            return d;
+    }
+    return -1;
 }
 /******************************************************************************/
 LOCAL gboolean moloch_rules_check_ip(const MolochRule_t * const rule, const int p, const struct in6_addr *ip, BSB *logStr)
@@ -1203,11 +1262,18 @@ void moloch_rules_run_field_set(MolochSession_t *session, int pos, const gpointe
 void moloch_rules_run_session_setup(MolochSession_t *session, MolochPacket_t *packet)
 {
     int r;
+    int d = -2;
     MolochRule_t *rule;
     for (r = 0; (rule = current.rules[MOLOCH_RULE_TYPE_SESSION_SETUP][r]); r++) {
         if (rule->fieldsLen) {
             moloch_rules_check_rule_fields(session, rule, -1, NULL);
-        } else if (rule->bpfp.bf_len && bpf_filter(rule->bpfp.bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
+            continue;
+        }
+
+        if (d == -2)
+            d = moloch_rules_dlt_index(packet);
+
+        if (d >= 0 && rule->bpfp[d].bf_len && bpf_filter(rule->bpfp[d].bf_insns, packet->pkt, packet->pktlen, packet->pktlen)) {
             moloch_rules_match(session, rule);
         }
     }
@@ -30,12 +30,52 @@ LOCAL int                   protocolField;
 extern uint32_t             hashSalt;
 
 LOCAL MolochSessionHead_t   closingQ[MOLOCH_MAX_PACKET_THREADS];
-MolochSessionHead_t         tcpWriteQ[MOLOCH_MAX_PACKET_THREADS];
 
-typedef HASHP_VAR(h_, MolochSessionHash_t, MolochSessionHead_t);
+/* Bytes of sessions, field values and queued tcp data owned by each packet
+ * thread, only that thread updates it.  When memory use first goes over
+ * memEvictPercentage the stats thread fixes a budget for each thread, the
+ * packet thread saves sessions once over it until a twentieth under it.
+ */
+int64_t                     sessionMemory[MOLOCH_MAX_PACKET_THREADS];
+LOCAL volatile int64_t      sessionMemoryBudget[MOLOCH_MAX_PACKET_THREADS];
+LOCAL char                  sessionMemoryEvicting[MOLOCH_MAX_PACKET_THREADS];
+LOCAL uint64_t              sessionMemoryEvicted;
+
+#define MOLOCH_SESSION_MEMORY(maxFields) (sizeof(MolochSession_t) + sizeof(MolochSessionCold_t) + sizeof(MolochField_t *) * (maxFields))
+
+void moloch_session_save(MolochSession_t *session);
+
+/* Open addressing session table.  Each group is one cache line, 7 session
+ * pointers and a tag byte per slot, so a lookup normally reads one group and
+ * then the matching session.  Tags are matched 8 at a time in a uint64_t.
+ */
+#define MOLOCH_SESSION_GROUP_SLOTS 7
+#define MOLOCH_SESSION_MIN_GROUPS  64
+#define MOLOCH_SESSION_MIGRATE     2   // Old groups moved per add/remove while resizing
+
+#define MOLOCH_SESSION_TAG_EMPTY   0x00
+#define MOLOCH_SESSION_TAG_DELETED 0x01
+#define MOLOCH_SESSION_TAG(hash)   (0x80 | ((hash) >> 25))
+
+typedef struct {
+    uint8_t                tags[8]; // Last one is never used
+    MolochSession_t       *slots[MOLOCH_SESSION_GROUP_SLOTS];
+} __attribute__((aligned(64))) MolochSessionGroup_t;
+
+typedef struct {
+    MolochSessionGroup_t  *groups;
+    uint32_t               mask;       // Number of groups - 1
+    uint32_t               used;       // Full and deleted slots
+    uint32_t               count;
+
+    // While resizing, sessions not moved yet are still found in old
+    MolochSessionGroup_t  *oldGroups;
+    uint32_t               oldMask;
+    uint32_t               migrated;
+} MolochSessionTable_t;
 
 LOCAL MolochSessionHead_t   sessionsQ[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
-LOCAL MolochSessionHash_t   sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
+LOCAL MolochSessionTable_t  sessions[MOLOCH_MAX_PACKET_THREADS][SESSION_MAX];
 LOCAL int needSave[MOLOCH_MAX_PACKET_THREADS];
 
 typedef struct molochsescmd {
@@ -160,10 +200,238 @@ uint32_t moloch_session_hash(const void *key)
 }
 #endif
 
+/******************************************************************************/
+/* ip4 and ip6 ids are compared a uint64_t at a time, the last load overlaps
+ * the one before it so nothing past the id is read.
+ */
+LOCAL inline uint64_t moloch_session_load64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
 /******************************************************************************/
 LOCAL int moloch_session_cmp(const void *keyv, const MolochSession_t *session)
 {
-    return memcmp(keyv, session->sessionId, MIN(((uint8_t *)keyv)[0], session->sessionId[0])) == 0;
+    const uint8_t *key = keyv;
+    const uint8_t *id = session->sessionId;
+
+    switch (key[0]) {
+    case 13:
+        return ((moloch_session_load64(key) ^ moloch_session_load64(id)) |
+                (moloch_session_load64(key + 5) ^ moloch_session_load64(id + 5))) == 0;
+    case 37:
+        return ((moloch_session_load64(key) ^ moloch_session_load64(id)) |
+                (moloch_session_load64(key + 8) ^ moloch_session_load64(id + 8)) |
+                (moloch_session_load64(key + 16) ^ moloch_session_load64(id + 16)) |
+                (moloch_session_load64(key + 24) ^ moloch_session_load64(id + 24)) |
+                (moloch_session_load64(key + 29) ^ moloch_session_load64(id + 29))) == 0;
+    default:
+        return memcmp(key, id, MIN(key[0], id[0])) == 0;
+    }
+}
+/******************************************************************************/
+/* Returns the high bit of each of the 7 slot bytes that equal tag
+ */
+LOCAL inline uint64_t moloch_session_group_match(const MolochSessionGroup_t *group, uint8_t tag)
+{
+    uint64_t w;
+    memcpy(&w, group->tags, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    w ^= 0x0101010101010101ULL * tag;
+    return ~(((w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | w | 0x7f7f7f7f7f7f7f7fULL) & 0x0080808080808080ULL;
+}
+/******************************************************************************/
+// Empty or deleted slots
+LOCAL inline uint64_t moloch_session_group_free(const MolochSessionGroup_t *group)
+{
+    uint64_t w;
+    memcpy(&w, group->tags, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return ~w & 0x0080808080808080ULL;
+}
+/******************************************************************************/
+// The low hash bits pick the packet thread so mix before using the high bits
+LOCAL inline uint32_t moloch_session_group_pos(uint32_t hash, uint32_t mask)
+{
+    return ((uint64_t)(uint32_t)(hash * 0x9e3779b1) * (mask + 1)) >> 32;
+}
+/******************************************************************************/
+LOCAL MolochSession_t *moloch_session_groups_find(MolochSessionGroup_t *groups, uint32_t mask, uint32_t hash, const uint8_t *sessionId)
+{
+    const uint8_t tag = MOLOCH_SESSION_TAG(hash);
+    uint32_t      pos = moloch_session_group_pos(hash, mask);
+    uint32_t      probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        MolochSessionGroup_t *group = &groups[pos];
+        uint64_t              m;
+
+        for (m = moloch_session_group_match(group, tag); m; m &= m - 1) {
+            MolochSession_t *session = group->slots[__builtin_ctzll(m) >> 3];
+            if (session->h_hash == hash && moloch_session_cmp(sessionId, session))
+                return session;
+        }
+        if (moloch_session_group_match(group, MOLOCH_SESSION_TAG_EMPTY))
+            return NULL;
+        pos = (pos + 1) & mask;
+    }
+    return NULL;
+}
+/******************************************************************************/
+// Returns if an empty slot was used, reused deleted slots don't change used
+LOCAL int moloch_session_groups_add(MolochSessionGroup_t *groups, uint32_t mask, MolochSession_t *session)
+{
+    uint32_t pos = moloch_session_group_pos(session->h_hash, mask);
+
+    while (1) {
+        MolochSessionGroup_t *group = &groups[pos];
+        uint64_t              m = moloch_session_group_free(group);
+
+        if (m) {
+            int i = __builtin_ctzll(m) >> 3;
+            int wasEmpty = group->tags[i] == MOLOCH_SESSION_TAG_EMPTY;
+            group->tags[i] = MOLOCH_SESSION_TAG(session->h_hash);
+            group->slots[i] = session;
+            return wasEmpty;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+/******************************************************************************/
+/* Returns -1 if not found, otherwise 1 if the slot went back to empty.  A
+ * slot can only be emptied if its group has an empty slot, since then no
+ * probe ever went past it.
+ */
+LOCAL int moloch_session_groups_remove(MolochSessionGroup_t *groups, uint32_t mask, MolochSession_t *session)
+{
+    const uint8_t tag = MOLOCH_SESSION_TAG(session->h_hash);
+    uint32_t      pos = moloch_session_group_pos(session->h_hash, mask);
+    uint32_t      probes;
+
+    for (probes = 0; probes <= mask; probes++) {
+        MolochSessionGroup_t *group = &groups[pos];
+        uint64_t              m;
+
+        for (m = moloch_session_group_match(group, tag); m; m &= m - 1) {
+            int i = __builtin_ctzll(m) >> 3;
+            if (group->slots[i] != session)
+                continue;
+            group->slots[i] = NULL;
+            if (moloch_session_group_match(group, MOLOCH_SESSION_TAG_EMPTY)) {
+                group->tags[i] = MOLOCH_SESSION_TAG_EMPTY;
+                return 1;
+            }
+            group->tags[i] = MOLOCH_SESSION_TAG_DELETED;
+            return 0;
+        }
+        if (moloch_session_group_match(group, MOLOCH_SESSION_TAG_EMPTY))
+            return -1;
+        pos = (pos + 1) & mask;
+    }
+    return -1;
+}
+/******************************************************************************/
+LOCAL MolochSessionGroup_t *moloch_session_groups_alloc(uint32_t num)
+{
+    void *groups;
+    if (posix_memalign(&groups, 64, num * sizeof(MolochSessionGroup_t)))
+        LOGEXIT("ERROR - Couldn't allocate %u session groups", num);
+    memset(groups, 0, num * sizeof(MolochSessionGroup_t));
+    return groups;
+}
+/******************************************************************************/
+/* Move up to num groups from the old groups, the moved groups are marked
+ * deleted so probes for sessions not moved yet still go past them.
+ */
+LOCAL void moloch_session_table_migrate(MolochSessionTable_t *table, uint32_t num)
+{
+    while (num > 0 && table->oldGroups) {
+        MolochSessionGroup_t *group = &table->oldGroups[table->migrated];
+        int i;
+
+        for (i = 0; i < MOLOCH_SESSION_GROUP_SLOTS; i++) {
+            if (group->tags[i] & 0x80)
+                table->used += moloch_session_groups_add(table->groups, table->mask, group->slots[i]);
+            group->tags[i] = MOLOCH_SESSION_TAG_DELETED;
+        }
+
+        num--;
+        table->migrated++;
+        if (table->migrated > table->oldMask) {
+            free(table->oldGroups);
+            table->oldGroups = NULL;
+        }
+    }
+}
+/******************************************************************************/
+LOCAL void moloch_session_table_resize(MolochSessionTable_t *table, uint32_t num)
+{
+    // Only one resize at a time
+    moloch_session_table_migrate(table, 0xffffffff);
+
+    table->oldGroups = table->groups;
+    table->oldMask = table->mask;
+    table->migrated = 0;
+
+    table->groups = moloch_session_groups_alloc(num);
+    table->mask = num - 1;
+    table->used = 0;
+}
+/******************************************************************************/
+LOCAL MolochSession_t *moloch_session_table_find(MolochSessionTable_t *table, uint32_t hash, const uint8_t *sessionId)
+{
+    MolochSession_t *session = moloch_session_groups_find(table->groups, table->mask, hash, sessionId);
+
+    if (!session && unlikely(table->oldGroups))
+        session = moloch_session_groups_find(table->oldGroups, table->oldMask, hash, sessionId);
+    return session;
+}
+/******************************************************************************/
+/* Grow when 7/8 of the slots are used, which may just be cleaning out deleted
+ * slots if not many are full.
+ */
+LOCAL void moloch_session_table_add(MolochSessionTable_t *table, MolochSession_t *session)
+{
+    if (unlikely(table->oldGroups))
+        moloch_session_table_migrate(table, MOLOCH_SESSION_MIGRATE);
+
+    table->used += moloch_session_groups_add(table->groups, table->mask, session);
+    table->count++;
+    session->inHash = 1;
+
+    uint32_t slots = (table->mask + 1) * MOLOCH_SESSION_GROUP_SLOTS;
+    if (table->used > slots / 8 * 7) {
+        uint32_t num = table->mask + 1;
+        if (table->count > slots / 2)
+            num *= 2;
+        moloch_session_table_resize(table, num);
+    }
+}
+/******************************************************************************/
+// Shrink when less then 1/8 full so memory follows the number of sessions
+LOCAL void moloch_session_table_remove(MolochSessionTable_t *table, MolochSession_t *session)
+{
+    int rc = moloch_session_groups_remove(table->groups, table->mask, session);
+
+    if (rc == -1 && table->oldGroups)
+        moloch_session_groups_remove(table->oldGroups, table->oldMask, session);
+    else if (rc == 1)
+        table->used--;
+
+    table->count--;
+    session->inHash = 0;
+
+    if (unlikely(table->oldGroups)) {
+        moloch_session_table_migrate(table, MOLOCH_SESSION_MIGRATE);
+    } else if (table->mask + 1 > MOLOCH_SESSION_MIN_GROUPS &&
+               table->count < (table->mask + 1) * MOLOCH_SESSION_GROUP_SLOTS / 8) {
+        moloch_session_table_resize(table, (table->mask + 1) / 2);
+    }
 }
 /******************************************************************************/
 void moloch_session_add_cmd(MolochSession_t *session, MolochSesCmd sesCmd, gpointer uw1, gpointer uw2, MolochCmd_func func)
@@ -217,6 +485,45 @@ void moloch_session_add_tag(MolochSession_t *session, const char *tag) {
     moloch_field_string_add(config.tagsStringField, session, tag, -1, TRUE);
 }
 /******************************************************************************/
+/* The idle timer isn't moved on every packet, when it fires it checks the
+ * real deadline and only saves the session if it has passed.
+ */
+LOCAL void moloch_session_idle_cb(MolochTimer_t *timer, int thread)
+{
+    MolochSession_t *session = (MolochSession_t *)((char *)timer - offsetof(MolochSession_t, idleTimer));
+    uint32_t         expire;
+
+    if (session->closingQ)
+        expire = session->saveTime + 1;
+    else
+        expire = session->lastPacket.tv_sec + config.timeouts[session->ses] + 1;
+
+    if (expire > (uint64_t)lastPacketSecs[thread]) {
+        moloch_timer_add(thread, timer, expire, moloch_session_idle_cb);
+        return;
+    }
+
+    moloch_session_save(session);
+}
+/******************************************************************************/
+LOCAL void moloch_session_save_cb(MolochTimer_t *timer, int thread)
+{
+    MolochSession_t *session = (MolochSession_t *)((char *)timer - offsetof(MolochSession_t, saveTimer));
+
+    moloch_session_mid_save(session, lastPacketSecs[thread]);
+}
+/******************************************************************************/
+/* Sessions that can stay open a long time get saved every tcpSaveTimeout,
+ * the timer re arms itself from moloch_session_mid_save.
+ */
+void moloch_session_long_open(MolochSession_t *session)
+{
+    if (session->saveTimer.tm_next || session->closingQ)
+        return;
+
+    moloch_timer_add(session->thread, &session->saveTimer, session->saveTime + 1, moloch_session_save_cb);
+}
+/******************************************************************************/
 void moloch_session_mark_for_close (MolochSession_t *session, SessionTypes ses)
 {
     if (session->closingQ)
@@ -227,31 +534,28 @@ void moloch_session_mark_for_close (MolochSession_t *session, SessionTypes ses)
     DLL_REMOVE(q_, &sessionsQ[session->thread][ses], session);
     DLL_PUSH_TAIL(q_, &closingQ[session->thread], session);
 
-    if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
-    }
+    moloch_timer_remove(session->thread, &session->saveTimer);
+    moloch_timer_add(session->thread, &session->idleTimer, session->saveTime + 1, moloch_session_idle_cb);
 }
 /******************************************************************************/
 LOCAL void moloch_session_free (MolochSession_t *session)
 {
-    if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
-    }
+    moloch_timer_remove(session->thread, &session->idleTimer);
+    moloch_timer_remove(session->thread, &session->saveTimer);
 
-    g_array_free(session->filePosArray, TRUE);
+    moloch_filepos_free(&session->filePos);
     if (config.enablePacketLen) {
         g_array_free(session->fileLenArray, TRUE);
     }
     g_array_free(session->fileNumArray, TRUE);
 
-    if (session->rootId && session->rootId != (void *)1L)
-        g_free(session->rootId);
+    if (session->cold->rootId && session->cold->rootId != (void *)1L)
+        g_free(session->cold->rootId);
 
     if (session->parserInfo) {
         int i;
         for (i = 0; i < session->parserNum; i++) {
-            if (session->parserInfo[i].parserFreeFunc)
-                session->parserInfo[i].parserFreeFunc(session, session->parserInfo[i].uw);
+            moloch_parsers_free_info(session, &session->parserInfo[i]);
         }
         free(session->parserInfo);
     }
@@ -266,13 +570,15 @@ LOCAL void moloch_session_free (MolochSession_t *session)
     if (session->pq)
         moloch_pq_free(session);
 
+    sessionMemory[session->thread] -= MOLOCH_SESSION_MEMORY(session->maxFields);
+    MOLOCH_TYPE_FREE(MolochSessionCold_t, session->cold);
     MOLOCH_TYPE_FREE(MolochSession_t, session);
 }
 /******************************************************************************/
 void moloch_session_save(MolochSession_t *session)
 {
-    if (session->h_next) {
-        HASH_REMOVE(h_, sessions[session->thread][session->ses], session);
+    if (session->inHash) {
+        moloch_session_table_remove(&sessions[session->thread][session->ses], session);
     }
 
     if (session->closingQ) {
@@ -294,11 +600,10 @@ void moloch_session_save(MolochSession_t *session)
     if (pluginsCbs & MOLOCH_PLUGIN_PRE_SAVE)
         moloch_plugins_cb_pre_save(session, TRUE);
 
-    if (session->tcp_next) {
-        DLL_REMOVE(tcp_, &tcpWriteQ[session->thread], session);
-    }
+    moloch_timer_remove(session->thread, &session->idleTimer);
+    moloch_timer_remove(session->thread, &session->saveTimer);
 
-    if (session->outstandingQueries > 0) {
+    if (session->cold->outstandingQueries > 0) {
         session->needSave = 1;
         needSave[session->thread]++;
         return;
@@ -322,26 +627,26 @@ void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
     if (pluginsCbs & MOLOCH_PLUGIN_PRE_SAVE)
         moloch_plugins_cb_pre_save(session, FALSE);
 
-    if (!session->rootId) {
-        session->rootId = (void *)1L;
+    if (!session->cold->rootId) {
+        session->cold->rootId = (void *)1L;
     }
 
     moloch_rules_run_before_save(session, 0);
     moloch_db_save_session(session, FALSE);
-    g_array_set_size(session->filePosArray, 0);
+    moloch_filepos_free(&session->filePos);
     if (config.enablePacketLen) {
         g_array_set_size(session->fileLenArray, 0);
     }
     g_array_set_size(session->fileNumArray, 0);
     session->lastFileNum = 0;
 
-    if (session->tcp_next) {
-        DLL_MOVE_TAIL(tcp_, &tcpWriteQ[session->thread], session);
-    }
-
     // Don't change change saveTime if already closing
     if (!session->closingQ) {
         session->saveTime = tv_sec + config.tcpSaveTimeout;
+
+        // A set cb means this is a long open session, see moloch_session_long_open
+        if (session->saveTimer.cb)
+            moloch_timer_add(session->thread, &session->saveTimer, session->saveTime + 1, moloch_session_save_cb);
     }
 
     session->bytes[0] = 0;
@@ -358,8 +663,8 @@ void moloch_session_mid_save(MolochSession_t *session, uint32_t tv_sec)
 /******************************************************************************/
 gboolean moloch_session_decr_outstanding(MolochSession_t *session)
 {
-    session->outstandingQueries--;
-    if (session->needSave && session->outstandingQueries == 0) {
+    session->cold->outstandingQueries--;
+    if (session->needSave && session->cold->outstandingQueries == 0) {
         needSave[session->thread]--;
         session->needSave = 0; /* Stop endless loop if plugins add tags */
 
@@ -409,14 +714,44 @@ MolochSession_t *moloch_session_find(int ses, uint8_t *sessionId)
     MolochSession_t *session;
 
     uint32_t hash = moloch_session_hash(sessionId);
-    int      thread = hash % config.packetThreads;
+    int      threads[MOLOCH_MAX_NUMA_NODES];
+    int      cnt = moloch_packet_hash_threads(hash, threads);
+    int      i;
+
+    for (i = 0; i < cnt; i++) {
+        session = moloch_session_table_find(&sessions[threads[i]][ses], hash, sessionId);
+        if (session)
+            return session;
+    }
+    return NULL;
+}
+/******************************************************************************/
+/* The packet thread calls these for a batch of packets before processing them,
+ * first for all the groups and then for the first tag match in each group, so
+ * the cache misses overlap instead of happening one at a time in find_or_create.
+ */
+void moloch_session_prefetch_bucket(int thread, int mProtocol, uint32_t hash)
+{
+    MolochSessionTable_t *table = &sessions[thread][mProtocols[mProtocol].ses];
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
-    return session;
+    __builtin_prefetch(&table->groups[moloch_session_group_pos(hash, table->mask)]);
+}
+/******************************************************************************/
+void moloch_session_prefetch_session(int thread, int mProtocol, uint32_t hash)
+{
+    MolochSessionTable_t *table = &sessions[thread][mProtocols[mProtocol].ses];
+    MolochSessionGroup_t *group = &table->groups[moloch_session_group_pos(hash, table->mask)];
+
+    uint64_t m = moloch_session_group_match(group, MOLOCH_SESSION_TAG(hash));
+    if (m) {
+        MolochSession_t *session = group->slots[__builtin_ctzll(m) >> 3];
+        __builtin_prefetch(session);
+        __builtin_prefetch((char *)session + 64);
+    }
 }
 /******************************************************************************/
 // Should only be used by packet, lots of side effects
-MolochSession_t *moloch_session_find_or_create(int mProtocol, uint32_t hash, uint8_t *sessionId, int *isNew)
+MolochSession_t *moloch_session_find_or_create(int thread, int mProtocol, uint32_t hash, uint8_t *sessionId, int *isNew)
 {
     MolochSession_t *session;
 
@@ -424,10 +759,9 @@ MolochSession_t *moloch_session_find_or_create(int mProtocol, uint32_t hash, uin
         hash = moloch_session_hash(sessionId);
     }
 
-    int          thread = hash % config.packetThreads;
     SessionTypes ses = mProtocols[mProtocol].ses;
 
-    HASH_FIND_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    session = moloch_session_table_find(&sessions[thread][ses], hash, sessionId);
 
     if (session) {
         if (!session->closingQ) {
@@ -439,21 +773,18 @@ MolochSession_t *moloch_session_find_or_create(int mProtocol, uint32_t hash, uin
     *isNew = 1;
 
     session = MOLOCH_TYPE_ALLOC0(MolochSession_t);
+    session->cold = MOLOCH_TYPE_ALLOC0(MolochSessionCold_t);
     session->ses = ses;
     session->mProtocol = mProtocol;
     session->stopSaving = 0xffff;
 
     memcpy(session->sessionId, sessionId, sessionId[0]);
+    session->h_hash = hash;
 
-    HASH_ADD_HASH(h_, sessions[thread][ses], hash, sessionId, session);
+    moloch_session_table_add(&sessions[thread][ses], session);
     DLL_PUSH_TAIL(q_, &sessionsQ[thread][ses], session);
+    moloch_timer_add(thread, &session->idleTimer, lastPacketSecs[thread] + config.timeouts[ses] + 1, moloch_session_idle_cb);
 
-    if (HASH_BUCKET_COUNT(h_, sessions[thread][ses], hash) > 15) {
-        char buf[100];
-        LOG("ERROR - Large number of chains: %s %u %u %d %d %d - might want to increase maxStreams see https://arkime.com/settings#maxstreams", moloch_session_id_string(sessionId, buf), hash, hash % sessions[thread][ses].size, thread, HASH_BUCKET_COUNT(h_, sessions[thread][ses], hash), sessions[thread][ses].size);
-    }
-
-    session->filePosArray = g_array_sized_new(FALSE, FALSE, sizeof(uint64_t), 100);
     if (config.enablePacketLen) {
         session->fileLenArray = g_array_sized_new(FALSE, FALSE, sizeof(uint16_t), 100);
     }
@@ -461,7 +792,7 @@ MolochSession_t *moloch_session_find_or_create(int mProtocol, uint32_t hash, uin
     session->fields = MOLOCH_SIZE_ALLOC0(fields, sizeof(MolochField_t *)*config.maxField);
     session->maxFields = config.maxField;
     session->thread = thread;
-    DLL_INIT(td_, &session->tcpData);
+    sessionMemory[thread] += MOLOCH_SESSION_MEMORY(session->maxFields);
     if (config.numPlugins > 0)
         session->pluginData = MOLOCH_SIZE_ALLOC0(pluginData, sizeof(void *)*config.numPlugins);
 
@@ -475,12 +806,96 @@ uint32_t moloch_session_monitoring()
 
     for (t = 0; t < config.packetThreads; t++) {
         for (s = 0; s < SESSION_MAX; s++) {
-            count += HASH_COUNT(h_, sessions[t][s]);
+            count += sessions[t][s].count;
         }
     }
     return count;
 }
 /******************************************************************************/
+/* Save the least recently active sessions, whatever their type, until this
+ * thread is a twentieth under its memory budget.  At most 100 per call so
+ * packets keep moving, the rest go on the next call.
+ */
+LOCAL void moloch_session_memory_evict(int thread)
+{
+    int64_t budget = sessionMemoryBudget[thread];
+    int64_t low = budget - budget / 20;
+    int     count;
+
+    if (!budget) {
+        sessionMemoryEvicting[thread] = 0;
+        return;
+    }
+
+    if (!sessionMemoryEvicting[thread]) {
+        if (sessionMemory[thread] <= budget)
+            return;
+        sessionMemoryEvicting[thread] = 1;
+    }
+
+    for (count = 0; count < 100; count++) {
+        if (sessionMemory[thread] <= low) {
+            sessionMemoryEvicting[thread] = 0;
+            return;
+        }
+
+        MolochSession_t *oldest = NULL;
+        int              ses;
+        for (ses = 0; ses < SESSION_MAX; ses++) {
+            MolochSession_t *session = DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]);
+            if (session && (!oldest || session->lastPacket.tv_sec < oldest->lastPacket.tv_sec))
+                oldest = session;
+        }
+
+        if (!oldest) {
+            sessionMemoryEvicting[thread] = 0;
+            return;
+        }
+
+        moloch_session_add_tag(oldest, "memory-evicted");
+        moloch_session_save(oldest);
+        MOLOCH_THREAD_INCR(sessionMemoryEvicted);
+    }
+}
+/******************************************************************************/
+/* Called from the stats thread with the percentage of physical memory in
+ * use.  Freed sessions don't shrink the process since the slabs are kept,
+ * so the budget is set once, a tenth under each thread's session memory
+ * when memEvictPercentage is crossed, and held until memory use drops.
+ */
+void moloch_session_memory_check(float memUse)
+{
+    static int evicting;
+    int        t;
+
+    if (config.memEvictPercentage == 100 || memUse <= config.memEvictPercentage) {
+        // Keep the budget until well under so hovering doesn't cut it again
+        if (evicting && memUse + 2 < config.memEvictPercentage) {
+            LOG("Memory use %.2f%% back under %u%%, %" PRIu64 " sessions evicted", memUse, config.memEvictPercentage, sessionMemoryEvicted);
+            evicting = 0;
+            for (t = 0; t < config.packetThreads; t++) {
+                sessionMemoryBudget[t] = 0;
+            }
+        }
+        return;
+    }
+
+    if (!evicting) {
+        evicting = 1;
+        int64_t total = 0;
+        for (t = 0; t < config.packetThreads; t++) {
+            sessionMemoryBudget[t] = MAX(sessionMemory[t] - sessionMemory[t] / 10, 1);
+            total += sessionMemoryBudget[t];
+        }
+        LOG("WARNING - Memory use %.2f%% over memEvictPercentage %u%%, saving least recently active sessions over a %" PRId64 " byte session budget", memUse, config.memEvictPercentage, total);
+    }
+
+    for (t = 0; t < config.packetThreads; t++) {
+        if (sessionMemory[t] > sessionMemoryBudget[t])
+            moloch_packet_thread_wake(t);
+    }
+}
+/******************************************************************************/
 void moloch_session_process_commands(int thread)
 {
     // Commands
@@ -503,43 +918,19 @@ void moloch_session_process_commands(int thread)
         MOLOCH_TYPE_FREE(MolochSesCmd_t, cmd);
     }
 
-    // Closing Q
-    for (count = 0; count < 10; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(q_, &closingQ[thread]);
-
-        if (session && session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_save(session);
-        } else {
-            break;
-        }
-    }
+    // Idle, closing, long open and PQ timeouts that are due
+    moloch_timer_run(thread, lastPacketSecs[thread]);
 
-    // Sessions Idle Long Time
+    // Too many sessions, drop the least recently used
     int ses;
     for (ses = 0; ses < SESSION_MAX; ses++) {
-        for (count = 0; count < 10; count++) {
-            MolochSession_t *session = DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]);
-
-            if (session && (DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams[ses] ||
-                            ((uint64_t)session->lastPacket.tv_sec + config.timeouts[ses] < (uint64_t)lastPacketSecs[thread]))) {
-
-                moloch_session_save(session);
-            } else {
-                break;
-            }
+        while (DLL_COUNT(q_, &sessionsQ[thread][ses]) > (int)config.maxStreams[ses]) {
+            moloch_session_save(DLL_PEEK_HEAD(q_, &sessionsQ[thread][ses]));
         }
     }
 
-    // TCP Sessions Open Long Time
-    for (count = 0; count < 50; count++) {
-        MolochSession_t *session = DLL_PEEK_HEAD(tcp_, &tcpWriteQ[thread]);
-
-        if (session && (uint64_t)session->saveTime < (uint64_t)lastPacketSecs[thread]) {
-            moloch_session_mid_save(session, lastPacketSecs[thread]);
-        } else {
-            break;
-        }
-    }
+    if (unlikely(sessionMemoryBudget[thread]))
+        moloch_session_memory_evict(thread);
 }
 
 /******************************************************************************/
@@ -582,23 +973,16 @@ void moloch_session_init()
         MOLOCH_FIELD_TYPE_STR_HASH,  MOLOCH_FIELD_FLAG_CNT | MOLOCH_FIELD_FLAG_LINKED_SESSIONS,
         (char *)NULL);
 
-    int primes[SESSION_MAX];
+    // Tables start small and grow/shrink with the number of sessions
     int s;
-    for (s = 0; s < SESSION_MAX; s++) {
-        primes[s] = moloch_get_next_prime(config.maxStreams[s]);
-    }
-
-    if (config.debug)
-        LOG("session hash size %d %d %d %d %d %d", primes[SESSION_ICMP], primes[SESSION_UDP], primes[SESSION_TCP], primes[SESSION_SCTP], primes[SESSION_ESP], primes[SESSION_OTHER]);
-
     int t;
     for (t = 0; t < config.packetThreads; t++) {
         for (s = 0; s < SESSION_MAX; s++) {
-            HASHP_INIT(h_, sessions[t][s], primes[s], moloch_session_hash, (HASH_CMP_FUNC)moloch_session_cmp);
+            sessions[t][s].groups = moloch_session_groups_alloc(MOLOCH_SESSION_MIN_GROUPS);
+            sessions[t][s].mask = MOLOCH_SESSION_MIN_GROUPS - 1;
             DLL_INIT(q_, &sessionsQ[t][s]);
         }
 
-        DLL_INIT(tcp_, &tcpWriteQ[t]);
         DLL_INIT(q_, &closingQ[t]);
         DLL_INIT(cmd_, &sessionCmds[t]);
         MOLOCH_LOCK_INIT(sessionCmds[t].lock);
@@ -615,9 +999,26 @@ LOCAL void moloch_session_flush_close(MolochSession_t *session, gpointer UNUSED(
     int i;
 
     for (i = 0; i < SESSION_MAX; i++) {
-        HASH_FORALL_POP_HEAD(h_, sessions[thread][i], session,
-            moloch_session_save(session);
-        );
+        MolochSessionTable_t *table = &sessions[thread][i];
+        moloch_session_table_migrate(table, 0xffffffff);
+
+        uint32_t g;
+        int      j;
+        for (g = 0; g <= table->mask; g++) {
+            MolochSessionGroup_t *group = &table->groups[g];
+            for (j = 0; j < MOLOCH_SESSION_GROUP_SLOTS; j++) {
+                if (!(group->tags[j] & 0x80))
+                    continue;
+                session = group->slots[j];
+                group->tags[j] = MOLOCH_SESSION_TAG_DELETED;
+                group->slots[j] = NULL;
+                table->count--;
+                session->inHash = 0;
+                moloch_session_save(session);
+            }
+        }
+        memset(table->groups, 0, (table->mask + 1) * sizeof(MolochSessionGroup_t));
+        table->used = 0;
     }
     moloch_pq_flush(thread);
 }
@@ -0,0 +1,168 @@
+/******************************************************************************/
+/* slab.c  -- per thread slab allocator
+ *
+ * Copyright 2021 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Each thread carves objects out of its own MOLOCH_SLAB_SIZE aligned slabs,
+ * one size class per slab, so finding the slab header of any object is a
+ * mask.  Frees by the owning thread go on its free list, frees by any other
+ * thread (packets allocated by a reader and freed by a packet thread) are
+ * pushed on the owner's remote list with a CAS, and the owner takes the
+ * whole remote list when its free list runs dry.
+ *
+ * Size classes are every 16 bytes up to 256, then 4 per power of 2 up to
+ * MOLOCH_SLAB_MAX_SIZE.  Anything bigger goes to malloc.
+ */
+
+#include "moloch.h"
+#include <sys/mman.h>
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_SLAB_SIZE     (1024 * 1024)
+#define MOLOCH_SLAB_HDR      64
+#define MOLOCH_SLAB_MAX_SIZE (128 * 1024)
+#define MOLOCH_SLAB_CLASSES  52
+
+typedef struct molochslabfree_t {
+    struct molochslabfree_t *next;
+} MolochSlabFree_t;
+
+typedef struct molochslabthread_t {
+    MolochSlabFree_t          *free[MOLOCH_SLAB_CLASSES];
+    char                      *bump[MOLOCH_SLAB_CLASSES];
+    char                      *bumpEnd[MOLOCH_SLAB_CLASSES];
+    MolochSlabFree_t *volatile remote;
+} MolochSlabThread_t;
+
+typedef struct {
+    MolochSlabThread_t        *owner;
+    int                        sizeClass;
+} MolochSlab_t;
+
+LOCAL __thread MolochSlabThread_t *slabThread;
+
+/******************************************************************************/
+LOCAL inline int moloch_slab_class(size_t size)
+{
+    if (size <= 256)
+        return size == 0 ? 0 : (size + 15) / 16 - 1;
+
+    int b = 31 - __builtin_clz(size - 1);
+    return 16 + (b - 8) * 4 + (((size - 1) >> (b - 2)) & 3);
+}
+/******************************************************************************/
+LOCAL inline size_t moloch_slab_class_size(int sizeClass)
+{
+    if (sizeClass < 16)
+        return (sizeClass + 1) * 16;
+
+    int b = 8 + (sizeClass - 16) / 4;
+    return (1 << b) + ((sizeClass - 16) % 4 + 1) * (1 << (b - 2));
+}
+/******************************************************************************/
+// mmap twice the size and trim so the slab is aligned to its size
+LOCAL char *moloch_slab_new(int sizeClass)
+{
+    char *mem = mmap(NULL, MOLOCH_SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        LOGEXIT("ERROR - Couldn't allocate slab for %d byte objects", (int)moloch_slab_class_size(sizeClass));
+
+    char *slab = (char *)(((uintptr_t)mem + MOLOCH_SLAB_SIZE - 1) & ~((uintptr_t)MOLOCH_SLAB_SIZE - 1));
+    if (slab > mem)
+        munmap(mem, slab - mem);
+    munmap(slab + MOLOCH_SLAB_SIZE, mem + MOLOCH_SLAB_SIZE * 2 - (slab + MOLOCH_SLAB_SIZE));
+
+    MolochSlab_t *hdr = (MolochSlab_t *)slab;
+    hdr->owner = slabThread;
+    hdr->sizeClass = sizeClass;
+    return slab;
+}
+/******************************************************************************/
+// Sort everything other threads gave back onto our free lists
+LOCAL void moloch_slab_take_remote()
+{
+    MolochSlabFree_t *item = __sync_lock_test_and_set(&slabThread->remote, NULL);
+    MolochSlabFree_t *next;
+
+    for (; item; item = next) {
+        next = item->next;
+        MolochSlab_t *hdr = (MolochSlab_t *)((uintptr_t)item & ~((uintptr_t)MOLOCH_SLAB_SIZE - 1));
+        item->next = slabThread->free[hdr->sizeClass];
+        slabThread->free[hdr->sizeClass] = item;
+    }
+}
+/******************************************************************************/
+void *moloch_slab_alloc(size_t size, int zero)
+{
+    if (size > MOLOCH_SLAB_MAX_SIZE)
+        return zero ? calloc(1, size) : malloc(size);
+
+    if (unlikely(!slabThread))
+        slabThread = calloc(1, sizeof(MolochSlabThread_t));
+
+    int   sizeClass = moloch_slab_class(size);
+    void *mem = slabThread->free[sizeClass];
+
+    if (unlikely(!mem) && slabThread->remote) {
+        moloch_slab_take_remote();
+        mem = slabThread->free[sizeClass];
+    }
+
+    if (likely(mem)) {
+        slabThread->free[sizeClass] = slabThread->free[sizeClass]->next;
+    } else {
+        size_t classSize = moloch_slab_class_size(sizeClass);
+
+        if (slabThread->bump[sizeClass] + classSize > slabThread->bumpEnd[sizeClass]) {
+            slabThread->bump[sizeClass] = moloch_slab_new(sizeClass) + MOLOCH_SLAB_HDR;
+            slabThread->bumpEnd[sizeClass] = slabThread->bump[sizeClass] - MOLOCH_SLAB_HDR + MOLOCH_SLAB_SIZE;
+        }
+        mem = slabThread->bump[sizeClass];
+        slabThread->bump[sizeClass] += classSize;
+    }
+
+    if (zero)
+        memset(mem, 0, size);
+    return mem;
+}
+/******************************************************************************/
+void moloch_slab_free(size_t size, void *mem)
+{
+    if (!mem)
+        return;
+
+    if (size > MOLOCH_SLAB_MAX_SIZE) {
+        free(mem);
+        return;
+    }
+
+    MolochSlab_t     *hdr = (MolochSlab_t *)((uintptr_t)mem & ~((uintptr_t)MOLOCH_SLAB_SIZE - 1));
+    MolochSlabFree_t *item = mem;
+
+    if (hdr->owner == slabThread) {
+        item->next = slabThread->free[hdr->sizeClass];
+        slabThread->free[hdr->sizeClass] = item;
+        return;
+    }
+
+    MolochSlabThread_t *owner = hdr->owner;
+    MolochSlabFree_t   *head;
+    do {
+        head = owner->remote;
+        item->next = head;
+    } while (!__sync_bool_compare_and_swap(&owner->remote, head, item));
+}
@@ -0,0 +1,193 @@
+/******************************************************************************/
+/* timer.c  -- per packet thread hierarchical timer wheel
+ *
+ * Copyright 2021 AOL Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this Software except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Time is packet seconds (lastPacketSecs) not wall clock.  Level 0 has a
+ * slot per second for the next 64 seconds, each level above has slots 64
+ * times as wide.  When level 0 wraps the next level's slot for the coming
+ * 64 seconds is cascaded down, so each tick only touches the timers due in
+ * it.  Timers already due wait on the due list for the next run.
+ *
+ * Only the packet thread that owns a wheel may use it.
+ */
+
+#include "moloch.h"
+
+extern MolochConfig_t        config;
+
+#define MOLOCH_TIMER_BITS   6
+#define MOLOCH_TIMER_SLOTS  (1 << MOLOCH_TIMER_BITS)
+#define MOLOCH_TIMER_MASK   (MOLOCH_TIMER_SLOTS - 1)
+#define MOLOCH_TIMER_LEVELS 4
+#define MOLOCH_TIMER_MAX    ((1LL << (MOLOCH_TIMER_BITS * MOLOCH_TIMER_LEVELS)) - 1)
+
+// Further then this and it is cheaper to just re add everything
+#define MOLOCH_TIMER_MAX_TICKS (MOLOCH_TIMER_SLOTS * MOLOCH_TIMER_SLOTS)
+
+#define MOLOCH_TIMER_DUE    -1
+
+typedef struct {
+    MolochTimerHead_t        slots[MOLOCH_TIMER_LEVELS][MOLOCH_TIMER_SLOTS];
+    MolochTimerHead_t        due;
+    uint32_t                 now;       // Every tick up to and including now has run
+    int                      count;
+} MolochTimerWheel_t;
+
+LOCAL MolochTimerWheel_t     wheels[MOLOCH_MAX_PACKET_THREADS];
+
+/******************************************************************************/
+LOCAL void moloch_timer_place(MolochTimerWheel_t *wheel, MolochTimer_t *timer)
+{
+    int64_t delta = (int64_t)timer->expire - wheel->now;
+
+    if (delta <= 0) {
+        timer->tm_bucket = MOLOCH_TIMER_DUE;
+        DLL_PUSH_TAIL(tm_, &wheel->due, timer);
+        return;
+    }
+
+    // Past the top level, park it where it will be looked at again later
+    if (delta > MOLOCH_TIMER_MAX)
+        delta = MOLOCH_TIMER_MAX;
+
+    uint64_t when = (uint64_t)wheel->now + delta;
+    int level = 0;
+    while (delta >= (1LL << (MOLOCH_TIMER_BITS * (level + 1))))
+        level++;
+
+    timer->tm_bucket = level * MOLOCH_TIMER_SLOTS + ((when >> (MOLOCH_TIMER_BITS * level)) & MOLOCH_TIMER_MASK);
+    DLL_PUSH_TAIL(tm_, &wheel->slots[level][timer->tm_bucket & MOLOCH_TIMER_MASK], timer);
+}
+/******************************************************************************/
+void moloch_timer_add(int thread, MolochTimer_t *timer, uint32_t expire, MolochTimer_cb cb)
+{
+    MolochTimerWheel_t *wheel = &wheels[thread];
+
+    if (timer->tm_next)
+        moloch_timer_remove(thread, timer);
+
+    timer->expire = expire;
+    timer->cb = cb;
+    wheel->count++;
+    moloch_timer_place(wheel, timer);
+}
+/******************************************************************************/
+void moloch_timer_remove(int thread, MolochTimer_t *timer)
+{
+    MolochTimerWheel_t *wheel = &wheels[thread];
+
+    if (!timer->tm_next)
+        return;
+
+    if (timer->tm_bucket == MOLOCH_TIMER_DUE)
+        DLL_REMOVE(tm_, &wheel->due, timer);
+    else
+        DLL_REMOVE(tm_, &wheel->slots[timer->tm_bucket / MOLOCH_TIMER_SLOTS][timer->tm_bucket & MOLOCH_TIMER_MASK], timer);
+    wheel->count--;
+}
+/******************************************************************************/
+LOCAL void moloch_timer_replace_list(MolochTimerWheel_t *wheel, MolochTimerHead_t *head)
+{
+    MolochTimer_t *timer;
+
+    while (DLL_POP_HEAD(tm_, head, timer)) {
+        moloch_timer_place(wheel, timer);
+    }
+}
+/******************************************************************************/
+/* Time jumped backwards or too far forward to tick through, so start the
+ * wheel over at now and put every timer back.
+ */
+LOCAL void moloch_timer_rebuild(MolochTimerWheel_t *wheel, uint32_t now)
+{
+    MolochTimerHead_t all;
+    int               l, s;
+
+    DLL_INIT(tm_, &all);
+    for (l = 0; l < MOLOCH_TIMER_LEVELS; l++) {
+        for (s = 0; s < MOLOCH_TIMER_SLOTS; s++) {
+            DLL_PUSH_TAIL_DLL(tm_, &all, &wheel->slots[l][s]);
+        }
+    }
+    wheel->now = now;
+    moloch_timer_replace_list(wheel, &all);
+}
+/******************************************************************************/
+/* Run every timer due at or before now.  Callbacks may add timers, ones
+ * already due wait for the next run so a callback can't loop forever.
+ */
+void moloch_timer_run(int thread, uint32_t now)
+{
+    MolochTimerWheel_t *wheel = &wheels[thread];
+    MolochTimer_t      *timer;
+
+    if (wheel->count == 0) {
+        wheel->now = now;
+        return;
+    }
+
+    if (now < wheel->now || now - wheel->now > MOLOCH_TIMER_MAX_TICKS) {
+        moloch_timer_rebuild(wheel, now);
+    }
+
+    while (wheel->now < now) {
+        uint32_t tick = ++wheel->now;
+        int      l;
+
+        // Cascade each level whose slot boundary we just crossed, top down
+        for (l = 1; l < MOLOCH_TIMER_LEVELS; l++) {
+            if ((tick >> (MOLOCH_TIMER_BITS * (l - 1))) & MOLOCH_TIMER_MASK)
+                break;
+        }
+        for (l = l - 1; l >= 1; l--) {
+            moloch_timer_replace_list(wheel, &wheel->slots[l][(tick >> (MOLOCH_TIMER_BITS * l)) & MOLOCH_TIMER_MASK]);
+        }
+
+        MolochTimerHead_t *slot = &wheel->slots[0][tick & MOLOCH_TIMER_MASK];
+        while (DLL_POP_HEAD(tm_, slot, timer)) {
+            timer->tm_bucket = MOLOCH_TIMER_DUE;
+            DLL_PUSH_TAIL(tm_, &wheel->due, timer);
+        }
+    }
+
+    // Callbacks may remove other due timers, so always pop from the wheel
+    int cnt = DLL_COUNT(tm_, &wheel->due);
+    while (cnt > 0 && DLL_POP_HEAD(tm_, &wheel->due, timer)) {
+        wheel->count--;
+        timer->cb(timer, thread);
+        cnt--;
+    }
+}
+/******************************************************************************/
+int moloch_timer_count(int thread)
+{
+    return wheels[thread].count;
+}
+/******************************************************************************/
+void moloch_timer_init()
+{
+    int t, l, s;
+
+    for (t = 0; t < config.packetThreads; t++) {
+        DLL_INIT(tm_, &wheels[t].due);
+        for (l = 0; l < MOLOCH_TIMER_LEVELS; l++) {
+            for (s = 0; s < MOLOCH_TIMER_SLOTS; s++) {
+                DLL_INIT(tm_, &wheels[t].slots[l][s]);
+            }
+        }
+    }
+}
@@ -55,12 +55,9 @@ LOCAL long writer_inplace_create(MolochPacket_t * const packet)
         moloch_db_file_exists(readerName, &outputId);
     } else {
         char *filename;
-        if (config.gapPacketPos)
-            filename = moloch_db_create_file_full(packet->ts.tv_sec, readerName, st.st_size, !config.noLockPcap, &outputId,
-                                                  "packetPosEncoding", "gap0",
-                                                  (char *)NULL);
-        else
-            filename = moloch_db_create_file(packet->ts.tv_sec, readerName, st.st_size, !config.noLockPcap, &outputId);
+        filename = moloch_db_create_file_full(packet->ts.tv_sec, readerName, st.st_size, !config.noLockPcap, &outputId,
+                                              "packetPosEncoding", config.gapPacketPos ? "gap0" : MOLOCH_VAR_ARG_SKIP,
+                                              (char *)NULL);
 
         g_free(filename);
     }
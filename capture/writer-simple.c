@@ -1,8 +1,8 @@
 /******************************************************************************/
 /* writer-simple.c  -- Simple Writer Plugin
  *
- * This writer just creates a file per packet thread and queues buffers
- * to be written to disk in a single output thread.
+ * This writer just creates a file per packet thread and link type and queues
+ * buffers to be written to disk in a single output thread.
  *
  * Copyright 2012-2017 AOL Inc. All rights reserved.
  *
@@ -33,6 +33,7 @@
 
 extern MolochConfig_t        config;
 extern MolochPcapFileHdr_t   pcapFileHeader;
+extern int                   readerDlt[256];
 LOCAL  gboolean              localPcapIndex;
 
 typedef struct {
@@ -64,15 +65,21 @@ LOCAL  MOLOCH_COND_DEFINE(simpleQ);
 
 enum MolochSimpleMode { MOLOCH_SIMPLE_NORMAL, MOLOCH_SIMPLE_XOR2048, MOLOCH_SIMPLE_AES256CTR};
 
-LOCAL MolochSimple_t        *currentInfo[MOLOCH_MAX_PACKET_THREADS];
+// A pcap file only has one link type, so each one in use gets its own files
+#define MOLOCH_SIMPLE_MAX_LINKS 8
+LOCAL int                    linkDlts[MOLOCH_SIMPLE_MAX_LINKS];
+LOCAL int                    numLinks;
+LOCAL MOLOCH_LOCK_DEFINE(linkDlts);
+
+LOCAL MolochSimple_t        *currentInfo[MOLOCH_MAX_PACKET_THREADS][MOLOCH_SIMPLE_MAX_LINKS];
 LOCAL MolochSimpleHead_t     freeList[MOLOCH_MAX_PACKET_THREADS];
 LOCAL uint32_t               pageSize;
 LOCAL enum MolochSimpleMode  simpleMode;
 LOCAL int                    simpleMaxQ;
 LOCAL const EVP_CIPHER      *cipher;
 LOCAL int                    openOptions;
-LOCAL struct timeval         lastSave[MOLOCH_MAX_PACKET_THREADS];
-LOCAL struct timeval         fileAge[MOLOCH_MAX_PACKET_THREADS];
+LOCAL struct timeval         lastSave[MOLOCH_MAX_PACKET_THREADS][MOLOCH_SIMPLE_MAX_LINKS];
+LOCAL struct timeval         fileAge[MOLOCH_MAX_PACKET_THREADS][MOLOCH_SIMPLE_MAX_LINKS];
 
 #define INDEX_FILES_CACHE_SIZE (MOLOCH_MAX_PACKET_THREADS-1)
 struct {
@@ -152,9 +159,35 @@ LOCAL void writer_simple_free(MolochSimple_t *info)
 }
 
 /******************************************************************************/
-LOCAL void writer_simple_process_buf(int thread, int closing)
+/* Which of the link slots to use for a dlt, adding it the first time it's seen */
+LOCAL int writer_simple_link(int dlt)
+{
+    int l;
+
+    for (l = 0; l < numLinks; l++) {
+        if (linkDlts[l] == dlt)
+            return l;
+    }
+
+    MOLOCH_LOCK(linkDlts);
+    for (l = 0; l < numLinks; l++) {
+        if (linkDlts[l] == dlt)
+            break;
+    }
+    if (l == numLinks) {
+        if (numLinks == MOLOCH_SIMPLE_MAX_LINKS)
+            LOGEXIT("ERROR - Only %d different link types can be written", MOLOCH_SIMPLE_MAX_LINKS);
+        linkDlts[l] = dlt;
+        __sync_synchronize();
+        numLinks++;
+    }
+    MOLOCH_UNLOCK(linkDlts);
+    return l;
+}
+/******************************************************************************/
+LOCAL void writer_simple_process_buf(int thread, int link, int closing)
 {
-    MolochSimple_t *info = currentInfo[thread];
+    MolochSimple_t *info = currentInfo[thread][link];
     static uint32_t lastError;
 
     info->closing = closing;
@@ -163,22 +196,22 @@ LOCAL void writer_simple_process_buf(int thread, int closing)
         int writeSize = (info->bufpos/pageSize) * pageSize;
 
         // Create next buffer
-        currentInfo[thread] = writer_simple_alloc(thread, info);
+        currentInfo[thread][link] = writer_simple_alloc(thread, info);
 
         // Copy what we aren't going to write to next buffer
-        memcpy(currentInfo[thread]->buf, info->buf + writeSize, info->bufpos - writeSize);
-        currentInfo[thread]->bufpos = info->bufpos - writeSize;
+        memcpy(currentInfo[thread][link]->buf, info->buf + writeSize, info->bufpos - writeSize);
+        currentInfo[thread][link]->bufpos = info->bufpos - writeSize;
 
         // Set what we are going to write
         info->bufpos = writeSize;
     } else {
-        currentInfo[thread] = NULL;
+        currentInfo[thread][link] = NULL;
     }
     MOLOCH_LOCK(simpleQ);
-    gettimeofday(&lastSave[thread], NULL);
+    gettimeofday(&lastSave[thread][link], NULL);
     DLL_PUSH_TAIL(simple_, &simpleQ, info);
-    if (DLL_COUNT(simple_, &simpleQ) > 100 && lastSave[thread].tv_sec > lastError + 60) {
-        lastError = lastSave[thread].tv_sec;
+    if (DLL_COUNT(simple_, &simpleQ) > 100 && lastSave[thread][link].tv_sec > lastError + 60) {
+        lastError = lastSave[thread][link].tv_sec;
         LOG("WARNING - Disk Q of %d is too large, check the Arkime FAQ about (https://arkime.com/faq#why-am-i-dropping-packets) testing disk speed", DLL_COUNT(simple_, &simpleQ));
     }
     MOLOCH_COND_SIGNAL(simpleQ);
@@ -302,8 +335,9 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
     }
 
     int thread = session->thread;
+    int link = writer_simple_link(readerDlt[packet->readerPos]);
 
-    if (!currentInfo[thread]) {
+    if (!currentInfo[thread][link]) {
         char  dekhex[1024];
         char *name = 0;
         char *kekId;
@@ -319,7 +353,7 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
         }
 
 
-        MolochSimple_t *info = currentInfo[thread] = writer_simple_alloc(thread, NULL);
+        MolochSimple_t *info = currentInfo[thread][link] = writer_simple_alloc(thread, NULL);
         switch(simpleMode) {
         case MOLOCH_SIMPLE_NORMAL:
             name = moloch_db_create_file_full(packet->ts.tv_sec, NULL, 0, 0, &info->file->id,
@@ -367,27 +401,27 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
 
         /* If offline pcap honor umask, otherwise disable other RW */
         if (config.pcapReadOffline) {
-            currentInfo[thread]->file->fd = open(name,  openOptions, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+            currentInfo[thread][link]->file->fd = open(name,  openOptions, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
         } else {
-            currentInfo[thread]->file->fd = open(name,  openOptions, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+            currentInfo[thread][link]->file->fd = open(name,  openOptions, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
         }
-        if (currentInfo[thread]->file->fd < 0) {
+        if (currentInfo[thread][link]->file->fd < 0) {
             LOGEXIT("ERROR - pcap open failed - Couldn't open file: '%s' with %s  (%d) -- You may need to check directory permissions or set pcapWriteMethod=simple-nodirect in config.ini file.  See https://arkime.com/settings#pcapwritemethod", name, strerror(errno), errno);
         }
-        info->file->pos = currentInfo[thread]->bufpos = 24;
+        info->file->pos = currentInfo[thread][link]->bufpos = 24;
 
         memcpy(info->buf, &pcapFileHeader, 20);
-        uint32_t linktype = moloch_packet_dlt_to_linktype(pcapFileHeader.dlt);
+        uint32_t linktype = moloch_packet_dlt_to_linktype(linkDlts[link]);
         memcpy(info->buf+20, &linktype, 4);
         if (config.debug)
-            LOG("opened %d %s %d", thread, name, info->file->fd);
+            LOG("opened %d %d %s %d", thread, link, name, info->file->fd);
         g_free(name);
 
-        gettimeofday(&fileAge[thread], NULL);
+        gettimeofday(&fileAge[thread][link], NULL);
     }
 
-    packet->writerFileNum = currentInfo[thread]->file->id;
-    packet->writerFilePos = currentInfo[thread]->file->pos;
+    packet->writerFileNum = currentInfo[thread][link]->file->id;
+    packet->writerFilePos = currentInfo[thread][link]->file->pos;
 
     struct moloch_pcap_sf_pkthdr hdr;
 
@@ -396,16 +430,16 @@ LOCAL void writer_simple_write(const MolochSession_t * const session, MolochPack
     hdr.caplen     = packet->pktlen;
     hdr.pktlen     = packet->pktlen;
 
-    memcpy(currentInfo[thread]->buf+currentInfo[thread]->bufpos, &hdr, 16);
-    currentInfo[thread]->bufpos += 16;
-    memcpy(currentInfo[thread]->buf+currentInfo[thread]->bufpos, packet->pkt, packet->pktlen);
-    currentInfo[thread]->bufpos += packet->pktlen;
-    currentInfo[thread]->file->pos += 16 + packet->pktlen;
+    memcpy(currentInfo[thread][link]->buf+currentInfo[thread][link]->bufpos, &hdr, 16);
+    currentInfo[thread][link]->bufpos += 16;
+    memcpy(currentInfo[thread][link]->buf+currentInfo[thread][link]->bufpos, packet->pkt, packet->pktlen);
+    currentInfo[thread][link]->bufpos += packet->pktlen;
+    currentInfo[thread][link]->file->pos += 16 + packet->pktlen;
 
-    if (currentInfo[thread]->bufpos > config.pcapWriteSize) {
-        writer_simple_process_buf(thread, 0);
-    } else if (currentInfo[thread]->file->pos >= config.maxFileSizeB) {
-        writer_simple_process_buf(thread, 1);
+    if (currentInfo[thread][link]->bufpos > config.pcapWriteSize) {
+        writer_simple_process_buf(thread, link, 0);
+    } else if (currentInfo[thread][link]->file->pos >= config.maxFileSizeB) {
+        writer_simple_process_buf(thread, link, 1);
     }
 }
 /******************************************************************************/
@@ -467,17 +501,20 @@ LOCAL void *writer_simple_thread(void *UNUSED(arg))
         }
 
         writer_simple_free(info);
+        moloch_reader_flow_signal();
     }
     return NULL;
 }
 /******************************************************************************/
 LOCAL void writer_simple_exit()
 {
-    int thread;
+    int thread, link;
 
     for (thread = 0; thread < config.packetThreads; thread++) {
-        if (currentInfo[thread]) {
-            writer_simple_process_buf(thread, 1);
+        for (link = 0; link < numLinks; link++) {
+            if (currentInfo[thread][link]) {
+                writer_simple_process_buf(thread, link, 1);
+            }
         }
     }
 
@@ -502,22 +539,26 @@ LOCAL void writer_simple_check(MolochSession_t *session, void *UNUSED(uw1), void
     struct timeval now;
     gettimeofday(&now, NULL);
 
-    // No data or not enough bytes, reset the time
-    if (!currentInfo[session->thread] || currentInfo[session->thread]->bufpos < (uint32_t)pageSize) {
-        lastSave[session->thread] = now;
-        return;
-    }
+    const int thread = session->thread;
+    int link;
+    for (link = 0; link < numLinks; link++) {
+        // No data or not enough bytes, reset the time
+        if (!currentInfo[thread][link] || currentInfo[thread][link]->bufpos < (uint32_t)pageSize) {
+            lastSave[thread][link] = now;
+            continue;
+        }
 
-    if (config.maxFileTimeM > 0 && now.tv_sec - fileAge[session->thread].tv_sec >= config.maxFileTimeM*60) {
-        writer_simple_process_buf(session->thread, 1);
-        return;
-    }
+        if (config.maxFileTimeM > 0 && now.tv_sec - fileAge[thread][link].tv_sec >= config.maxFileTimeM*60) {
+            writer_simple_process_buf(thread, link, 1);
+            continue;
+        }
 
-    // Last add must be 10 seconds ago and have more then pageSize bytes
-    if (now.tv_sec - lastSave[session->thread].tv_sec < 10)
-        return;
+        // Last add must be 10 seconds ago and have more then pageSize bytes
+        if (now.tv_sec - lastSave[thread][link].tv_sec < 10)
+            continue;
 
-    writer_simple_process_buf(session->thread, 0);
+        writer_simple_process_buf(thread, link, 0);
+    }
 }
 /******************************************************************************/
 /* Called in the main thread.  Check all the timestamps, and if out of date
@@ -530,10 +571,13 @@ LOCAL gboolean writer_simple_check_gfunc (gpointer UNUSED(user_data))
     gettimeofday(&now, NULL);
 
     MOLOCH_LOCK(simpleQ);
-    int thread;
+    int thread, link;
     for (thread = 0; thread < config.packetThreads; thread++) {
-        if (now.tv_sec - lastSave[thread].tv_sec >= 10) {
-            moloch_session_add_cmd_thread(thread, NULL, NULL, writer_simple_check);
+        for (link = 0; link < numLinks; link++) {
+            if (now.tv_sec - lastSave[thread][link].tv_sec >= 10) {
+                moloch_session_add_cmd_thread(thread, NULL, NULL, writer_simple_check);
+                break;
+            }
         }
     }
     MOLOCH_UNLOCK(simpleQ);
@@ -578,17 +622,17 @@ void writer_simple_index (MolochSession_t * session)
 
     BSB_INIT(bsb, buf, sizeof(buf));
 
-    FILE *fp = 0;
-    uint64_t last = 0;
-    uint64_t lastgap = 0;
-    for(guint i = 0; i < session->filePosArray->len; i++) {
-        int64_t packetPos = (int64_t)g_array_index(session->filePosArray, int64_t, i);
+    // The session already has the gaps, just write each as a varint
+    FILE               *fp = 0;
+    MolochFilePosIter_t iter;
+    int64_t             packetPos, gap;
+
+    moloch_filepos_iter_init(&session->filePos, &iter);
+    while (moloch_filepos_next(&iter, &packetPos, &gap)) {
         if (packetPos < 0) {
             if (fp) {
                 filePos[(files-1)*3 + 2] = BSB_LENGTH(bsb);
                 fwrite(buf, BSB_LENGTH(bsb), 1, fp);
-                last = 0;
-                lastgap = 0;
             }
             fp = writer_simple_get_index(session->thread, -packetPos);
 
@@ -598,40 +642,8 @@ void writer_simple_index (MolochSession_t * session)
 
             BSB_INIT(bsb, buf, sizeof(buf));
         } else {
-            uint64_t val = packetPos - last;
-            if (val == lastgap) {
-                val = 0;
-            } else {
-                lastgap = val;
-            }
-            last = packetPos;
-
-            if (val <= 0x7f) {
-                BSB_EXPORT_u08(bsb, 0x80 | val);
-                continue;
-            }
-            BSB_EXPORT_u08(bsb, (val & 0x7f));
-
-            if (val <= 0x3fff) {
-                BSB_EXPORT_u08(bsb, 0x80 | ((val >> 7) & 0x7f));
-                continue;
-            }
-            BSB_EXPORT_u08(bsb, ((val >> 7) & 0x7f));
-
-            if (val <= 0x1fffff) {
-                BSB_EXPORT_u08(bsb, 0x80 | ((val >> 14) & 0x7f));
-                continue;
-            }
-            BSB_EXPORT_u08(bsb, ((val >> 14) & 0x7f));
-
-            if (val <= 0x0fffffff) {
-                BSB_EXPORT_u08(bsb, 0x80 | ((val >> 21) & 0x7f));
-                continue;
-            }
-            BSB_EXPORT_u08(bsb, ((val >> 21) & 0x7f));
-
-            // Has to be last because of config.maxFileSizeB on init
-            BSB_EXPORT_u08(bsb, 0x80 | ((val >> 28) & 0x7f));
+            if (BSB_REMAINING(bsb) >= 10)
+                BSB_EXPORT_skip(bsb, moloch_filepos_varint(BSB_WORK_PTR(bsb), gap));
         }
     }
 
@@ -640,8 +652,10 @@ void writer_simple_index (MolochSession_t * session)
         fwrite(buf, BSB_LENGTH(bsb), 1, fp);
     }
 
-    g_array_set_size(session->filePosArray, 0);
-    g_array_append_vals(session->filePosArray, filePos, files*3);
+    moloch_filepos_free(&session->filePos);
+    for (int i = 0; i < files*3; i++) {
+        moloch_filepos_add(&session->filePos, filePos[i]);
+    }
 }
 /******************************************************************************/
 void writer_simple_init(char *name)
@@ -710,10 +724,12 @@ void writer_simple_init(char *name)
     struct timeval now;
     gettimeofday(&now, NULL);
 
-    int thread;
+    int thread, link;
     for (thread = 0; thread < config.packetThreads; thread++) {
-        lastSave[thread] = now;
-        fileAge[thread] = now;
+        for (link = 0; link < MOLOCH_SIMPLE_MAX_LINKS; link++) {
+            lastSave[thread][link] = now;
+            fileAge[thread][link] = now;
+        }
         DLL_INIT(simple_, &freeList[thread]);
         MOLOCH_LOCK_INIT(freeList[thread].lock);
     }
@@ -98,14 +98,25 @@ sub sortJson {
     return $json;
 }
 ################################################################################
+# Returns the .test name and the capture command for a .pcap, .pcapng or .pcap.gz file
+sub captureCmd {
+    my ($pcap) = @_;
+    $pcap = "$pcap.pcap" if ($pcap !~ /\.(pcap|pcapng|pcap\.gz)$/);
+    my ($filename) = $pcap =~ /^(.*)\.(pcap|pcapng|pcap\.gz)$/;
+
+    # libpcap can't read pcapng files with more than one link type
+    my $opts = ($pcap =~ /\.pcapng$/) ? "-o offlineMmap=true " : "";
+    return ($filename, "../capture/capture --tests -c config.test.ini -n test $opts-r $pcap 2>&1 1>/dev/null | ./tests.pl --fix");
+}
+################################################################################
 sub doTests {
     my @files = @ARGV;
-    @files = glob ("pcap/*.pcap") if ($#files == -1);
+    @files = glob ("pcap/*.pcap pcap/*.pcapng pcap/*.pcap.gz") if ($#files == -1);
 
     plan tests => scalar @files;
 
-    foreach my $filename (@files) {
-        $filename = substr($filename, 0, -5) if ($filename =~ /\.pcap$/);
+    foreach my $pcap (@files) {
+        my ($filename, $cmd) = captureCmd($pcap);
         die "Missing $filename.test" if (! -f "$filename.test");
 
         open my $fh, '<', "$filename.test" or die "error opening $filename.test: $!";
@@ -113,8 +124,6 @@ sub doTests {
         my $savedJson = sortJson(from_json($savedData, {relaxed => 1}));
 
 
-        my $cmd = "../capture/capture --tests -c config.test.ini -n test -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix";
-
         if ($main::valgrind) {
             $cmd = "G_SLICE=always-malloc valgrind --leak-check=full --log-file=$filename.val " . $cmd;
         }
@@ -223,12 +232,12 @@ my ($json) = @_;
 
 ################################################################################
 sub doMake {
-    foreach my $filename (@ARGV) {
-        $filename = substr($filename, 0, -5) if ($filename =~ /\.pcap$/);
+    foreach my $pcap (@ARGV) {
+        my ($filename, $cmd) = captureCmd($pcap);
         if ($main::debug) {
-          print("../capture/capture --tests -c config.test.ini -n test -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix > $filename.test\n");
+          print("$cmd > $filename.test\n");
         }
-        system("../capture/capture --tests -c config.test.ini -n test -r $filename.pcap 2>&1 1>/dev/null | ./tests.pl --fix > $filename.test");
+        system("$cmd > $filename.test");
     }
 }
 ################################################################################